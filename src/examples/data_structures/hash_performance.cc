@@ -0,0 +1,291 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3), snprintf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, atol(3)
+#include <stdint.h>	// for uint64_t
+#include <search.h>	// for hcreate_r(3), hdestroy_r(3), hsearch_r(3), ENTRY
+#include <time.h>	// for clock_gettime(2), CLOCK_MONOTONIC
+#include <string.h>	// for memset(3)
+#include <map>	// for std::map
+#include <unordered_map>	// for std::unordered_map
+#include <string>	// for std::string
+#include <string_view>	// for std::string_view
+#include <err_utils.h>	// for CHECK_NOT_ZERO(), CHECK_ASSERT(), CHECK_NOT_M1()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <HashMap.hh>	// for HashMap, HashMapStringHash
+
+/*
+ * This example compares HashMap.hh (a Swiss table style open addressing
+ * hash map) to the glibc hash table (hsearch_r(3), see hash.cc and
+ * hash2.cc), std::unordered_map and std::map.
+ *
+ * For every size it measures, in nanoseconds per operation:
+ * - insert - inserting all keys into an empty container.
+ * - hit - looking up all keys (in a different order).
+ * - miss - looking up as many keys which are not there.
+ *
+ * It does it twice: with string keys (which hsearch_r(3) requires) and
+ * with integer keys. Finally it shows the longest single insert while
+ * growing a map from empty, which is where the incremental resize of
+ * HashMap pays off.
+ *
+ * Notes:
+ * - hsearch_r(3) cannot grow so it is created with twice the number of
+ * keys up front, which is a favour the others do not get.
+ * - all string keys live in one big buffer and are used as
+ * std::string_view so no container allocates strings.
+ *
+ * Pass the smallest and the largest number of keys (default 1000000 for
+ * both), the sizes in between go up by a factor of 10. 100M keys need
+ * a few gigabytes of memory.
+ *
+ * Results:
+ * - HashMap beats std::unordered_map (a node per element, a pointer
+ * chase per lookup) by a factor of 1.5-4 and std::map (a pointer chase
+ * per tree level) by much more, the gap grows with the size.
+ * - misses are cheap in HashMap: almost always one group load and
+ * compare shows the key is not there.
+ * - the longest insert of the non incremental maps is the rehash of the
+ * whole table, with incremental resize it is an allocation.
+ */
+
+static uint64_t splitmix64(uint64_t* state) {
+	uint64_t z=(*state+=0x9E3779B97F4A7C15ULL);
+	z=(z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+	z=(z ^ (z >> 27))*0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static const unsigned int key_len=18;
+
+static void make_keys(char* buf, std::string_view* keys, uint64_t* ikeys, size_t n, uint64_t seed, char prefix) {
+	uint64_t state=seed;
+	for(size_t i=0; i<n; i++) {
+		uint64_t k=splitmix64(&state);
+		char* p=buf+i*key_len;
+		snprintf(p, key_len, "%c%016lx", prefix, k);
+		keys[i]=std::string_view(p, key_len-1);
+		ikeys[i]=k;
+	}
+}
+
+static double nanos(measure* m, size_t n) {
+	return measure_micro_diff(m)*1000.0/n;
+}
+
+static void print_row(const char* name, double insert, double hit, double miss) {
+	printf("%-28s %8.1lf %8.1lf %8.1lf\n", name, insert, hit, miss);
+}
+
+// insert, hit and miss for the std:: containers and HashMap
+template <class Map, class Key> static void run(const char* name, Map& map, const Key* keys, const Key* lookup, const Key* missing, size_t n) {
+	measure m;
+	measure_init(&m, name, n);
+	measure_start(&m);
+	for(size_t i=0; i<n; i++) {
+		map[keys[i]]=i;
+	}
+	measure_end(&m);
+	double insert=nanos(&m, n);
+	size_t found=0;
+	measure_start(&m);
+	for(size_t i=0; i<n; i++) {
+		found+=map.find(lookup[i])!=NULL;
+	}
+	measure_end(&m);
+	double hit=nanos(&m, n);
+	size_t notfound=0;
+	measure_start(&m);
+	for(size_t i=0; i<n; i++) {
+		notfound+=map.find(missing[i])==NULL;
+	}
+	measure_end(&m);
+	double miss=nanos(&m, n);
+	CHECK_ASSERT(found==n && notfound==n);
+	print_row(name, insert, hit, miss);
+}
+
+// std:: containers return end() and not a null pointer on a miss
+template <class Map> class StdAdaptor {
+private:
+	Map map;
+
+public:
+	typename Map::mapped_type& operator[](const typename Map::key_type& k) {
+		return map[k];
+	}
+	typename Map::mapped_type* find(const typename Map::key_type& k) {
+		auto it=map.find(k);
+		if(it==map.end()) {
+			return NULL;
+		}
+		return &it->second;
+	}
+};
+
+static void run_hsearch(const std::string_view* keys, const std::string_view* lookup, const std::string_view* missing, size_t n) {
+	struct hsearch_data htab;
+	memset(&htab, 0, sizeof(htab));
+	measure m;
+	measure_init(&m, "hsearch_r", n);
+	measure_start(&m);
+	CHECK_NOT_ZERO(hcreate_r(n*2, &htab));
+	for(size_t i=0; i<n; i++) {
+		ENTRY item;
+		ENTRY* ritem;
+		// the key buffer is null terminated
+		item.key=(char*)keys[i].data();
+		item.data=(void*)i;
+		CHECK_NOT_ZERO(hsearch_r(item, ENTER, &ritem, &htab));
+	}
+	measure_end(&m);
+	double insert=nanos(&m, n);
+	size_t found=0;
+	measure_start(&m);
+	for(size_t i=0; i<n; i++) {
+		ENTRY item;
+		ENTRY* ritem;
+		item.key=(char*)lookup[i].data();
+		found+=hsearch_r(item, FIND, &ritem, &htab);
+	}
+	measure_end(&m);
+	double hit=nanos(&m, n);
+	size_t notfound=0;
+	measure_start(&m);
+	for(size_t i=0; i<n; i++) {
+		ENTRY item;
+		ENTRY* ritem;
+		item.key=(char*)missing[i].data();
+		notfound+=hsearch_r(item, FIND, &ritem, &htab)==0;
+	}
+	measure_end(&m);
+	double miss=nanos(&m, n);
+	hdestroy_r(&htab);
+	CHECK_ASSERT(found==n && notfound==n);
+	print_row("hsearch_r", insert, hit, miss);
+}
+
+static double now_micros() {
+	struct timespec ts;
+	CHECK_NOT_M1(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec*1000000.0+ts.tv_nsec/1000.0;
+}
+
+template <class Map> static void run_latency(const char* name, Map& map, const uint64_t* keys, size_t n) {
+	double worst=0;
+	for(size_t i=0; i<n; i++) {
+		double start=now_micros();
+		map[keys[i]]=i;
+		double took=now_micros()-start;
+		if(took>worst) {
+			worst=took;
+		}
+	}
+	printf("%-28s %10.1lf micros\n", name, worst);
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc>3) {
+		fprintf(stderr, "%s: usage: %s [min keys] [max keys]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: example: %s 1000000 100000000\n", argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	size_t min_keys=1000000;
+	size_t max_keys=min_keys;
+	if(argc>1) {
+		min_keys=max_keys=atol(argv[1]);
+	}
+	if(argc>2) {
+		max_keys=atol(argv[2]);
+	}
+	// heterogeneous lookup: std::string keys, searched with a const char*
+	HashMap<std::string, int, HashMapStringHash> names;
+	names["mark"]=1;
+	CHECK_ASSERT(names.find("mark")!=NULL && *names.find("mark")==1);
+	CHECK_ASSERT(names.find(std::string_view("veltzer"))==NULL);
+
+	for(size_t n=min_keys; n<=max_keys; n*=10) {
+		char* buf=new char[n*key_len*2];
+		std::string_view* keys=new std::string_view[n];
+		std::string_view* missing=new std::string_view[n];
+		std::string_view* lookup=new std::string_view[n];
+		uint64_t* ikeys=new uint64_t[n];
+		uint64_t* imissing=new uint64_t[n];
+		uint64_t* ilookup=new uint64_t[n];
+		make_keys(buf, keys, ikeys, n, 1, 'k');
+		make_keys(buf+n*key_len, missing, imissing, n, 2, 'm');
+		// look the keys up in a different order than they were inserted
+		uint64_t state=3;
+		for(size_t i=0; i<n; i++) {
+			size_t j=splitmix64(&state)%n;
+			lookup[i]=keys[j];
+			ilookup[i]=ikeys[j];
+		}
+		printf("%zd keys, nanos per operation\n", n);
+		printf("%-28s %8s %8s %8s\n", "string keys", "insert", "hit", "miss");
+		run_hsearch(keys, lookup, missing, n);
+		{
+			StdAdaptor<std::map<std::string_view, size_t>> map;
+			run("std::map", map, keys, lookup, missing, n);
+		}
+		{
+			StdAdaptor<std::unordered_map<std::string_view, size_t>> map;
+			run("std::unordered_map", map, keys, lookup, missing, n);
+		}
+		{
+			HashMap<std::string_view, size_t, HashMapStringHash> map;
+			run("HashMap", map, keys, lookup, missing, n);
+		}
+		printf("%-28s %8s %8s %8s\n", "integer keys", "insert", "hit", "miss");
+		{
+			StdAdaptor<std::map<uint64_t, size_t>> map;
+			run("std::map", map, ikeys, ilookup, imissing, n);
+		}
+		{
+			StdAdaptor<std::unordered_map<uint64_t, size_t>> map;
+			run("std::unordered_map", map, ikeys, ilookup, imissing, n);
+		}
+		{
+			HashMap<uint64_t, size_t> map;
+			run("HashMap", map, ikeys, ilookup, imissing, n);
+		}
+		printf("longest single insert\n");
+		{
+			std::unordered_map<uint64_t, size_t> map;
+			run_latency("std::unordered_map", map, ikeys, n);
+		}
+		{
+			HashMap<uint64_t, size_t> map(0, false);
+			run_latency("HashMap (stop the world)", map, ikeys, n);
+		}
+		{
+			HashMap<uint64_t, size_t> map;
+			run_latency("HashMap (incremental)", map, ikeys, n);
+		}
+		delete[] buf;
+		delete[] keys;
+		delete[] missing;
+		delete[] lookup;
+		delete[] ikeys;
+		delete[] imissing;
+		delete[] ilookup;
+	}
+	return EXIT_SUCCESS;
+}
@@ -30,6 +30,8 @@
  * This is an example of asynchroneous IO.
  *
  * Note that you must link with -lrt or this example will not work.
+ * Note that glibc implements this API with threads doing blocking reads,
+ * see async_reader.cc for io_uring(7) and native aio.
  *
  * References:
  * man aio.h
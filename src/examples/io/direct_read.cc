@@ -23,10 +23,9 @@
 #include <sys/types.h>	// for open(2), fstat(2)
 #include <sys/stat.h>	// for open(2), fstat(2)
 #include <fcntl.h>	// for open(2)
-#include <sys/ioctl.h>	// for ioctl(2)
 #include <unistd.h>	// for fstat(2)
-#include <linux/fs.h>	// for BLKSSZGET
 #include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_INT()
+#include <direct_utils.h>	// for direct_info, direct_info_get()
 #include <multiproc_utils.h>	// for my_system()
 
 /*
@@ -41,11 +40,12 @@
  * of the same. play around with the command line parameters to
  * see that.
  *
- * TODO:
- * - show the difference in performance between doing O_DIRECT and
- * not (maybe in another example and not this one?!?).
- * - use the BLKSSZGET ioctl(2) (see the code below) to get the block
- * size as well as the fstat(2) that is currently used.
+ * The alignment needed is found with direct_info_get() from
+ * direct_utils.h (statx(2) STATX_DIOALIGN, BLKSSZGET or sysfs). The
+ * st_blksize of fstat(2) is the preferred IO size of the file system
+ * and not the alignment, it just happens to be a multiple of it.
+ * The difference in performance between O_DIRECT and not is shown in
+ * direct_read_performance.cc.
  *
  * REFERENCES:
  * http://www.quora.com/Linux/How-can-I-bypass-the-OS-buffering-during-I-O-in-Linux
@@ -70,13 +70,19 @@ int main(int argc, char** argv, char** envp) {
 		flags|=O_DIRECT;
 	}
 	int fd=CHECK_NOT_M1(open(filename, flags));
-	// find out the block size
-	blksize_t block_size1;
-	CHECK_NOT_M1(ioctl(fd, BLKSSZGET, &block_size1));
-	printf("block_size1=%ld\n", block_size1);
+	// find out the alignment
+	direct_info info;
+	direct_info_get(fd, &info);
+	printf("alignment: memory %u, offset %u (from %s), logical block %u, physical block %u\n", info.mem_align, info.offset_align, info.source, info.logical_block, info.physical_block);
 	struct stat mystat;
 	CHECK_NOT_M1(fstat(fd, &mystat));
-	blksize_t block_size=mystat.st_blksize;
+	printf("st_blksize=%ld\n", mystat.st_blksize);
+	blksize_t block_size=info.mem_align;
+	if(block_size==0) {
+		fprintf(stderr, "%s: no direct I/O alignment for %s (from %s), O_DIRECT is not supported here\n", argv[0], filename, info.source);
+		CHECK_NOT_M1(close(fd));
+		return EXIT_FAILURE;
+	}
 	char* p;
 	if(use_malloc) {
 		p=(char*)malloc(size);
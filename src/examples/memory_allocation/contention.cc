@@ -19,9 +19,16 @@
 #include <firstinclude.h>
 #include <pthread.h>	// for pthread_create(3), pthread_join(3)
 #include <sched.h>	// for cpu_set_t, CPU_ZERO(3), CPU_SET(3)
-#include <unistd.h>	// for sysconf(3)
-#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1()
-#include <stdlib.h>	// for EXIT_FAILURE, EXIT_SUCCESS, malloc(3), free(3)
+#include <unistd.h>	// for sysconf(3), fork(2), _exit(2)
+#include <sys/types.h>	// for waitpid(2)
+#include <sys/wait.h>	// for waitpid(2), WIFEXITED(), WEXITSTATUS()
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1(), CHECK_ZERO(), CHECK_ASSERT(), CHECK_NOT_NULL()
+#include <stdlib.h>	// for EXIT_FAILURE, EXIT_SUCCESS, malloc(3), free(3), rand_r(3)
+#include <stdio.h>	// for fprintf(3), printf(3), fopen(3), fscanf(3), fclose(3), fflush(3)
+#include <string.h>	// for strcmp(3)
+#include <algorithm>	// for std::min()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <SlabAllocator.hh>	// for slab_malloc(), slab_free(), SlabAllocator
 
 /*
  * This example is designed to cause as much contention as possible
@@ -34,6 +41,27 @@
  * large (mmap) allocations:
  * strace -f -e trace=mmap,munmap ./src/examples/memory_allocation/contention.elf 1000000 100 1 4000 4096
  *
+ * You can also swap in the thread caching slab allocator from
+ * SlabAllocator.hh and compare it to malloc(3) as the number of threads
+ * grows. Allocations/sec and the resident memory after the run are
+ * reported for 1, 2, 4... and [max_threads] threads (default: the
+ * number of cpus). Every run is done in a child process of its own so
+ * the resident memory is that of one allocator and one run only:
+ * ./src/examples/memory_allocation/contention.elf 100000 100 1 64 16 both 8
+ *
+ * Results:
+ * - with a single small size the slab allocator does all of its work
+ * in the thread local magazines and is several times faster than glibc.
+ * - with mixed small sizes the two are close, glibc has per thread arenas
+ * and a per thread cache (tcache) of its own.
+ * - above 32K every slab allocation is an mmap(2)/munmap(2) pair and
+ * glibc, which reuses freed chunks, wins by an order of magnitude.
+ * - the slab allocator never gives slabs back so its resident memory is
+ * the high watermark of the run.
+ *
+ * Each thread uses rand_r(3) with its own seed, rand(3) takes a lock
+ * and would be the bottleneck instead of the allocator.
+ *
  * TODO:
  * - Add the possibility to do more than one allocation at a time (do them in batches).
  * - Analyze the results of this example.
@@ -57,9 +85,34 @@ static int num_allocations;
 static int size_min;
 static int size_max;
 static int mul;
+static bool use_slab;
+
+static inline void* do_alloc(size_t size) {
+	if(use_slab) {
+		return slab_malloc(size);
+	}
+	return malloc(size);
+}
+
+static inline void do_free(void* ptr) {
+	if(use_slab) {
+		slab_free(ptr);
+	} else {
+		free(ptr);
+	}
+}
+
+// current resident memory in KB
+static unsigned long rss_kb() {
+	FILE* f=CHECK_NOT_NULL_FILEP(fopen("/proc/self/statm", "r"));
+	unsigned long size, resident;
+	CHECK_ASSERT(fscanf(f, "%lu %lu", &size, &resident)==2);
+	CHECK_ZERO(fclose(f));
+	return resident*(CHECK_NOT_M1(sysconf(_SC_PAGESIZE))/1024);
+}
 
 void *worker(void *p) {
-	//int num=*(int *)p;
+	unsigned int seed=*(int *)p;
 	int diff=size_max-size_min;
 	for(int i=0;i<num_iterations;i++) {
 		void* buffers[num_allocations];
@@ -68,39 +121,27 @@ void *worker(void *p) {
 			if(diff==0) {
 				size_to_alloc=size_min*mul;
 			} else {
-				size_to_alloc=(size_min+rand()%diff)*mul;
+				size_to_alloc=(size_min+rand_r(&seed)%diff)*mul;
 			}
-			buffers[j]=CHECK_NOT_NULL(malloc(size_to_alloc));
+			buffers[j]=CHECK_NOT_NULL(do_alloc(size_to_alloc));
 		}
 		for(int j=0;j<num_allocations;j++) {
 			// free(3) has not return value
-			free(buffers[j]);
+			do_free(buffers[j]);
 		}
 	}
 	return NULL;
 }
 
-int main(int argc, char** argv, char** envp) {
-	if(argc!=6) {
-		fprintf(stderr, "argc is %d\n", argc);
-		fprintf(stderr, "%s: usage: %s [num_iterations] [num_allocations] [size_min] [size_max] [mul]\n", argv[0], argv[0]);
-		fprintf(stderr, "%s: example: %s 1000000 100 1 100 4096\n", argv[0], argv[0]);
-		return EXIT_FAILURE;
-	}
-	num_iterations=atoi(argv[1]);
-	num_allocations=atoi(argv[2]);
-	size_min=atoi(argv[3]);
-	size_max=atoi(argv[4]);
-	mul=atoi(argv[5]);
-
-	const int cpu_num=CHECK_NOT_M1(sysconf(_SC_NPROCESSORS_ONLN));
-	const int num_threads=cpu_num;
-
+static void run(int num_threads, int cpu_num, bool print_stats) {
 	pthread_t threads[num_threads];
 	pthread_attr_t attrs[num_threads];
 	cpu_set_t cpu_sets[num_threads];
 	int ids[num_threads];
 
+	measure m;
+	measure_init(&m, use_slab ? "slab" : "malloc", (long long)num_iterations*num_allocations*num_threads);
+	measure_start(&m);
 	for(int i=0; i<num_threads; i++) {
 		ids[i]=i;
 		CPU_ZERO(cpu_sets + i);
@@ -111,6 +152,70 @@ int main(int argc, char** argv, char** envp) {
 	}
 	for(int i=0; i<num_threads; i++) {
 		CHECK_ZERO_ERRNO(pthread_join(threads[i], NULL));
+		CHECK_ZERO_ERRNO(pthread_attr_destroy(attrs + i));
+	}
+	measure_end(&m);
+	double ops=(double)num_iterations*num_allocations*num_threads;
+	printf("threads %3d %-6s %12.0lf allocs/sec rss %8lu KB\n", num_threads, use_slab ? "slab" : "malloc", ops/measure_micro_diff(&m)*1000000.0, rss_kb());
+	if(print_stats) {
+		SlabAllocator::instance().print_stats();
+	}
+}
+
+// run in a fresh child so that neither allocator sees the heap of the other
+static void run_in_child(int num_threads, int cpu_num, bool print_stats) {
+	// or the child would print what is buffered again
+	CHECK_ZERO(fflush(stdout));
+	pid_t pid=CHECK_NOT_M1(fork());
+	if(pid==0) {
+		run(num_threads, cpu_num, print_stats);
+		CHECK_ZERO(fflush(stdout));
+		_exit(EXIT_SUCCESS);
+	}
+	int status;
+	CHECK_NOT_M1(waitpid(pid, &status, 0));
+	CHECK_ASSERT(WIFEXITED(status) && WEXITSTATUS(status)==EXIT_SUCCESS);
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc<6 || argc>8) {
+		fprintf(stderr, "argc is %d\n", argc);
+		fprintf(stderr, "%s: usage: %s [num_iterations] [num_allocations] [size_min] [size_max] [mul] [malloc|slab|both] [max_threads]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: example: %s 1000000 100 1 100 4096\n", argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	num_iterations=atoi(argv[1]);
+	num_allocations=atoi(argv[2]);
+	size_min=atoi(argv[3]);
+	size_max=atoi(argv[4]);
+	mul=atoi(argv[5]);
+	const char* allocator="malloc";
+	if(argc>6) {
+		allocator=argv[6];
+	}
+	bool do_malloc=strcmp(allocator, "malloc")==0 || strcmp(allocator, "both")==0;
+	bool do_slab=strcmp(allocator, "slab")==0 || strcmp(allocator, "both")==0;
+	if(!do_malloc && !do_slab) {
+		fprintf(stderr, "%s: unknown allocator %s\n", argv[0], allocator);
+		return EXIT_FAILURE;
+	}
+
+	const int cpu_num=CHECK_NOT_M1(sysconf(_SC_NPROCESSORS_ONLN));
+	int max_threads=cpu_num;
+	if(argc>7) {
+		max_threads=atoi(argv[7]);
+	}
+	// doubling, and max_threads last even if it is not a power of two
+	for(int num_threads=1; num_threads<=max_threads; num_threads=num_threads==max_threads ? max_threads+1 : std::min(num_threads*2, max_threads)) {
+		if(do_malloc) {
+			use_slab=false;
+			run_in_child(num_threads, cpu_num, false);
+		}
+		if(do_slab) {
+			use_slab=true;
+			// the statistics of the last run
+			run_in_child(num_threads, cpu_num, num_threads==max_threads);
+		}
 	}
 	return EXIT_SUCCESS;
 }
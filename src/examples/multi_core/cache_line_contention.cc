@@ -26,6 +26,7 @@
 #include <trace_utils.h>// for INFO()
 #include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1(), CHECK_ZERO()
 #include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_print()
+#include <CacheLine.hh>	// for Padded, cache_line_check()
 
 /*
  * This demo shows the difference in speed of running two threads using the same cache line
@@ -41,6 +42,9 @@
  * The solution is either to attach volatile to both the 'shared' and 'nonshared' members
  * (see below) or to use the 'td->XXXXXXXXX[td->num]+=1;' notation used below (the compiler
  * does not know what 'td->num' is and so actually writes the data.
+ * - type 2 does the same as type 1 but with an array of Padded<int> from
+ * CacheLine.hh allocated with plain new[]. One allocation instead of one
+ * per thread and no cache line size lookup at run time.
  *
  * EXTRA_LINK_FLAGS=-lpthread
  */
@@ -51,6 +55,7 @@ typedef struct _thread_data {
 	unsigned long long attempts;
 	int* shared;
 	int* nonshared;
+	Padded<int>* padded;
 	int usleep_interval;
 } thread_data;
 
@@ -68,6 +73,13 @@ static void *nonshared_worker(void* p) {
 	}
 	return NULL;
 }
+static void *padded_worker(void* p) {
+	thread_data* td=(thread_data*)p;
+	for(unsigned long long i=0; i<td->attempts; i++) {
+		td->padded[td->num].get()+=1;
+	}
+	return NULL;
+}
 static void *observer(void *p) {
 	thread_data* td=(thread_data*)p;
 	INFO("start thread %d, running on core %d", td->num, sched_getcpu());
@@ -115,6 +127,7 @@ static int parse_arguments(int& argc, char** argv, bool& doObserver, int& type,
 		fprintf(stderr, "%s: select type of threads using --type=[argument]\n", argv[0]);
 		fprintf(stderr, "%s:\ttype=0 means shared thread (default)\n", argv[0]);
 		fprintf(stderr, "%s:\ttype=1 means nonshared threads\n", argv[0]);
+		fprintf(stderr, "%s:\ttype=2 means padded threads\n", argv[0]);
 		fprintf(stderr, "%s: select attempts using --attempts=[argument]\n", argv[0]);
 		fprintf(stderr, "%s: for example: --type=0 --attempts=1000000 0 1 2 3\n", argv[0]);
 		exit(EXIT_FAILURE);
@@ -152,6 +165,8 @@ int main(int argc, char** argv, char** envp) {
 	void** rets=new void*[thread_num];
 
 	int *shared=(int*)malloc_one_cache_line();
+	Padded<int>* padded=new Padded<int>[thread_num];
+	cache_line_check();
 
 	measure m;
 	measure_init(&m, "single attempt", attempts);
@@ -161,6 +176,7 @@ int main(int argc, char** argv, char** envp) {
 		data[i].attempts=attempts;
 		data[i].nonshared=(int*)malloc_one_cache_line();
 		data[i].shared=shared;
+		data[i].padded=padded;
 		data[i].usleep_interval=usleep_interval;
 		CPU_ZERO(cpu_sets+i);
 		CPU_SET(atoi(argv[optind+i]), cpu_sets+i);
@@ -176,6 +192,9 @@ int main(int argc, char** argv, char** envp) {
 			case 1:
 				CHECK_ZERO_ERRNO(pthread_create(threads + i, attrs + i, nonshared_worker, data + i));
 				break;
+			case 2:
+				CHECK_ZERO_ERRNO(pthread_create(threads + i, attrs + i, padded_worker, data + i));
+				break;
 			default:
 				fprintf(stderr, "bad type of thread (%d)\n", type);
 				exit(EXIT_FAILURE);
@@ -29,6 +29,8 @@
  * 1. using a union.
  * 2. explicit padding.
  * 3. __attribute__((aligned (alignment)))
+ * For a reusable version which does not need the getconf(1) trick below
+ * see Padded<T> in CacheLine.hh.
  *
  * This also shows that the __attribute__((aligned (LEVEL2_CACHE_LINESIZE)))
  * will cause the structure to always be aligned by the compiler when passing
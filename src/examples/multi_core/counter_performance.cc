@@ -0,0 +1,161 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, atoi(3), atoll(3)
+#include <pthread.h>	// for pthread_t, pthread_create(3), pthread_join(3)
+#include <atomic>	// for std::atomic
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_ASSERT()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <cpu_set_utils.h>	// for cpu_set_allowed_count()
+#include <CacheLine.hh>	// for Padded, PerThread, PerCpu, cache_line_check()
+
+/*
+ * This example counts events from many threads in different ways
+ * and shows the cost of sharing (true and false):
+ * - shared - one atomic counter for everyone (true sharing).
+ * - adjacent - an array of counters, one per thread, next to each other
+ * (false sharing: no data is shared but cache lines are).
+ * - PerThread - one counter per thread, each on its own cache line.
+ * - PerCpu - one atomic counter per cpu, each on its own cache line.
+ *
+ * All counters are updated with relaxed atomic adds so that the only
+ * difference is where they live.
+ *
+ * Pass the maximum number of threads (default is twice the number of cpus)
+ * and the number of increments per thread.
+ *
+ * EXTRA_LINK_FLAGS=-lpthread
+ */
+
+typedef enum _kind {
+	KIND_SHARED,
+	KIND_ADJACENT,
+	KIND_PER_THREAD,
+	KIND_PER_CPU,
+} kind;
+
+static const char* kind_names[]={
+	"shared",
+	"adjacent",
+	"PerThread",
+	"PerCpu",
+};
+
+typedef struct _thread_data {
+	kind k;
+	unsigned int num;
+	unsigned long long attempts;
+	std::atomic<unsigned long long>* shared;
+	std::atomic<unsigned long long>* adjacent;
+	PerThread<std::atomic<unsigned long long>>* per_thread;
+	PerCpu<std::atomic<unsigned long long>>* per_cpu;
+} thread_data;
+
+static void* worker(void* p) {
+	thread_data* td=(thread_data*)p;
+	switch(td->k) {
+	case KIND_SHARED:
+		for(unsigned long long i=0; i<td->attempts; i++) {
+			td->shared->fetch_add(1, std::memory_order_relaxed);
+		}
+		break;
+	case KIND_ADJACENT:
+		for(unsigned long long i=0; i<td->attempts; i++) {
+			td->adjacent[td->num].fetch_add(1, std::memory_order_relaxed);
+		}
+		break;
+	case KIND_PER_THREAD: {
+		std::atomic<unsigned long long>& c=td->per_thread->local();
+		for(unsigned long long i=0; i<td->attempts; i++) {
+			c.fetch_add(1, std::memory_order_relaxed);
+		}
+		break;
+	}
+	case KIND_PER_CPU:
+		for(unsigned long long i=0; i<td->attempts; i++) {
+			td->per_cpu->local().fetch_add(1, std::memory_order_relaxed);
+		}
+		break;
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc>3) {
+		fprintf(stderr, "%s: usage: %s [max threads] [attempts]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: example: %s 8 10000000\n", argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	unsigned int max_threads=2*cpu_set_allowed_count();
+	unsigned long long attempts=10000000;
+	if(argc>1) {
+		max_threads=atoi(argv[1]);
+	}
+	if(argc>2) {
+		attempts=atoll(argv[2]);
+	}
+	cache_line_check();
+	printf("cache line size is %zd (compile time) %zd (run time)\n", CACHE_LINE_SIZE, cache_line_size());
+	for(unsigned int thread_num=1; thread_num<=max_threads; thread_num*=2) {
+		for(unsigned int k=KIND_SHARED; k<=KIND_PER_CPU; k++) {
+			std::atomic<unsigned long long> shared(0);
+			std::atomic<unsigned long long>* adjacent=new std::atomic<unsigned long long>[thread_num]();
+			// a fresh PerThread per run, the threads of the last run gave their ids back
+			PerThread<std::atomic<unsigned long long>> per_thread(max_threads);
+			PerCpu<std::atomic<unsigned long long>> per_cpu;
+			pthread_t* threads=new pthread_t[thread_num];
+			thread_data* data=new thread_data[thread_num];
+			measure m;
+			measure_init(&m, kind_names[k], attempts*thread_num);
+			measure_start(&m);
+			for(unsigned int i=0; i<thread_num; i++) {
+				data[i].k=(kind)k;
+				data[i].num=i;
+				data[i].attempts=attempts;
+				data[i].shared=&shared;
+				data[i].adjacent=adjacent;
+				data[i].per_thread=&per_thread;
+				data[i].per_cpu=&per_cpu;
+				CHECK_ZERO_ERRNO(pthread_create(threads+i, NULL, worker, data+i));
+			}
+			for(unsigned int i=0; i<thread_num; i++) {
+				CHECK_ZERO_ERRNO(pthread_join(threads[i], NULL));
+			}
+			measure_end(&m);
+			// sum up and make sure we did not lose any counts
+			unsigned long long sum=shared.load();
+			for(unsigned int i=0; i<thread_num; i++) {
+				sum+=adjacent[i].load();
+			}
+			per_thread.for_each([&sum](std::atomic<unsigned long long>& c) {
+				sum+=c.load();
+			});
+			per_cpu.for_each([&sum](std::atomic<unsigned long long>& c) {
+				sum+=c.load();
+			});
+			CHECK_ASSERT(sum==attempts*thread_num);
+			printf("threads %3u %-10s %8.3lf nanos per increment\n", thread_num, kind_names[k], measure_micro_diff(&m)*1000.0/(attempts*thread_num));
+			delete[] threads;
+			delete[] data;
+			delete[] adjacent;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, atoi(3), exit(3)
+#include <pthread.h>	// for pthread_t, pthread_attr_t, pthread_create(3), pthread_join(3), pthread_attr_setaffinity_np(3)
+#include <sched.h>	// for cpu_set_t, CPU_ZERO(3), CPU_SET(3)
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_ASSERT()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <Exchanger.hh>	// for Exchanger
+
+/*
+ * This example measures how many exchanges per second two threads can
+ * do through the lock free Exchanger in Exchanger.hh.
+ *
+ * Pass two cores to run on. Pass the same core twice to see what happens
+ * when the two threads share a core: spinning is useless then since the
+ * other side cannot arrive until we are descheduled, and everything
+ * depends on how fast we park.
+ * Each run is done with several spin limits, 0 means "always park".
+ *
+ * Results:
+ * on the same core spinning only burns the time slice of the other side:
+ * about 500K exchanges/sec with no spin down to about 14K with 4096 spins.
+ * On different cores the spin is what avoids the context switches.
+ *
+ * For example:
+ * ./exchanger_performance.elf 0 0
+ * ./exchanger_performance.elf 0 1
+ *
+ * EXTRA_LINK_FLAGS=-lpthread
+ */
+
+typedef struct _thread_data {
+	Exchanger<unsigned long long>* e;
+	unsigned long long attempts;
+	unsigned long long base;
+} thread_data;
+
+static void* worker(void* p) {
+	thread_data* td=(thread_data*)p;
+	for(unsigned long long i=0; i<td->attempts; i++) {
+		unsigned long long val=td->base+i;
+		td->e->exchange(val);
+		// we must get the i'th value of the other side
+		CHECK_ASSERT(val==(td->base^1)+i);
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc!=3) {
+		fprintf(stderr, "%s: usage: %s [core] [core]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: example: %s 0 1\n", argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	const unsigned long long attempts=100000;
+	const unsigned int spins[]={0, 1 << 6, 1 << 10, 1 << 12};
+	for(unsigned int s=0; s<sizeof(spins)/sizeof(spins[0]); s++) {
+		Exchanger<unsigned long long> e(spins[s]);
+		pthread_t threads[2];
+		pthread_attr_t attrs[2];
+		cpu_set_t cpu_sets[2];
+		thread_data data[2];
+		measure m;
+		measure_init(&m, "exchange", attempts);
+		measure_start(&m);
+		for(int i=0; i<2; i++) {
+			data[i].e=&e;
+			data[i].attempts=attempts;
+			data[i].base=i;
+			CPU_ZERO(cpu_sets+i);
+			CPU_SET(atoi(argv[1+i]), cpu_sets+i);
+			CHECK_ZERO_ERRNO(pthread_attr_init(attrs+i));
+			CHECK_ZERO_ERRNO(pthread_attr_setaffinity_np(attrs+i, sizeof(cpu_set_t), cpu_sets+i));
+			CHECK_ZERO_ERRNO(pthread_create(threads+i, attrs+i, worker, data+i));
+		}
+		for(int i=0; i<2; i++) {
+			CHECK_ZERO_ERRNO(pthread_join(threads[i], NULL));
+			CHECK_ZERO_ERRNO(pthread_attr_destroy(attrs+i));
+		}
+		measure_end(&m);
+		double secs=measure_micro_diff(&m)/1000000.0;
+		printf("cores %s,%s spin %6u: %12.0lf exchanges/sec\n", argv[1], argv[2], spins[s], attempts/secs);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <omp.h>// for openmp pragmas and functions
+#include <stdlib.h>	// for random(3), atoi(3), EXIT_SUCCESS, EXIT_FAILURE
+#include <string.h>	// for memcpy(3)
+#include <err_utils.h>	// for CHECK_ASSERT()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <WorkStealingPool.hh>	// for WorkStealingPool
+
+/*
+ * The merge sort from merge_sort.cc ported to the work stealing pool
+ * and compared against the OpenMP version and a serial version.
+ *
+ * - the OpenMP version uses 'parallel sections' like merge_sort.cc. By
+ * default OpenMP does not do nested parallelism so only the top level
+ * split runs in parallel, the rest is serial inside two threads.
+ * - the work stealing version spawns both halves at every level and lets
+ * idle workers steal the big halves from the top of the busy deques.
+ * - all versions sort serially below a cutoff since spawning a task to
+ * sort 10 integers costs more than sorting them.
+ *
+ * Pass the number of elements (default 10000000).
+ *
+ * EXTRA_COMPILE_FLAGS=-fopenmp
+ * EXTRA_LINK_FLAGS=-fopenmp -lpthread
+ */
+
+static const unsigned int cutoff=8192;
+
+static void merge(int* arr, unsigned int from, unsigned int mid, unsigned int to, int* scratch) {
+	unsigned int length=to-from;
+	memcpy(scratch+from, arr+from, length*sizeof(int));
+	unsigned int i=mid;
+	unsigned int j=from;
+	unsigned int target=from;
+	while(target<to) {
+		if(i<to && j<mid) {
+			if(scratch[i]<scratch[j]) {
+				arr[target]=scratch[i];
+				i++;
+			} else {
+				arr[target]=scratch[j];
+				j++;
+			}
+		} else {
+			if(i<to) {
+				arr[target]=scratch[i];
+				i++;
+			} else {
+				arr[target]=scratch[j];
+				j++;
+			}
+		}
+		target++;
+	}
+}
+
+static void mergesort_serial(int* arr, unsigned int from, unsigned int to, int* scratch) {
+	if(from+1>=to) {
+		return;
+	}
+	unsigned int mid=(from+to)/2;
+	mergesort_serial(arr, from, mid, scratch);
+	mergesort_serial(arr, mid, to, scratch);
+	merge(arr, from, mid, to, scratch);
+}
+
+static void mergesort_omp(int* arr, unsigned int from, unsigned int to, int* scratch) {
+	if(to-from<cutoff) {
+		mergesort_serial(arr, from, to, scratch);
+		return;
+	}
+	unsigned int mid=(from+to)/2;
+	#pragma omp parallel sections
+	{
+		#pragma omp section
+		mergesort_omp(arr, from, mid, scratch);
+		#pragma omp section
+		mergesort_omp(arr, mid, to, scratch);
+	}
+	merge(arr, from, mid, to, scratch);
+}
+
+static void mergesort_ws(WorkStealingPool& pool, int* arr, unsigned int from, unsigned int to, int* scratch) {
+	if(to-from<cutoff) {
+		mergesort_serial(arr, from, to, scratch);
+		return;
+	}
+	unsigned int mid=(from+to)/2;
+	WorkStealingPool::TaskGroup g;
+	pool.spawn(g, [&pool, arr, from, mid, scratch] {
+		mergesort_ws(pool, arr, from, mid, scratch);
+	});
+	// do the second half ourselves instead of spawning and sleeping
+	mergesort_ws(pool, arr, mid, to, scratch);
+	pool.sync(g);
+	merge(arr, from, mid, to, scratch);
+}
+
+static void check_sorted(int* arr, unsigned int size) {
+	for(unsigned int i=1; i<size; i++) {
+		CHECK_ASSERT(arr[i-1]<=arr[i]);
+	}
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc>2) {
+		fprintf(stderr, "%s: usage: %s [size]\n", argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	unsigned int size=10000000;
+	if(argc==2) {
+		size=atoi(argv[1]);
+	}
+	int* orig=new int[size];
+	for(unsigned int i=0; i<size; i++) {
+		orig[i]=random();
+	}
+	int* arr=new int[size];
+	int* scratch=new int[size];
+	WorkStealingPool pool;
+	printf("sorting %u elements, %u workers, %d openmp threads\n", size, pool.size(), omp_get_max_threads());
+	const char* names[]={"serial", "openmp", "work stealing"};
+	for(unsigned int type=0; type<3; type++) {
+		memcpy(arr, orig, size*sizeof(int));
+		measure m;
+		measure_init(&m, names[type], 1);
+		measure_start(&m);
+		switch(type) {
+		case 0:
+			mergesort_serial(arr, 0, size, scratch);
+			break;
+		case 1:
+			mergesort_omp(arr, 0, size, scratch);
+			break;
+		case 2:
+			pool.run([&pool, arr, size, scratch] {
+				mergesort_ws(pool, arr, 0, size, scratch);
+			});
+			break;
+		}
+		measure_end(&m);
+		check_sorted(arr, size);
+		printf("%-14s %10.0lf micros\n", names[type], measure_micro_diff(&m));
+	}
+	pool.print_stats();
+	delete[] orig;
+	delete[] arr;
+	delete[] scratch;
+	return EXIT_SUCCESS;
+}
@@ -19,6 +19,11 @@
 #include <firstinclude.h>
 #include <stdlib.h>	// for malloc(3), EXIT_SUCCESS, EXIT_FAILURE, rand(3), atoi(3)
 #include <stdio.h>	// for printf(3), fprintf(3), stderr
+#include <string.h>	// for strcmp(3)
+#include <err_utils.h>	// for CHECK_NOT_NULL()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <hugepage_utils.h>	// for hugepage_buf, hugepage_alloc(), hugepage_free(), hugepage_kind_name(), hugepage_thp_kb()
+#include <perf_utils.h>	// for perf_counter_open_dtlb_misses(), perf_counter_start(), perf_counter_stop(), perf_counter_close()
 
 /*
  * This is a sample which misses the cache on purpose...
@@ -32,27 +37,73 @@
  * generating.
  * make the value bigger to see more misses...
  *
+ * The optional third argument selects where the memory comes from:
+ * - malloc - malloc(3), regular 4K pages (the default).
+ * - huge - huge pages if possible (hugetlb 2M, then THP, then regular pages).
+ * - huge1g - like huge but try 1G hugetlb pages first.
+ * The random access loop is timed and its dTLB misses counted, compare:
+ * ./src/examples/performance/cache_misser.elf 1073741824 10000000 malloc
+ * ./src/examples/performance/cache_misser.elf 1073741824 10000000 huge
+ * With huge pages most of the dTLB misses (and page walks) are gone.
+ *
  * TODO:
  * - allocate the memory using mmap(2) and MAP_POPULATE before starting the loop in * order to get number of cache misses lower.
  */
 
 int main(int argc, char** argv, char** envp) {
-	if(argc!=3) {
-		fprintf(stderr, "%s: usage: %s [size] [times]\n", argv[0], argv[0]);
+	if(argc!=3 && argc!=4) {
+		fprintf(stderr, "%s: usage: %s [size] [times] [malloc|huge|huge1g]\n", argv[0], argv[0]);
 		return EXIT_FAILURE;
 	}
 	printf("RAND_MAX is %d\n", RAND_MAX);
 	unsigned int size=atoi(argv[1]);
 	unsigned int times=atoi(argv[2]);
-	char* p=(char*)malloc(size);
+	const char* mode="malloc";
+	if(argc==4) {
+		mode=argv[3];
+	}
+	char* p;
+	hugepage_buf b;
+	bool use_malloc=strcmp(mode, "malloc")==0;
+	if(use_malloc) {
+		p=(char*)CHECK_NOT_NULL(malloc(size));
+		printf("memory from malloc(3)\n");
+	} else if(strcmp(mode, "huge")==0 || strcmp(mode, "huge1g")==0) {
+		hugepage_alloc(&b, size, strcmp(mode, "huge1g")==0 ? HUGEPAGE_1G : HUGEPAGE_2M);
+		p=(char*)b.ptr;
+		printf("memory from %s\n", hugepage_kind_name(b.kind));
+	} else {
+		fprintf(stderr, "%s: unknown mode %s\n", argv[0], mode);
+		return EXIT_FAILURE;
+	}
 	for(unsigned int i=0; i<size; i++) {
 		p[i]=i%256;
 	}
+	if(!use_malloc && b.kind==HUGEPAGE_THP) {
+		printf("AnonHugePages is %ld KB\n", hugepage_thp_kb());
+	}
+	int fd=perf_counter_open_dtlb_misses();
+	measure m;
+	measure_init(&m, "random access", times);
+	perf_counter_start(fd);
+	measure_start(&m);
 	long long sum=0;
 	for(unsigned int i=0; i<times; i++) {
 		int pos=rand()%size;
 		sum+=p[pos];
 	}
+	measure_end(&m);
+	long long misses=perf_counter_stop(fd);
+	perf_counter_close(fd);
 	printf("sum is %lld\n", sum);
+	printf("%u random accesses took %.0lf micros\n", times, measure_micro_diff(&m));
+	if(misses!=-1) {
+		printf("dTLB load misses %lld\n", misses);
+	}
+	if(use_malloc) {
+		free(p);
+	} else {
+		hugepage_free(&b);
+	}
 	return EXIT_SUCCESS;
 }
@@ -25,6 +25,9 @@
 /**
  * This is an example of how to do min() and max() macros without branches.
  * Remember why branching is bad for performance? Because it hinders prediction.
+ * Note that min_b/max_b overflow when a-b does not fit in an int. See
+ * branchless_utils.h for versions which do not and branchless_filter.cc
+ * for the cost of mispredictions.
  *
  * References:
  * - https://www.reddit.com/r/learnprogramming/comments/u6iq0/minmax_without_branching_c/
@@ -0,0 +1,309 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS
+#include <stdint.h>	// for uint64_t
+#include <unistd.h>	// for read(2), write(2), close(2)
+#include <sys/eventfd.h>// for eventfd(2)
+#include <pthread.h>	// for pthread_create(3), pthread_join(3), pthread_mutex_*, pthread_cond_*
+#include <time.h>	// for clock_gettime(2)
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1(), CHECK_INT()
+#include <us_helper.h>	// for no_params(), ARRAY_SIZEOF()
+#include <timespec_utils.h>	// for timespec_diff_nano()
+#include <futex_utils.h>// for futex_cond_t, futex_mutex_t, futex_event_t, futex_cond_*(), futex_event_*()
+
+/*
+ * This example compares the futex based primitives in futex_utils.h
+ * to pthread conditions and to eventfd(2) based signaling (which is
+ * what the condition_using_eventfd exercise uses).
+ *
+ * Three things are measured:
+ * - the cost of signaling when nobody is waiting. eventfd always pays
+ * a write(2). pthread and futex conditions do not enter the kernel.
+ * - the round trip latency of a ping/pong between two threads.
+ * - the cost of a broadcast to 1-64 waiters, from the broadcast until
+ * all waiters got the mutex and left. The futex condition requeues the
+ * waiters onto the mutex, the "wakeall" variant wakes them all at once
+ * and lets them fight over the mutex.
+ *
+ * EXTRA_LINK_FLAGS=-lpthread
+ */
+
+typedef enum _kind {
+	KIND_EVENTFD,
+	KIND_PTHREAD,
+	KIND_FUTEX,
+	KIND_FUTEX_WAKEALL,
+} kind;
+
+static const char* kind_names[]={
+	"eventfd",
+	"pthread",
+	"futex",
+	"futex (wakeall)",
+};
+
+static inline unsigned long long now_nanos() {
+	struct timespec t;
+	CHECK_NOT_M1(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec*NSEC_PER_SEC+t.tv_nsec;
+}
+
+/*
+ * signal with nobody waiting
+ */
+static void signal_no_waiters(unsigned int loop) {
+	int efd=CHECK_NOT_M1(eventfd(0, EFD_NONBLOCK));
+	pthread_cond_t pcond=PTHREAD_COND_INITIALIZER;
+	futex_cond_t fcond;
+	futex_cond_init(&fcond);
+	for(unsigned int k=KIND_EVENTFD; k<=KIND_FUTEX; k++) {
+		unsigned long long start=now_nanos();
+		for(unsigned int i=0; i<loop; i++) {
+			switch(k) {
+			case KIND_EVENTFD: {
+				uint64_t u=1;
+				CHECK_INT(write(efd, &u, sizeof(uint64_t)), sizeof(uint64_t));
+				break;
+			}
+			case KIND_PTHREAD:
+				CHECK_ZERO_ERRNO(pthread_cond_signal(&pcond));
+				break;
+			case KIND_FUTEX:
+				futex_cond_signal(&fcond);
+				break;
+			}
+		}
+		unsigned long long end=now_nanos();
+		printf("signal (no waiters) %-16s %8.2lf nanos\n", kind_names[k], (double)(end-start)/loop);
+		if(k==KIND_EVENTFD) {
+			// drain the counter so that it never overflows
+			uint64_t u;
+			CHECK_INT(read(efd, &u, sizeof(uint64_t)), sizeof(uint64_t));
+		}
+	}
+	CHECK_ZERO_ERRNO(pthread_cond_destroy(&pcond));
+	CHECK_NOT_M1(close(efd));
+}
+
+/*
+ * ping pong between two threads
+ */
+typedef struct _pingpong {
+	kind k;
+	unsigned int loop;
+	int efd[2];
+	pthread_mutex_t pmutex;
+	pthread_cond_t pcond[2];
+	int pflag[2];
+	futex_event_t fevent[2];
+} pingpong;
+
+static inline void pingpong_post(pingpong* pp, int i) {
+	switch(pp->k) {
+	case KIND_EVENTFD: {
+		uint64_t u=1;
+		CHECK_INT(write(pp->efd[i], &u, sizeof(uint64_t)), sizeof(uint64_t));
+		break;
+	}
+	case KIND_PTHREAD:
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&pp->pmutex));
+		pp->pflag[i]=1;
+		CHECK_ZERO_ERRNO(pthread_cond_signal(pp->pcond+i));
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&pp->pmutex));
+		break;
+	default:
+		futex_event_set(pp->fevent+i);
+		break;
+	}
+}
+
+static inline void pingpong_wait(pingpong* pp, int i) {
+	switch(pp->k) {
+	case KIND_EVENTFD: {
+		uint64_t u;
+		CHECK_INT(read(pp->efd[i], &u, sizeof(uint64_t)), sizeof(uint64_t));
+		break;
+	}
+	case KIND_PTHREAD:
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&pp->pmutex));
+		while(!pp->pflag[i]) {
+			CHECK_ZERO_ERRNO(pthread_cond_wait(pp->pcond+i, &pp->pmutex));
+		}
+		pp->pflag[i]=0;
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&pp->pmutex));
+		break;
+	default:
+		futex_event_wait(pp->fevent+i);
+		break;
+	}
+}
+
+static void* pong(void* p) {
+	pingpong* pp=(pingpong*)p;
+	for(unsigned int i=0; i<pp->loop; i++) {
+		pingpong_wait(pp, 0);
+		pingpong_post(pp, 1);
+	}
+	return NULL;
+}
+
+static void round_trip(unsigned int loop) {
+	for(unsigned int k=KIND_EVENTFD; k<=KIND_FUTEX; k++) {
+		pingpong pp;
+		pp.k=(kind)k;
+		pp.loop=loop;
+		CHECK_ZERO_ERRNO(pthread_mutex_init(&pp.pmutex, NULL));
+		for(int i=0; i<2; i++) {
+			pp.efd[i]=CHECK_NOT_M1(eventfd(0, 0));
+			CHECK_ZERO_ERRNO(pthread_cond_init(pp.pcond+i, NULL));
+			pp.pflag[i]=0;
+			futex_event_init(pp.fevent+i, 0, 0);
+		}
+		pthread_t thread;
+		CHECK_ZERO_ERRNO(pthread_create(&thread, NULL, pong, &pp));
+		unsigned long long start=now_nanos();
+		for(unsigned int i=0; i<loop; i++) {
+			pingpong_post(&pp, 0);
+			pingpong_wait(&pp, 1);
+		}
+		unsigned long long end=now_nanos();
+		CHECK_ZERO_ERRNO(pthread_join(thread, NULL));
+		printf("round trip %-16s %8.2lf nanos\n", kind_names[k], (double)(end-start)/loop);
+		for(int i=0; i<2; i++) {
+			CHECK_NOT_M1(close(pp.efd[i]));
+			CHECK_ZERO_ERRNO(pthread_cond_destroy(pp.pcond+i));
+		}
+		CHECK_ZERO_ERRNO(pthread_mutex_destroy(&pp.pmutex));
+	}
+}
+
+/*
+ * broadcast to many waiters
+ */
+typedef struct _bcast {
+	kind k;
+	unsigned int rounds;
+	pthread_mutex_t pmutex;
+	pthread_cond_t pcond;
+	futex_mutex_t fmutex;
+	futex_cond_t fcond;
+	int gen;
+	int ready;
+	int done;
+} bcast;
+
+static inline void bcast_lock(bcast* b) {
+	if(b->k==KIND_PTHREAD) {
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&b->pmutex));
+	} else {
+		futex_mutex_lock(&b->fmutex);
+	}
+}
+
+static inline void bcast_unlock(bcast* b) {
+	if(b->k==KIND_PTHREAD) {
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&b->pmutex));
+	} else {
+		futex_mutex_unlock(&b->fmutex);
+	}
+}
+
+static void* bcast_waiter(void* p) {
+	bcast* b=(bcast*)p;
+	for(unsigned int r=0; r<b->rounds; r++) {
+		bcast_lock(b);
+		int gen=b->gen;
+		__atomic_add_fetch(&b->ready, 1, __ATOMIC_SEQ_CST);
+		while(gen==b->gen) {
+			if(b->k==KIND_PTHREAD) {
+				CHECK_ZERO_ERRNO(pthread_cond_wait(&b->pcond, &b->pmutex));
+			} else {
+				futex_cond_wait(&b->fcond, &b->fmutex);
+			}
+		}
+		bcast_unlock(b);
+		__atomic_add_fetch(&b->done, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+static void broadcast(unsigned int rounds) {
+	const int waiters_arr[]={1, 2, 4, 8, 16, 32, 64};
+	for(unsigned int w=0; w<ARRAY_SIZEOF(waiters_arr); w++) {
+		const int waiters=waiters_arr[w];
+		for(unsigned int k=KIND_PTHREAD; k<=KIND_FUTEX_WAKEALL; k++) {
+			bcast b;
+			b.k=(kind)k;
+			b.rounds=rounds;
+			CHECK_ZERO_ERRNO(pthread_mutex_init(&b.pmutex, NULL));
+			CHECK_ZERO_ERRNO(pthread_cond_init(&b.pcond, NULL));
+			futex_mutex_init(&b.fmutex);
+			futex_cond_init(&b.fcond);
+			b.gen=0;
+			b.ready=0;
+			b.done=0;
+			pthread_t* threads=new pthread_t[waiters];
+			for(int i=0; i<waiters; i++) {
+				CHECK_ZERO_ERRNO(pthread_create(threads+i, NULL, bcast_waiter, &b));
+			}
+			unsigned long long sum=0;
+			for(unsigned int r=0; r<rounds; r++) {
+				while(__atomic_load_n(&b.ready, __ATOMIC_SEQ_CST)!=waiters) {
+				}
+				unsigned long long start=now_nanos();
+				bcast_lock(&b);
+				b.ready=0;
+				b.done=0;
+				b.gen++;
+				switch(k) {
+				case KIND_PTHREAD:
+					CHECK_ZERO_ERRNO(pthread_cond_broadcast(&b.pcond));
+					break;
+				case KIND_FUTEX:
+					futex_cond_broadcast(&b.fcond, &b.fmutex);
+					break;
+				case KIND_FUTEX_WAKEALL:
+					futex_cond_broadcast_wakeall(&b.fcond);
+					break;
+				}
+				bcast_unlock(&b);
+				while(__atomic_load_n(&b.done, __ATOMIC_SEQ_CST)!=waiters) {
+				}
+				sum+=now_nanos()-start;
+			}
+			for(int i=0; i<waiters; i++) {
+				CHECK_ZERO_ERRNO(pthread_join(threads[i], NULL));
+			}
+			delete[] threads;
+			printf("broadcast waiters=%2d %-16s %10.2lf nanos\n", waiters, kind_names[k], (double)sum/rounds);
+			CHECK_ZERO_ERRNO(pthread_cond_destroy(&b.pcond));
+			CHECK_ZERO_ERRNO(pthread_mutex_destroy(&b.pmutex));
+		}
+	}
+}
+
+int main(int argc, char** argv, char** envp) {
+	no_params(argc, argv);
+	signal_no_waiters(1000000);
+	round_trip(100000);
+	broadcast(200);
+	return EXIT_SUCCESS;
+}
@@ -35,6 +35,9 @@
  * functions (malloc,realloc,memalign) and would throw exceptions or returns nulls
  * if these are called after a certain stage.
  *
+ * Note that the malloc hooks were removed in glibc 2.34. rt_utils.h
+ * (see memory_reservoir.cc) does the same by interposing malloc(3).
+ *
  * EXTRA_COMPILE_FLAGS=-Wno-error=deprecated-declarations -Wno-deprecated-declarations
  */
 
@@ -0,0 +1,121 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, malloc(3), free(3)
+#include <string.h>	// for memset(3), strcmp(3)
+#include <pthread.h>	// for pthread_t, pthread_create(3), pthread_join(3)
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_NULL()
+#define RT_MALLOC_HOOK
+#include <rt_utils.h>	// for rt_memory_init(), rt_pthread_create(), rt_reservoir_alloc(), rt_malloc_lock(), rt_faults_*()
+
+/*
+ * This example shows the memory part of a real time application
+ * setup using rt_utils.h and proves that the steady state takes no
+ * page faults and calls no malloc(3).
+ *
+ * A naive thread and a real time thread do the same "cycles" of work:
+ * they use a 1MB buffer and some (deep) stack. The naive thread mallocs its
+ * buffer in the cycle and its stack is not prefaulted. The real time
+ * thread is started with rt_pthread_create() (stack prefaulted), gets its
+ * buffer from the reservoir during init and runs its cycles after
+ * rt_malloc_lock().
+ *
+ * Run it with 'trap' as an argument and add a malloc(3) to the real time
+ * cycle to see the process abort.
+ *
+ * Notes:
+ * - for mlockall(2) to work run as root or raise 'ulimit -l'.
+ *
+ * EXTRA_LINK_FLAGS=-lpthread
+ */
+
+static const size_t buffer_size=1024*1024;
+static const unsigned int cycles=100;
+
+static void __attribute__((noinline)) use_stack(unsigned int depth) {
+	volatile char frame[4096];
+	frame[0]=depth;
+	if(depth>0) {
+		use_stack(depth-1);
+	}
+	frame[4095]=frame[0];
+}
+
+static void cycle(char* buffer) {
+	memset(buffer, 1, buffer_size);
+	use_stack(64);
+}
+
+static void* naive_thread(void*) {
+	rt_faults f;
+	rt_faults_start(&f);
+	for(unsigned int i=0; i<cycles; i++) {
+		char* buffer=(char*)CHECK_NOT_NULL(malloc(buffer_size));
+		cycle(buffer);
+		free(buffer);
+	}
+	rt_faults_end(&f);
+	rt_faults_print("naive thread steady state", &f);
+	return NULL;
+}
+
+static char* rt_buffer;
+static rt_malloc_mode mode=RT_MALLOC_COUNT;
+
+static void* rt_thread(void*) {
+	rt_faults f;
+	rt_faults_start(&f);
+	// the steady state, from here on no malloc(3) and no faults
+	rt_malloc_lock(mode);
+	for(unsigned int i=0; i<cycles; i++) {
+		cycle(rt_buffer);
+	}
+	rt_malloc_lock(RT_MALLOC_ALLOW);
+	rt_faults_end(&f);
+	rt_faults_print("real time thread steady state", &f);
+	printf("malloc calls in steady state %lu, free calls %lu\n", rt_malloc_calls(), rt_free_calls());
+	return NULL;
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc>2) {
+		fprintf(stderr, "%s: usage: %s [count|trap]\n", argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(argc==2 && strcmp(argv[1], "trap")==0) {
+		mode=RT_MALLOC_TRAP;
+	}
+	// the naive way first, before we change malloc(3) for the whole process
+	pthread_t naive;
+	CHECK_ZERO_ERRNO(pthread_create(&naive, NULL, naive_thread, NULL));
+	CHECK_ZERO_ERRNO(pthread_join(naive, NULL));
+
+	rt_faults f;
+	rt_faults_start(&f);
+	rt_memory_init(64*1024*1024, 2*buffer_size);
+	rt_buffer=(char*)rt_reservoir_alloc(buffer_size);
+	rt_faults_end(&f);
+	rt_faults_print("init", &f);
+	// printf(3) allocated its buffer on first use, which we just did
+	pthread_t rt;
+	rt_pthread_create(&rt, NULL, rt_thread, NULL);
+	CHECK_ZERO_ERRNO(pthread_join(rt, NULL));
+	return EXIT_SUCCESS;
+}
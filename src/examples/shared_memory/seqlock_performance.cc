@@ -0,0 +1,181 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, atoi(3), exit(3)
+#include <unistd.h>	// for fork(2), usleep(3), _exit(2)
+#include <sys/types.h>	// for waitpid(2), semget(2), shmget(2)
+#include <sys/wait.h>	// for waitpid(2)
+#include <sys/ipc.h>	// for IPC_PRIVATE, IPC_RMID
+#include <sys/shm.h>	// for shmget(2), shmat(2), shmdt(2), shmctl(2)
+#include <sys/sem.h>	// for semget(2), semctl(2), semop(2)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_VOIDP(), CHECK_ASSERT()
+#include <multiproc_utils.h>	// for child_ok()
+#include <SeqLock.hh>	// for SeqLock
+#include <CacheLine.hh>	// for Padded
+
+/*
+ * This example compares a seqlock in a shared memory segment against
+ * a SysV semaphore protecting the same data, which is how the
+ * exercises/shared_memory solution protects its messages.
+ *
+ * One writer process updates a snapshot as fast as it can while 1..N
+ * reader processes read it. Every field of the snapshot holds the same
+ * value so that readers can verify that they never see a torn snapshot.
+ *
+ * Results:
+ * with the semaphore every read is two semop(2) system calls and readers
+ * serialize against each other and against the writer. With the seqlock
+ * reads are plain memory loads, reader throughput scales with the number
+ * of readers and the price is the (reported) retries.
+ *
+ * Pass the maximum number of readers (default 4) and the duration of
+ * each run in milliseconds (default 1000).
+ */
+
+typedef struct _snapshot {
+	unsigned long long values[8];
+} snapshot;
+
+typedef struct _result {
+	unsigned long long reads;
+	unsigned long long retries;
+} result;
+
+static const unsigned int MAX_READERS=64;
+
+typedef struct _shared {
+	SeqLock<snapshot> seqlock;
+	snapshot plain;
+	int stop;
+	unsigned long long writes;
+	Padded<result> results[MAX_READERS];
+} shared;
+
+static inline void sem_change(int semid, int op) {
+	struct sembuf sops;
+	sops.sem_num=0;
+	sops.sem_op=op;
+	sops.sem_flg=0;
+	CHECK_NOT_M1(semop(semid, &sops, 1));
+}
+
+static inline void check_snapshot(const snapshot& s) {
+	for(unsigned int i=1; i<sizeof(s.values)/sizeof(s.values[0]); i++) {
+		CHECK_ASSERT(s.values[i]==s.values[0]);
+	}
+}
+
+static void writer(shared* sh, int semid, bool use_seqlock) {
+	snapshot s;
+	unsigned long long counter=0;
+	while(!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		counter++;
+		for(unsigned int i=0; i<sizeof(s.values)/sizeof(s.values[0]); i++) {
+			s.values[i]=counter;
+		}
+		if(use_seqlock) {
+			sh->seqlock.write(s);
+		} else {
+			sem_change(semid, -1);
+			sh->plain=s;
+			sem_change(semid, 1);
+		}
+	}
+	sh->writes=counter;
+}
+
+static void reader(shared* sh, int semid, bool use_seqlock, unsigned int num) {
+	// counted locally, readers do not write shared state while reading
+	unsigned long long reads=0;
+	unsigned long long retries=0;
+	snapshot s;
+	while(!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		if(use_seqlock) {
+			retries+=sh->seqlock.read(s);
+		} else {
+			sem_change(semid, -1);
+			s=sh->plain;
+			sem_change(semid, 1);
+		}
+		check_snapshot(s);
+		reads++;
+	}
+	sh->results[num].get().reads=reads;
+	sh->results[num].get().retries=retries;
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc>3) {
+		fprintf(stderr, "%s: usage: %s [max readers] [millis]\n", argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	unsigned int max_readers=4;
+	unsigned int millis=1000;
+	if(argc>1) {
+		max_readers=atoi(argv[1]);
+	}
+	if(argc>2) {
+		millis=atoi(argv[2]);
+	}
+	CHECK_ASSERT(max_readers<=MAX_READERS);
+	int shmid=CHECK_NOT_M1(shmget(IPC_PRIVATE, sizeof(shared), IPC_CREAT | 0600));
+	shared* sh=(shared*)CHECK_NOT_VOIDP(shmat(shmid, NULL, 0), (void*)-1);
+	// mark for removal now, it goes away when the last process detaches
+	CHECK_NOT_M1(shmctl(shmid, IPC_RMID, NULL));
+	int semid=CHECK_NOT_M1(semget(IPC_PRIVATE, 1, IPC_CREAT | 0600));
+	for(unsigned int readers=1; readers<=max_readers; readers*=2) {
+		for(int type=0; type<2; type++) {
+			bool use_seqlock=(type==1);
+			SeqLock<snapshot>::placement(&sh->seqlock);
+			sh->stop=0;
+			sh->writes=0;
+			CHECK_NOT_M1(semctl(semid, 0, SETVAL, 1));
+			pid_t pids[MAX_READERS+1];
+			for(unsigned int i=0; i<=readers; i++) {
+				if((pids[i]=CHECK_NOT_M1(fork()))==0) {
+					if(i==0) {
+						writer(sh, semid, use_seqlock);
+					} else {
+						reader(sh, semid, use_seqlock, i-1);
+					}
+					_exit(EXIT_SUCCESS);
+				}
+			}
+			CHECK_NOT_M1(usleep(millis*1000));
+			__atomic_store_n(&sh->stop, 1, __ATOMIC_RELAXED);
+			for(unsigned int i=0; i<=readers; i++) {
+				int status;
+				CHECK_NOT_M1(waitpid(pids[i], &status, 0));
+				CHECK_ASSERT(child_ok(status));
+			}
+			unsigned long long reads=0;
+			unsigned long long retries=0;
+			for(unsigned int i=0; i<readers; i++) {
+				reads+=sh->results[i].get().reads;
+				retries+=sh->results[i].get().retries;
+			}
+			double secs=millis/1000.0;
+			printf("readers %2u %-9s reads/sec %12.0lf writes/sec %12.0lf retries/read %6.3lf\n", readers, use_seqlock ? "seqlock" : "semaphore", reads/secs, sh->writes/secs, reads ? (double)retries/reads : 0.0);
+		}
+	}
+	CHECK_NOT_M1(semctl(semid, 0, IPC_RMID));
+	CHECK_NOT_M1(shmdt(sh));
+	return EXIT_SUCCESS;
+}
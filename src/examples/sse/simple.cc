@@ -23,7 +23,9 @@
  * see this using:
  * make src/examples/sse/simple.dis
  *
- * EXTRA_COMPILE_FLAGS=-mmmx -march=native -g
+ * See simd_kernels.cc for picking wider instruction sets at runtime.
+ *
+ * EXTRA_COMPILE_FLAGS=-mmmx -g
  */
 
 #include <firstinclude.h>
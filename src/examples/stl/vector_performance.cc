@@ -20,19 +20,77 @@
 #include <iostream>	// for std::cout, std::endl
 #include <list>	// for std::list<T>, std::list<T>::iterator
 #include <vector>	// for std::list<T>, std::list<T>::iterator
-#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE;
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, malloc(3), free(3)
+#include <string.h>	// for strcmp(3)
+#include <err_utils.h>	// for CHECK_NOT_NULL()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <hugepage_utils.h>	// for hugepage_buf, hugepage_alloc(), hugepage_free(), hugepage_kind_name(), hugepage_round(), HUGEPAGE_SIZE_2M
+#include <perf_utils.h>	// for perf_counter_open_dtlb_misses(), perf_counter_open_page_faults(), perf_counter_start(), perf_counter_stop(), perf_counter_close()
 
 /*
  * This example explores the performance of vector with regard
  * to memcpy...
  *
+ * Pass 'huge' as the last argument to back the vector with huge pages
+ * (see hugepage_utils.h). Buffers below 2M still come from malloc(3),
+ * larger ones are mapped with huge pages, which cuts the page faults
+ * (and the dTLB misses) of growing and copying a big vector.
+ *
  * EXTRA_COMPILE_FLAGS=-g3
  */
 
 static int loop, size, modulu;
 
-void abuse_vector_once() {
-	std::vector<int> v;
+/*
+ * An allocator which takes big buffers from hugepage_alloc().
+ * The data starts at the start of the mapping, which is 2M aligned, so
+ * that its first 2M are a huge page too. The hugepage_buf is kept in a
+ * trailer after the data, where deallocate() finds it from the size.
+ */
+static hugepage_kind last_kind=HUGEPAGE_NONE;
+
+template <class T> class HugePageAllocator {
+public:
+	typedef T value_type;
+	HugePageAllocator() {
+	}
+	template <class U> HugePageAllocator(const HugePageAllocator<U>&) {
+	}
+	static size_t trailer(size_t n) {
+		return hugepage_round(n*sizeof(T), alignof(hugepage_buf));
+	}
+	T* allocate(size_t n) {
+		size_t bytes=n*sizeof(T);
+		if(bytes<HUGEPAGE_SIZE_2M) {
+			return (T*)CHECK_NOT_NULL(malloc(bytes));
+		}
+		hugepage_buf b;
+		hugepage_alloc(&b, trailer(n)+sizeof(hugepage_buf), HUGEPAGE_2M);
+		last_kind=b.kind;
+		*(hugepage_buf*)((char*)b.ptr+trailer(n))=b;
+		return (T*)b.ptr;
+	}
+	void deallocate(T* p, size_t n) {
+		if(n*sizeof(T)<HUGEPAGE_SIZE_2M) {
+			free(p);
+			return;
+		}
+		// copy the trailer out, it goes away with the mapping
+		hugepage_buf b=*(hugepage_buf*)((char*)p+trailer(n));
+		hugepage_free(&b);
+	}
+};
+
+template <class T, class U> bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+	return true;
+}
+
+template <class T, class U> bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+	return false;
+}
+
+template <class Vector> void abuse_vector_once() {
+	Vector v;
 	for(int i=0; i<size; i++) {
 		v.push_back(i);
 		if(i%modulu==0) {
@@ -42,15 +100,40 @@ void abuse_vector_once() {
 }
 
 int main(int argc, char** argv, char** envp) {
-	if(argc!=4) {
-		std::cerr << argv[0] << ": usage: " << argv[0] << " [loop] [size] [modulu]" << std::endl;
+	if(argc!=4 && argc!=5) {
+		std::cerr << argv[0] << ": usage: " << argv[0] << " [loop] [size] [modulu] [huge]" << std::endl;
 		return EXIT_FAILURE;
 	}
 	loop=atoi(argv[1]);
 	size=atoi(argv[2]);
 	modulu=atoi(argv[3]);
+	bool huge=argc==5 && strcmp(argv[4], "huge")==0;
+	int fd_tlb=perf_counter_open_dtlb_misses();
+	int fd_faults=perf_counter_open_page_faults();
+	measure m;
+	measure_init(&m, "vector", loop);
+	perf_counter_start(fd_tlb);
+	perf_counter_start(fd_faults);
+	measure_start(&m);
 	for(int i=0; i<loop; i++) {
-		abuse_vector_once();
+		if(huge) {
+			abuse_vector_once<std::vector<int, HugePageAllocator<int>>>();
+		} else {
+			abuse_vector_once<std::vector<int>>();
+		}
+	}
+	measure_end(&m);
+	long long tlb=perf_counter_stop(fd_tlb);
+	long long faults=perf_counter_stop(fd_faults);
+	perf_counter_close(fd_tlb);
+	perf_counter_close(fd_faults);
+	std::cout << "memory from " << (huge ? hugepage_kind_name(last_kind) : "malloc(3)") << std::endl;
+	std::cout << "took " << measure_micro_diff(&m) << " micros" << std::endl;
+	if(faults!=-1) {
+		std::cout << "page faults " << faults << std::endl;
+	}
+	if(tlb!=-1) {
+		std::cout << "dTLB load misses " << tlb << std::endl;
 	}
 	return EXIT_SUCCESS;
 }
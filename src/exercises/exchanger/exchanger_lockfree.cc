@@ -0,0 +1,84 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <iostream>	// for std::cout, std::endl
+#include <thread>	// for std::thread
+#include <stdlib.h>	// for EXIT_SUCCESS, rand(3), srand(3)
+#include <unistd.h>	// for usleep(3)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ASSERT()
+#include <Exchanger.hh>	// for Exchanger
+
+/*
+ * A lock free solution to the exchanger/randezvous exercise...
+ *
+ * Compare this to exchanger.cc: no mutex, no conditions, no state machine
+ * and no boost. See Exchanger.hh for how it works.
+ *
+ * EXTRA_LINK_FLAGS=-lpthread
+ */
+
+class Worker {
+private:
+	Exchanger<unsigned int>& e;
+	unsigned int max_sleep_time;
+	unsigned int loop_count;
+	unsigned int min;
+	unsigned int max;
+
+public:
+	Worker(Exchanger<unsigned int>& ie, unsigned int imax_sleep_time, unsigned int iloop_count, unsigned int imin, unsigned int imax) :
+		e(ie),
+		max_sleep_time(imax_sleep_time),
+		loop_count(iloop_count),
+		min(imin),
+		max(imax)
+	{
+	}
+	void operator()() {
+		for(unsigned int i=0; i<loop_count; i++) {
+			// sleep only some of the times to exercise both the spinning and the parking
+			if(i%2==0) {
+				CHECK_NOT_M1(usleep(rand()%max_sleep_time));
+			}
+			unsigned int myval=min+rand()%(max-min);
+			e.exchange(myval);
+			// assert that I got something out of my range
+			CHECK_ASSERT(myval<min || myval>=max);
+		}
+	}
+};
+
+int main(int argc, char** argv, char** envp) {
+	srand(0);
+	Exchanger<unsigned int> e;
+	unsigned int max_sleep_time=1000;
+	unsigned int loop_count=10000;
+	Worker w1(e, max_sleep_time, loop_count, 100, 200);
+	Worker w2(e, max_sleep_time, loop_count, 200, 300);
+
+	// start the threads
+	std::thread workerThread1(w1);
+	std::thread workerThread2(w2);
+	// print something
+	std::cout << "created the threads doing a join..." << std::endl;
+	// join the threads
+	workerThread1.join();
+	workerThread2.join();
+	return EXIT_SUCCESS;
+}
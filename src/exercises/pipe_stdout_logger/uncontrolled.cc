@@ -17,19 +17,31 @@
  */
 
 #include <firstinclude.h>
-#include <stdlib.h>	// for EXIT_SUCCESS
-#include <stdio.h>	// for printf(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, atol(3), atoi(3)
+#include <stdio.h>	// for printf(3), setvbuf(3)
 #include <unistd.h>	// for usleep(3)
 #include <err_utils.h>	// for CHECK_NOT_M1()
 
 /*
  * This is an uncontrolled program that we want to arrange logging for...
+ *
+ * uncontrolled [messages] [usleep]
+ * 0 messages is forever, the default is forever with 100us between
+ * messages.
  */
 int main(int argc, char** argv, char** envp) {
-	unsigned int counter=0;
-	while(true) {
-		printf("%d: This is yet another log message\n", counter);
-		CHECK_NOT_M1(usleep(100));
+	unsigned long messages=argc>1 ? atol(argv[1]) : 0;
+	unsigned int sleep_us=argc>2 ? atoi(argv[2]) : 100;
+	if(sleep_us==0) {
+		// a busy server, write in big chunks
+		setvbuf(stdout, NULL, _IOFBF, 64*1024);
+	}
+	unsigned long counter=0;
+	while(messages==0 || counter<messages) {
+		printf("%lu: This is yet another log message\n", counter);
+		if(sleep_us>0) {
+			CHECK_NOT_M1(usleep(sleep_us));
+		}
 		counter++;
 	}
 	return EXIT_SUCCESS;
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3), fprintf(3), fopen(3), fwrite(3), fclose(3)
+#include <stdlib.h>	// for EXIT_SUCCESS, EXIT_FAILURE, atoi(3), atol(3), rand_r(3)
+#include <string.h>	// for strcmp(3)
+#include <math.h>	// for sqrt(3), log(3), exp(3), cos(3), M_PI
+#include <sys/stat.h>	// for stat(2)
+#include <err_utils.h>	// for CHECK_NOT_NULL_FILEP(), CHECK_INT(), CHECK_NOT_M1(), CHECK_ZERO()
+#include <measure.h>	// for measure, measure_init(), measure_start(), measure_end(), measure_micro_diff()
+#include <cpu_set_utils.h>	// for cpu_set_allowed_count()
+#include <stats_utils.h>	// for stats, stats_file(), stats_quantile(), stats_variance(), stats_sum(), stats_format_parse()
+
+/*
+ * This is the grown up version of statistics.c: instead of reading
+ * numbers one by one with scanf(3) and adding them into a float (which
+ * stops growing at 2^24, try adding 20 million ones) it summarizes files
+ * of numbers of any size with stats_utils.h: the file is mapped, split
+ * between threads, parsed or converted into blocks of doubles which are
+ * summarized with vector instructions and merged with compensated
+ * (Neumaier) sums.
+ *
+ * The input is text (numbers separated by white space or commas) or
+ * binary (f32, f64, i64, u64 in native byte order), for instance the
+ * latency dumps of benchmarks.
+ *
+ * To try it create a file of log normal "latencies":
+ *	statistics_engine generate /tmp/lat.txt 100000000 text
+ *	statistics_engine generate /tmp/lat.f64 100000000 f64
+ *	statistics_engine text /tmp/lat.txt
+ *	statistics_engine f64 /tmp/lat.f64 4
+ *
+ * Results (one cpu, 20M values, file in the page cache):
+ * - binary doubles go at about 3GB/s (400M values per second), the
+ * histogram update is most of the work.
+ * - text goes at about 300MB/s per thread, the parsing is the work and it
+ * scales with threads.
+ * - for integers (i64, u64 and text without fractions) below 2^41 the
+ * sum is exact and does not depend on the number of threads: the sums
+ * of a block stay below 2^53 and so are exact in a double, and the
+ * compensated sum of the blocks holds 106 bits. For fractions the
+ * blocks round, the sum is within a few units in the last place of
+ * python's math.fsum() and may change in the last digits with the number
+ * of threads (the blocks are cut differently).
+ * - the quantiles are within 0.4% of the exact ones.
+ *
+ * EXTRA_LINK_FLAGS=-lpthread -lm
+ */
+
+static double normal(unsigned int* seed) {
+	// Box-Muller
+	double u1=(rand_r(seed)+1.0)/(RAND_MAX+2.0);
+	double u2=(rand_r(seed)+1.0)/(RAND_MAX+2.0);
+	return sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+static void generate(const char* filename, long count, stats_format format) {
+	FILE* f=CHECK_NOT_NULL_FILEP(fopen(filename, "w"));
+	unsigned int seed=42;
+	for(long i=0; i<count; i++) {
+		// around 1000 with a long tail
+		double v=exp(6.9+0.5*normal(&seed));
+		switch(format) {
+		case STATS_TEXT:
+			CHECK_NOT_NEGATIVE(fprintf(f, "%.3lf\n", v));
+			break;
+		case STATS_F64:
+			CHECK_INT(fwrite(&v, sizeof(v), 1, f), 1);
+			break;
+		default:
+			CHECK_ERROR("generate only does text and f64");
+		}
+	}
+	CHECK_ZERO(fclose(f));
+}
+
+int main(int argc, char** argv, char** envp) {
+	if(argc==5 && strcmp(argv[1], "generate")==0) {
+		generate(argv[2], atol(argv[3]), stats_format_parse(argv[4]));
+		return EXIT_SUCCESS;
+	}
+	if(argc<3 || argc>4) {
+		fprintf(stderr, "%s: usage: %s [text|f32|f64|i64|u64] [file] [threads]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: usage: %s generate [file] [count] [text|f64]\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: example: %s text /tmp/lat.txt 4\n", argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	stats_format format=stats_format_parse(argv[1]);
+	const char* filename=argv[2];
+	int threads=cpu_set_allowed_count();
+	if(argc==4) {
+		threads=atoi(argv[3]);
+	}
+	struct stat st;
+	CHECK_NOT_M1(stat(filename, &st));
+	stats s;
+	measure m;
+	measure_init(&m, "stats", 1);
+	measure_start(&m);
+	stats_file(&s, filename, format, threads);
+	measure_end(&m);
+	double micros=measure_micro_diff(&m);
+	printf("count     %lu\n", s.count);
+	if(s.skipped>0) {
+		printf("skipped   %lu\n", s.skipped);
+	}
+	printf("sum       %.17g\n", stats_sum(&s));
+	printf("mean      %.17g\n", s.mean);
+	printf("variance  %.17g\n", stats_variance(&s));
+	printf("stddev    %.17g\n", sqrt(stats_variance(&s)));
+	printf("min       %.17g\n", s.min);
+	printf("max       %.17g\n", s.max);
+	const double qs[]={0.5, 0.9, 0.99, 0.999, 0.9999};
+	for(unsigned int i=0; i<sizeof(qs)/sizeof(qs[0]); i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "p%g", qs[i]*100);
+		printf("%-9s %.6g\n", name, stats_quantile(&s, qs[i]));
+	}
+	printf("%d threads, %.3lf seconds, %.1lf MB/s, %.1lf M values/s\n", threads, micros/1000000, st.st_size/micros, s.count/micros);
+	stats_free(&s);
+	return EXIT_SUCCESS;
+}
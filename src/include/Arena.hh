@@ -0,0 +1,189 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __Arena_hh
+#define __Arena_hh
+
+#include <firstinclude.h>
+#include <stdlib.h>	// for malloc(3), free(3)
+#include <stdint.h>	// for uintptr_t
+#include <stddef.h>	// for max_align_t
+#include <new>	// for placement new
+#include <utility>	// for std::forward
+#include <memory_resource>	// for std::pmr::memory_resource
+#include <err_utils.h>	// for CHECK_NOT_NULL(), CHECK_ASSERT()
+
+/*
+ * A monotonic (bump pointer) arena, also known as a region allocator.
+ *
+ * - allocation is a pointer bump inside the current chunk.
+ * - when a chunk is exhausted a new one is malloc(3)ed and chained to it.
+ * Chunk sizes double up to max_chunk, an allocation larger than that gets
+ * a chunk of its own.
+ * - there is no per object free. mark() remembers the current position
+ * and rewind() throws away everything allocated since, in O(number of
+ * chunks). This is the obstack_free(3) idiom.
+ * - rewinding keeps the last chunk it frees as a spare so that a request
+ * loop (mark, work, rewind) does not go back to malloc(3) every time.
+ * - ArenaResource adapts an Arena to std::pmr::memory_resource so that
+ * std::pmr containers allocate from it.
+ *
+ * Notes:
+ * - an arena is not thread safe, use one per thread (per request).
+ * - objects in the arena still need their destructors called if they own
+ * anything outside the arena. Containers which allocate only from the
+ * arena can just be abandoned and rewound.
+ *
+ * References:
+ * https://en.wikipedia.org/wiki/Region-based_memory_management
+ * 'info libc' and search for 'obstack'
+ */
+
+class Arena {
+private:
+	// the data follows the header and is maximally aligned
+	struct alignas(max_align_t) Chunk {
+		Chunk* prev;
+		size_t size;
+		char* data() {
+			return (char*)(this+1);
+		}
+	};
+
+	Chunk* current;
+	char* cur;
+	char* end;
+	Chunk* spare;
+	size_t next_size;
+	size_t max_chunk;
+	size_t chunks;
+
+	void new_chunk(size_t need) {
+		size_t size=next_size;
+		if(need>size) {
+			size=need;
+		} else if(next_size<max_chunk) {
+			next_size*=2;
+		}
+		Chunk* c;
+		if(spare!=NULL && spare->size>=size) {
+			c=spare;
+			spare=NULL;
+		} else {
+			c=(Chunk*)CHECK_NOT_NULL(malloc(sizeof(Chunk)+size));
+			c->size=size;
+			chunks++;
+		}
+		c->prev=current;
+		current=c;
+		cur=c->data();
+		end=c->data()+c->size;
+	}
+
+	void release_chunk(Chunk* c) {
+		if(spare==NULL || spare->size<c->size) {
+			if(spare!=NULL) {
+				free(spare);
+				chunks--;
+			}
+			spare=c;
+		} else {
+			free(c);
+			chunks--;
+		}
+	}
+
+public:
+	class Mark {
+		friend class Arena;
+		Chunk* chunk;
+		char* cur;
+	};
+
+	Arena(size_t first_chunk=4096, size_t imax_chunk=1024*1024) : current(NULL), cur(NULL), end(NULL), spare(NULL), next_size(first_chunk), max_chunk(imax_chunk), chunks(0) {
+	}
+	~Arena() {
+		release();
+		if(spare!=NULL) {
+			free(spare);
+		}
+	}
+	Arena(const Arena&)=delete;
+	Arena& operator=(const Arena&)=delete;
+
+	void* allocate(size_t size, size_t align=alignof(max_align_t)) {
+		char* p=(char*)(((uintptr_t)cur+align-1) & ~(uintptr_t)(align-1));
+		if(cur==NULL || p+size>end) {
+			new_chunk(size+align);
+			p=(char*)(((uintptr_t)cur+align-1) & ~(uintptr_t)(align-1));
+		}
+		cur=p+size;
+		return p;
+	}
+	template <class T, class... Args> T* create(Args&&... args) {
+		return new(allocate(sizeof(T), alignof(T)))T(std::forward<Args>(args)...);
+	}
+	Mark mark() const {
+		Mark m;
+		m.chunk=current;
+		m.cur=cur;
+		return m;
+	}
+	void rewind(const Mark& m) {
+		while(current!=m.chunk) {
+			Chunk* c=current;
+			current=c->prev;
+			release_chunk(c);
+		}
+		cur=m.cur;
+		end=current==NULL ? NULL : current->data()+current->size;
+	}
+	// free everything (but the spare chunk)
+	void release() {
+		Mark m;
+		m.chunk=NULL;
+		m.cur=NULL;
+		rewind(m);
+	}
+	// the number of chunks held, including the spare one
+	size_t num_chunks() const {
+		return chunks;
+	}
+};
+
+class ArenaResource : public std::pmr::memory_resource {
+private:
+	Arena& arena;
+
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override {
+		return arena.allocate(bytes, alignment);
+	}
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+		// monotonic, memory comes back on Arena::rewind()
+	}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this==&other;
+	}
+
+public:
+	ArenaResource(Arena& iarena) : arena(iarena) {
+	}
+};
+
+#endif	/* !__Arena_hh */
@@ -0,0 +1,257 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CacheLine_hh
+#define __CacheLine_hh
+
+#include <firstinclude.h>
+#include <new>	// for std::hardware_destructive_interference_size
+#include <utility>	// for std::forward
+#include <type_traits>	// for std::enable_if, std::is_same, std::decay, std::false_type
+#include <stdio.h>	// for fprintf(3)
+#include <stdlib.h>	// for posix_memalign(3), free(3)
+#include <unistd.h>	// for sysconf(3)
+#include <sched.h>	// for sched_getcpu(3)
+#include <pthread.h>	// for pthread_mutex_t, pthread_mutex_lock(3), pthread_mutex_unlock(3)
+#include <vector>	// for std::vector
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1(), CHECK_ERROR()
+
+/*
+ * Templates to avoid false sharing.
+ *
+ * - Padded<T> - a T alone on its own cache line(s).
+ * - PerThread<T> - one padded T per thread.
+ * - PerCpu<T> - one padded T per cpu.
+ *
+ * The line size is a compile time constant taken from
+ * std::hardware_destructive_interference_size (instead of passing
+ * `getconf LEVEL2_CACHE_LINESIZE` on the command line, see
+ * examples/multi_core/cache_line_pad.cc). Since the compiler only knows
+ * what it is tuning for, cache_line_check() compares it to what the
+ * machine says at run time.
+ *
+ * Heap allocation: since C++17 'new' honors over alignment, so
+ * 'new Padded<T>[n]' is correctly aligned. cache_line_alloc() is for C
+ * style buffers.
+ *
+ * Notes:
+ * - gcc warns (-Winterference-size) on every use of the constant in a
+ * header since its value depends on -mtune. We take it once, here, and
+ * that is our ABI.
+ */
+
+#ifdef __cpp_lib_hardware_interference_size
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+static const size_t CACHE_LINE_SIZE=std::hardware_destructive_interference_size;
+#pragma GCC diagnostic pop
+#else
+static const size_t CACHE_LINE_SIZE=64;
+#endif	/* __cpp_lib_hardware_interference_size */
+
+/*
+ * The cache line size of the machine we are running on. Some kernels
+ * (virtual machines mostly) report 0, in which case we trust the compiler.
+ */
+static inline size_t cache_line_size() {
+	long size=sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	if(size<=0) {
+		return CACHE_LINE_SIZE;
+	}
+	return size;
+}
+
+/*
+ * Check that the compile time line size is enough for this machine.
+ * Returns false (and complains) if the padding is too small.
+ */
+static inline bool cache_line_check() {
+	size_t runtime=cache_line_size();
+	if(runtime>CACHE_LINE_SIZE) {
+		fprintf(stderr, "WARNING: compiled for cache line size %zd but running with %zd\n", CACHE_LINE_SIZE, runtime);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Allocate a buffer which starts on a cache line boundary and occupies
+ * whole cache lines (the larger of the compile time and run time sizes).
+ */
+static inline void* cache_line_alloc(size_t size) {
+	size_t line=cache_line_size();
+	if(line<CACHE_LINE_SIZE) {
+		line=CACHE_LINE_SIZE;
+	}
+	size=(size+line-1)/line*line;
+	void* ptr;
+	CHECK_ZERO_ERRNO(posix_memalign(&ptr, line, size));
+	return ptr;
+}
+
+static inline void cache_line_free(void* ptr) {
+	free(ptr);
+}
+
+/*
+ * Is a constructor call with Args a copy (or move) of a Self?
+ */
+template <class Self, class... Args> struct padded_is_copy : std::false_type {
+};
+template <class Self, class Arg> struct padded_is_copy<Self, Arg> : std::is_same<typename std::decay<Arg>::type, Self> {
+};
+
+template <class T> class alignas(CACHE_LINE_SIZE) Padded {
+private:
+	T val;
+
+public:
+	// not for a Padded, a non const one would pick this over the copy constructor
+	template <class... Args, class=typename std::enable_if<!padded_is_copy<Padded, Args...>::value>::type> Padded(Args&&... args) : val(std::forward<Args>(args)...) {
+	}
+	T& get() {
+		return val;
+	}
+	const T& get() const {
+		return val;
+	}
+	T* operator->() {
+		return &val;
+	}
+	T& operator*() {
+		return val;
+	}
+	operator T&() {
+		return val;
+	}
+};
+
+static_assert(sizeof(Padded<char>)==CACHE_LINE_SIZE, "Padded<char> is not a cache line");
+
+/*
+ * Every thread which touches a PerThread gets a small process wide id
+ * on its first access. The id goes back to a free list when the thread
+ * exits and the next new thread takes it (and whatever the old thread
+ * left in its slots, which is what keeps per thread caches from being
+ * stranded), so size the PerThread for the threads alive at once.
+ */
+class ThreadSlot {
+private:
+	static pthread_mutex_t* lock() {
+		static pthread_mutex_t m=PTHREAD_MUTEX_INITIALIZER;
+		return &m;
+	}
+	static std::vector<unsigned int>& free_ids() {
+		// never destroyed, threads may exit after static destructors ran
+		static std::vector<unsigned int>* v=new std::vector<unsigned int>();
+		return *v;
+	}
+	static inline unsigned int next_id=0;
+
+public:
+	unsigned int id;
+	ThreadSlot() {
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(lock()));
+		std::vector<unsigned int>& ids=free_ids();
+		if(ids.empty()) {
+			id=next_id++;
+		} else {
+			id=ids.back();
+			ids.pop_back();
+		}
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(lock()));
+	}
+	~ThreadSlot() {
+		// the mutex also orders our last use of the slots before the next owner's first
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(lock()));
+		free_ids().push_back(id);
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(lock()));
+	}
+};
+
+static inline unsigned int thread_slot_id() {
+	static thread_local ThreadSlot slot;
+	return slot.id;
+}
+
+template <class T> class PerThread {
+private:
+	unsigned int size;
+	Padded<T>* slots;
+
+public:
+	PerThread(unsigned int isize=256) : size(isize), slots(new Padded<T>[isize]) {
+	}
+	~PerThread() {
+		delete[] slots;
+	}
+	T& local() {
+		unsigned int id=thread_slot_id();
+		if(id>=size) {
+			CHECK_ERROR("too many threads alive for PerThread");
+		}
+		return slots[id].get();
+	}
+	unsigned int capacity() {
+		return size;
+	}
+	T& operator[](unsigned int i) {
+		return slots[i].get();
+	}
+	template <class F> void for_each(F f) {
+		for(unsigned int i=0; i<size; i++) {
+			f(slots[i].get());
+		}
+	}
+};
+
+/*
+ * A thread may migrate between sched_getcpu(3) and the access, so two
+ * threads may end up working on the same slot. T must therefore be safe
+ * for concurrent use (an atomic for instance); the point is that this
+ * is rare, so the cache line almost never bounces.
+ */
+template <class T> class PerCpu {
+private:
+	unsigned int size;
+	Padded<T>* slots;
+
+public:
+	PerCpu() : size(CHECK_NOT_M1(sysconf(_SC_NPROCESSORS_CONF))), slots(new Padded<T>[size]) {
+	}
+	~PerCpu() {
+		delete[] slots;
+	}
+	T& local() {
+		unsigned int cpu=CHECK_NOT_M1(sched_getcpu());
+		return slots[cpu%size].get();
+	}
+	unsigned int capacity() {
+		return size;
+	}
+	T& operator[](unsigned int i) {
+		return slots[i].get();
+	}
+	template <class F> void for_each(F f) {
+		for(unsigned int i=0; i<size; i++) {
+			f(slots[i].get());
+		}
+	}
+};
+
+#endif	/* !__CacheLine_hh */
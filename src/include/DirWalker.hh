@@ -0,0 +1,237 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DirWalker_hh
+#define __DirWalker_hh
+
+#include <firstinclude.h>
+#include <functional>	// for std::function
+#include <string>	// for std::string
+#include <sys/types.h>	// for open(2)
+#include <sys/stat.h>	// for statx(2), struct statx
+#include <fcntl.h>	// for openat(2), AT_SYMLINK_NOFOLLOW
+#include <unistd.h>	// for close(2)
+#include <string.h>	// for strerror(3)
+#include <stdio.h>	// for fprintf(3)
+#include <errno.h>	// for errno
+#include <stdlib.h>	// for malloc(3), free(3)
+#include <dirent.h>	// for DT_* constants
+#include <us_helper.h>	// for syscall_getdents64(), struct linux_dirent64
+#include <WorkStealingPool.hh>	// for WorkStealingPool
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_NULL()
+
+/*
+ * A parallel directory tree walker.
+ *
+ * What makes walking a tree slow and how this avoids it:
+ * - readdir(3) reads 32K of entries per getdents64(2), here every worker
+ * has its own big buffer (256K) so a directory of thousands of entries is
+ * one or two system calls.
+ * - stat(2) of every entry just to know whether it is a directory: the
+ * type is in d_type of the entry on all the common file systems, stat is
+ * only done for DT_UNKNOWN (with STATX_TYPE only) or when the caller asks
+ * for more (the statx(2) mask is the callers, the file system only
+ * fetches what is asked for).
+ * - building and resolving full paths: every directory is opened with
+ * openat(2) relative to the descriptor of its parent, so the kernel looks
+ * up one component instead of the whole path. The descriptor of a
+ * directory is closed as soon as all its subdirectories are opened.
+ * - one thread: every directory is a task of a WorkStealingPool, a worker
+ * pushes the subdirectories it finds on its own deque and idle workers
+ * steal them. On a cold cache this keeps many directory reads in flight.
+ *
+ * The callback is called from the workers, concurrently, for every entry
+ * but "." and "..", the root itself is not reported. Entry::path() builds
+ * the full path when it is needed. Directories which can not be opened
+ * and entries which can not be stat'ed are reported on stderr, counted in
+ * 'errors' and skipped.
+ */
+
+class DirWalker {
+public:
+	/*
+	 * A directory being walked. It lives as long as its subdirectories
+	 * (for paths), its descriptor only until they are all opened.
+	 */
+	class Dir {
+	public:
+		Dir* parent;
+		std::string name;
+		int fd;
+		// the processing of this directory and the pending openat(2) of its subdirectories
+		int fd_users;
+		// the processing of this directory and the subdirectories alive
+		int refs;
+		Dir(Dir* iparent, const char* iname) : parent(iparent), name(iname), fd(-1), fd_users(1), refs(1) {
+		}
+		std::string path() const {
+			if(parent==NULL) {
+				return name;
+			}
+			return parent->path()+"/"+name;
+		}
+	};
+	class Entry {
+	public:
+		const Dir* dir;
+		const char* name;
+		// DT_* from the directory or from statx(2)
+		unsigned char type;
+		// NULL if it was not needed
+		const struct statx* stx;
+		std::string path() const {
+			return dir->path()+"/"+name;
+		}
+	};
+	typedef std::function<void(const Entry&)> Callback;
+
+	// statistics
+	unsigned long dirs;
+	unsigned long entries;
+	unsigned long getdents_calls;
+	unsigned long statx_calls;
+	unsigned long errors;
+
+private:
+	WorkStealingPool& pool;
+	unsigned int stat_mask;
+	Callback callback;
+	WorkStealingPool::TaskGroup group;
+	static const size_t buffer_size=256*1024;
+
+	static char* buffer() {
+		static thread_local char* buf=NULL;
+		if(buf==NULL) {
+			buf=(char*)CHECK_NOT_NULL(malloc(buffer_size));
+		}
+		return buf;
+	}
+	static void release_fd(Dir* d) {
+		if(__atomic_sub_fetch(&d->fd_users, 1, __ATOMIC_ACQ_REL)==0 && d->fd!=-1) {
+			CHECK_NOT_M1(close(d->fd));
+		}
+	}
+	static void release(Dir* d) {
+		while(d!=NULL && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL)==0) {
+			Dir* parent=d->parent;
+			delete d;
+			d=parent;
+		}
+	}
+	void add(unsigned long* counter, unsigned long n) {
+		__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+	}
+	void report(const char* path, int error) {
+		fprintf(stderr, "%s: %s\n", path, strerror(error));
+		add(&errors, 1);
+	}
+	void spawn_dir(Dir* d) {
+		pool.spawn(group, [this, d] {
+			walk_dir(d);
+		});
+	}
+	void walk_dir(Dir* d) {
+		if(d->parent!=NULL) {
+			d->fd=openat(d->parent->fd, d->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			release_fd(d->parent);
+		}
+		if(d->fd==-1) {
+			// gone, not allowed, too deep, out of descriptors... like find(1) say so and go on
+			report(d->path().c_str(), errno);
+		} else {
+			read_dir(d);
+		}
+		release_fd(d);
+		release(d);
+	}
+	void read_dir(Dir* d) {
+		char* buf=buffer();
+		unsigned long n=0;
+		unsigned long calls=0;
+		unsigned long stats=0;
+		while(true) {
+			int nread=CHECK_NOT_M1(syscall_getdents64(d->fd, (struct linux_dirent64*)buf, buffer_size));
+			calls++;
+			if(nread==0) {
+				break;
+			}
+			for(int pos=0; pos<nread;) {
+				struct linux_dirent64* de=(struct linux_dirent64*)(buf+pos);
+				pos+=de->d_reclen;
+				const char* name=de->d_name;
+				if(name[0]=='.' && (name[1]=='\0' || (name[1]=='.' && name[2]=='\0'))) {
+					continue;
+				}
+				Entry e;
+				e.dir=d;
+				e.name=name;
+				e.type=de->d_type;
+				e.stx=NULL;
+				struct statx stx;
+				unsigned int mask=stat_mask;
+				if(e.type==DT_UNKNOWN) {
+					mask|=STATX_TYPE;
+				}
+				if(mask!=0) {
+					stats++;
+					if(statx(d->fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &stx)==-1) {
+						report((d->path()+"/"+name).c_str(), errno);
+						continue;
+					}
+					e.stx=&stx;
+					if(e.type==DT_UNKNOWN) {
+						e.type=IFTODT(stx.stx_mode);
+					}
+				}
+				n++;
+				if(callback) {
+					callback(e);
+				}
+				if(e.type==DT_DIR) {
+					Dir* child=new Dir(d, name);
+					__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+					__atomic_add_fetch(&d->fd_users, 1, __ATOMIC_RELAXED);
+					spawn_dir(child);
+				}
+			}
+		}
+		add(&dirs, 1);
+		add(&entries, n);
+		add(&getdents_calls, calls);
+		add(&statx_calls, stats);
+	}
+
+public:
+	/*
+	 * stat_mask is the STATX_* the callback needs in Entry::stx, 0 for
+	 * none (the type is always there)
+	 */
+	DirWalker(WorkStealingPool& ipool, unsigned int istat_mask=0, Callback icallback=Callback()) : dirs(0), entries(0), getdents_calls(0), statx_calls(0), errors(0), pool(ipool), stat_mask(istat_mask), callback(icallback) {
+	}
+	/*
+	 * Walk the tree under root and wait for the whole walk
+	 */
+	void walk(const char* root) {
+		Dir* d=new Dir(NULL, root);
+		d->fd=CHECK_NOT_M1(open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+		spawn_dir(d);
+		pool.sync(group);
+	}
+};
+
+#endif	/* !__DirWalker_hh */
@@ -0,0 +1,112 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __Exchanger_hh
+#define __Exchanger_hh
+
+#include <firstinclude.h>
+#include <utility>	// for std::swap
+#include <futex_utils.h>// for futex_wait_checked(), futex_wake()
+#include <atomic_utils.h>	// for cpu_relax()
+#include <err_utils.h>	// for CHECK_NOT_M1()
+
+/*
+ * A lock free exchanger (randezvous) built on a single atomic slot.
+ *
+ * The slot holds a pointer to a node which lives on the stack of the
+ * thread that arrived first. The first thread CASes its node into the
+ * empty slot and waits. The second thread CASes the slot back to empty,
+ * which makes it the exclusive owner of the waiting node, swaps the values
+ * and releases the waiter. This is the slot of the elimination array in
+ * the java.util.concurrent Exchanger with an arena size of one, which is
+ * all you need for pairwise handoff between two pipeline stages.
+ *
+ * The waiter spins for a bounded number of iterations (a handoff between
+ * two running threads is usually much shorter than a context switch) and
+ * only then parks on a futex. The node state is the futex word:
+ * WAITING - first thread is spinning
+ * PARKED - first thread is (about to be) asleep in futex(2)
+ * MATCHED - the second thread did the swap, the first may leave
+ *
+ * Notes:
+ * - the second thread may call futex_wake() on a node which is no longer
+ * on the stack of the waiter (it already saw MATCHED and left). This only
+ * results in a spurious wakeup of whoever is sleeping on that address,
+ * which every futex user must tolerate anyway.
+ * - with more than two threads the exchanger still works but pairs are
+ * formed arbitrarily.
+ */
+
+template <class T> class Exchanger {
+private:
+	enum { WAITING, PARKED, MATCHED };
+	struct Node {
+		T* item;
+		int state;
+	};
+	Node* slot;
+	unsigned int spin;
+
+public:
+	Exchanger(unsigned int ispin=1 << 12) : slot(NULL), spin(ispin) {
+	}
+
+	void exchange(T& t) {
+		Node me;
+		me.item=&t;
+		me.state=WAITING;
+		while(true) {
+			Node* other=__atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+			if(other==NULL) {
+				if(__atomic_compare_exchange_n(&slot, &other, &me, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					wait(&me);
+					return;
+				}
+			} else {
+				if(__atomic_compare_exchange_n(&slot, &other, (Node*)NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					std::swap(t, *other->item);
+					if(__atomic_exchange_n(&other->state, (int)MATCHED, __ATOMIC_RELEASE)==PARKED) {
+						CHECK_NOT_M1(futex_wake(&other->state, 1));
+					}
+					return;
+				}
+			}
+			cpu_relax();
+		}
+	}
+
+private:
+	void wait(Node* me) {
+		for(unsigned int i=0; i<spin; i++) {
+			if(__atomic_load_n(&me->state, __ATOMIC_ACQUIRE)==MATCHED) {
+				return;
+			}
+			cpu_relax();
+		}
+		int c=WAITING;
+		if(!__atomic_compare_exchange_n(&me->state, &c, (int)PARKED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			// matched between the last check and the CAS
+			return;
+		}
+		while(__atomic_load_n(&me->state, __ATOMIC_ACQUIRE)!=MATCHED) {
+			futex_wait_checked(&me->state, PARKED);
+		}
+	}
+};
+
+#endif	/* !__Exchanger_hh */
@@ -0,0 +1,352 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HashMap_hh
+#define __HashMap_hh
+
+#include <firstinclude.h>
+#include <stdlib.h>	// for aligned_alloc(3), free(3)
+#include <string.h>	// for memset(3)
+#include <stdint.h>	// for uint64_t, int8_t
+#include <new>	// for placement new, ::operator new, ::operator delete
+#include <utility>	// for std::pair, std::move, std::forward
+#include <tuple>	// for std::forward_as_tuple
+#include <functional>	// for std::hash, std::equal_to
+#include <string_view>	// for std::string_view
+#ifdef __SSE2__
+#include <emmintrin.h>	// for _mm_load_si128(), _mm_set1_epi8(), _mm_cmpeq_epi8(), _mm_movemask_epi8()
+#endif	/* __SSE2__ */
+#include <err_utils.h>	// for CHECK_NOT_NULL(), CHECK_ASSERT()
+
+/*
+ * An open addressing hash map in the style of Google's Swiss tables.
+ *
+ * - next to the slots there is one control byte per slot: empty, deleted
+ * or, for a full slot, 7 bits of the hash of its key.
+ * - control bytes come in aligned groups of 16. A lookup loads a group
+ * with one SSE2 load and compares all 16 bytes to the 7 bits of the key
+ * it is looking for in one instruction. Only the (rare) matches are
+ * compared to the key itself. A group which has an empty byte ends the
+ * probe. Groups are probed in triangular order, which visits all groups.
+ * - the table grows at 7/8 full. Growing is incremental: the old table is
+ * kept and every insert or erase moves a few of its slots to the new
+ * table, lookups check both. So no single insert pays for rehashing the
+ * whole map (pass incremental=false to see the difference).
+ * - lookups are heterogeneous: find() and erase() take any type the hash
+ * and the equality accept. With HashMapStringHash and std::equal_to<>
+ * (the defaults for std::string keys are not transparent, pass them)
+ * a map with std::string keys is searched with a const char* or a
+ * std::string_view without building a std::string.
+ * - the hash is mixed with a multiplication so that weak hashes (like
+ * std::hash<int> which is the identity) still spread well.
+ *
+ * Notes:
+ * - pointers returned by find() are invalidated by the next insert or
+ * erase (slots move between tables).
+ * - there are no iterators, use for_each().
+ *
+ * References:
+ * https://abseil.io/about/design/swisstables
+ * "Designing a Fast, Efficient, Cache-friendly Hash Table, Step by Step",
+ * Matt Kulukundis, CppCon 2017
+ */
+
+struct HashMapStringHash {
+	typedef void is_transparent;
+	size_t operator()(std::string_view s) const {
+		return std::hash<std::string_view>()(s);
+	}
+};
+
+template <class K, class V, class Hash=std::hash<K>, class Eq=std::equal_to<>> class HashMap {
+private:
+	typedef std::pair<K, V> value_type;
+	static const size_t GROUP=16;
+	static const int8_t EMPTY=-128;
+	static const int8_t DELETED=-2;
+	// how many old slots every mutating operation migrates
+	static const size_t MIGRATE_STEP=64;
+
+	struct Table {
+		int8_t* ctrl;
+		value_type* slots;
+		// a power of two and a multiple of GROUP, 0 for no table
+		size_t capacity;
+		size_t used;
+		size_t deleted;
+	};
+
+	Table cur;
+	Table old;
+	size_t migrate_pos;
+	bool incremental;
+	Hash hasher;
+	Eq eq;
+
+	// a bit per byte of the group which equals 'b'
+	static unsigned int match(const int8_t* group, int8_t b) {
+#ifdef __SSE2__
+		__m128i ctrl=_mm_load_si128((const __m128i*)group);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+#else
+		unsigned int m=0;
+		for(unsigned int i=0; i<GROUP; i++) {
+			if(group[i]==b) {
+				m|=1 << i;
+			}
+		}
+		return m;
+#endif	/* __SSE2__ */
+	}
+
+	// a bit per byte of the group which is empty or deleted (negative)
+	static unsigned int match_free(const int8_t* group) {
+#ifdef __SSE2__
+		return _mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+		unsigned int m=0;
+		for(unsigned int i=0; i<GROUP; i++) {
+			if(group[i]<0) {
+				m|=1 << i;
+			}
+		}
+		return m;
+#endif	/* __SSE2__ */
+	}
+
+	template <class Q> uint64_t hash_of(const Q& key) const {
+		uint64_t h=hasher(key);
+		h*=0x9E3779B97F4A7C15ULL;
+		return h ^ (h >> 32);
+	}
+
+	static int8_t h2_of(uint64_t h) {
+		return h >> 57;
+	}
+
+	static void table_init(Table& t, size_t capacity) {
+		t.capacity=capacity;
+		t.used=0;
+		t.deleted=0;
+		if(capacity==0) {
+			t.ctrl=NULL;
+			t.slots=NULL;
+			return;
+		}
+		t.ctrl=(int8_t*)CHECK_NOT_NULL(aligned_alloc(GROUP, capacity));
+		memset(t.ctrl, EMPTY, capacity);
+		t.slots=(value_type*)::operator new(capacity*sizeof(value_type));
+	}
+
+	static void table_free(Table& t) {
+		for(size_t i=0; i<t.capacity; i++) {
+			if(t.ctrl[i]>=0) {
+				t.slots[i].~value_type();
+			}
+		}
+		free(t.ctrl);
+		::operator delete(t.slots);
+		table_init(t, 0);
+	}
+
+	template <class Q> size_t find_in(const Table& t, const Q& key, uint64_t h) const {
+		if(t.used==0) {
+			return t.capacity;
+		}
+		size_t mask=t.capacity/GROUP-1;
+		size_t g=h & mask;
+		int8_t h2=h2_of(h);
+		for(size_t i=1; ; i++) {
+			const int8_t* group=t.ctrl+g*GROUP;
+			unsigned int m=match(group, h2);
+			while(m) {
+				size_t pos=g*GROUP+__builtin_ctz(m);
+				if(eq(t.slots[pos].first, key)) {
+					return pos;
+				}
+				m&=m-1;
+			}
+			if(match(group, EMPTY)) {
+				return t.capacity;
+			}
+			g=(g+i) & mask;
+		}
+	}
+
+	// put a key which is not in the table into the table
+	template <class... Args> value_type* place(Table& t, uint64_t h, Args&&... args) {
+		size_t mask=t.capacity/GROUP-1;
+		size_t g=h & mask;
+		for(size_t i=1; ; i++) {
+			unsigned int m=match_free(t.ctrl+g*GROUP);
+			if(m) {
+				size_t pos=g*GROUP+__builtin_ctz(m);
+				if(t.ctrl[pos]==DELETED) {
+					t.deleted--;
+				}
+				t.ctrl[pos]=h2_of(h);
+				t.used++;
+				return new(t.slots+pos)value_type(std::forward<Args>(args)...);
+			}
+			g=(g+i) & mask;
+		}
+	}
+
+	static void remove(Table& t, size_t pos) {
+		t.slots[pos].~value_type();
+		// a group which already has an empty slot ends every probe passing
+		// through it, so this slot can be empty too and not a tombstone
+		const int8_t* group=t.ctrl+pos/GROUP*GROUP;
+		if(match(group, EMPTY)) {
+			t.ctrl[pos]=EMPTY;
+		} else {
+			t.ctrl[pos]=DELETED;
+			t.deleted++;
+		}
+		t.used--;
+	}
+
+	// move up to 'count' slots from the old table to the current one
+	void migrate(size_t count) {
+		while(old.capacity>0 && count>0) {
+			if(old.ctrl[migrate_pos]>=0) {
+				value_type& v=old.slots[migrate_pos];
+				place(cur, hash_of(v.first), std::move(v));
+				v.~value_type();
+				// a tombstone, probes for keys not yet moved pass through here
+				old.ctrl[migrate_pos]=DELETED;
+				old.used--;
+			}
+			migrate_pos++;
+			count--;
+			if(migrate_pos==old.capacity) {
+				table_free(old);
+			}
+		}
+	}
+
+	void grow() {
+		// finish the previous resize first (rare, see MIGRATE_STEP)
+		migrate(old.capacity);
+		// after the resize the table is at most 7/16 full
+		size_t capacity=GROUP;
+		while(capacity*7/16<cur.used+1) {
+			capacity*=2;
+		}
+		old=cur;
+		migrate_pos=0;
+		table_init(cur, capacity);
+		if(!incremental) {
+			migrate(old.capacity);
+		}
+	}
+
+public:
+	HashMap(size_t reserve=0, bool iincremental=true) : migrate_pos(0), incremental(iincremental) {
+		table_init(cur, 0);
+		table_init(old, 0);
+		size_t capacity=0;
+		if(reserve>0) {
+			capacity=GROUP;
+			while(capacity*7/8<reserve) {
+				capacity*=2;
+			}
+		}
+		table_init(cur, capacity);
+	}
+	~HashMap() {
+		table_free(cur);
+		table_free(old);
+	}
+	HashMap(const HashMap&)=delete;
+	HashMap& operator=(const HashMap&)=delete;
+
+	size_t size() const {
+		return cur.used+old.used;
+	}
+	template <class Q> V* find(const Q& key) {
+		uint64_t h=hash_of(key);
+		size_t pos=find_in(cur, key, h);
+		if(pos!=cur.capacity) {
+			return &cur.slots[pos].second;
+		}
+		pos=find_in(old, key, h);
+		if(pos!=old.capacity) {
+			return &old.slots[pos].second;
+		}
+		return NULL;
+	}
+	template <class Q> bool contains(const Q& key) {
+		return find(key)!=NULL;
+	}
+	/*
+	 * Insert if not there. Returns the value and whether it was inserted.
+	 */
+	template <class KK, class... Args> std::pair<V*, bool> emplace(KK&& key, Args&&... args) {
+		migrate(MIGRATE_STEP);
+		V* v=find(key);
+		if(v!=NULL) {
+			return std::pair<V*, bool>(v, false);
+		}
+		if(cur.used+cur.deleted+1>cur.capacity*7/8) {
+			grow();
+		}
+		uint64_t h=hash_of(key);
+		value_type* p=place(cur, h, std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+		return std::pair<V*, bool>(&p->second, true);
+	}
+	bool insert(const K& key, const V& val) {
+		return emplace(key, val).second;
+	}
+	V& operator[](const K& key) {
+		return *emplace(key).first;
+	}
+	template <class Q> bool erase(const Q& key) {
+		migrate(MIGRATE_STEP);
+		uint64_t h=hash_of(key);
+		size_t pos=find_in(cur, key, h);
+		if(pos!=cur.capacity) {
+			remove(cur, pos);
+			return true;
+		}
+		pos=find_in(old, key, h);
+		if(pos!=old.capacity) {
+			remove(old, pos);
+			return true;
+		}
+		return false;
+	}
+	template <class F> void for_each(F f) {
+		Table* tables[]={&old, &cur};
+		for(Table* t : tables) {
+			for(size_t i=0; i<t->capacity; i++) {
+				if(t->ctrl[i]>=0) {
+					f(t->slots[i].first, t->slots[i].second);
+				}
+			}
+		}
+	}
+	void clear() {
+		table_free(old);
+		size_t capacity=cur.capacity;
+		table_free(cur);
+		table_init(cur, capacity);
+	}
+};
+
+#endif	/* !__HashMap_hh */
@@ -0,0 +1,248 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ObjectPool_hh
+#define __ObjectPool_hh
+
+#include <firstinclude.h>
+#include <stdlib.h>	// for malloc(3), free(3)
+#include <new>	// for placement new, ::operator new, ::operator delete
+#include <utility>	// for std::forward
+#include <futex_utils.h>// for futex_mutex_t, futex_mutex_init(), futex_mutex_lock(), futex_mutex_unlock()
+#include <CacheLine.hh>	// for PerThread
+#include <err_utils.h>	// for CHECK_NOT_NULL(), CHECK_ASSERT()
+
+/*
+ * A pool of fixed size slots for objects of type T.
+ *
+ * - free slots are kept on an intrusive singly linked list: the link is
+ * stored inside the free slot itself so the pool needs no memory of its
+ * own per object.
+ * - slots are carved from blocks of 'block_size' slots which are only
+ * freed when the pool is destroyed. Pass 'prealloc' to the constructor
+ * (or call reserve()) to do all allocation at startup, which is what you
+ * want in real time code: after that allocate() never calls malloc(3).
+ * - the shared free list is protected by a futex mutex. With
+ * 'thread_cache' every thread also keeps a private free list and moves
+ * slots to and from the shared one in batches of 'batch' slots, so the
+ * mutex is taken once per batch and not once per object.
+ * - allocate()/deallocate() deal in raw memory, create()/destroy() also
+ * construct and destruct (placement new and an explicit destructor call).
+ * - PoolAllocated<T> is a CRTP mixin which routes a class's operator
+ * new/delete to a pool of its own, see below.
+ *
+ * Notes:
+ * - the pool does not destroy objects which are still alive when the pool
+ * itself is destroyed, it just releases the memory.
+ * - slots cached by a thread which has exited stay in its cache until
+ * the next new thread takes over its id (see CacheLine.hh), so any
+ * number of threads may come and go, as long as no more than the
+ * PerThread size (256) use the pool at once.
+ */
+
+template <class T> class ObjectPool {
+private:
+	union Slot {
+		Slot* next;
+		alignas(T) char storage[sizeof(T)];
+	};
+
+	struct Block {
+		Block* next;
+		Slot* slots;
+	};
+
+	struct Cache {
+		Slot* head;
+		unsigned int count;
+		Cache() : head(NULL), count(0) {
+		}
+	};
+
+	futex_mutex_t lock;
+	Slot* free_list;
+	Block* blocks;
+	unsigned int block_size;
+	unsigned int batch;
+	size_t capacity;
+	PerThread<Cache>* caches;
+
+	// called with the lock held
+	void grow() {
+		Block* b=(Block*)CHECK_NOT_NULL(malloc(sizeof(Block)));
+		b->slots=(Slot*)CHECK_NOT_NULL(aligned_alloc(alignof(Slot), sizeof(Slot)*block_size));
+		b->next=blocks;
+		blocks=b;
+		for(unsigned int i=0; i<block_size; i++) {
+			b->slots[i].next=free_list;
+			free_list=b->slots+i;
+		}
+		capacity+=block_size;
+	}
+
+	// move up to 'batch' slots from the shared list to the cache
+	void refill(Cache& c) {
+		futex_mutex_lock(&lock);
+		for(unsigned int i=0; i<batch; i++) {
+			if(free_list==NULL) {
+				grow();
+			}
+			Slot* s=free_list;
+			free_list=s->next;
+			s->next=c.head;
+			c.head=s;
+		}
+		futex_mutex_unlock(&lock);
+		c.count+=batch;
+	}
+
+	// move 'batch' slots from the cache to the shared list
+	void drain(Cache& c) {
+		Slot* first=c.head;
+		Slot* last=first;
+		for(unsigned int i=1; i<batch; i++) {
+			last=last->next;
+		}
+		c.head=last->next;
+		c.count-=batch;
+		futex_mutex_lock(&lock);
+		last->next=free_list;
+		free_list=first;
+		futex_mutex_unlock(&lock);
+	}
+
+public:
+	ObjectPool(size_t prealloc=0, bool thread_cache=false, unsigned int iblock_size=1024, unsigned int ibatch=64) : free_list(NULL), blocks(NULL), block_size(iblock_size), batch(ibatch), capacity(0), caches(NULL) {
+		CHECK_ASSERT(block_size>0 && batch>0);
+		futex_mutex_init(&lock);
+		if(thread_cache) {
+			caches=new PerThread<Cache>();
+		}
+		reserve(prealloc);
+	}
+	~ObjectPool() {
+		delete caches;
+		while(blocks!=NULL) {
+			Block* b=blocks;
+			blocks=b->next;
+			free(b->slots);
+			free(b);
+		}
+	}
+	ObjectPool(const ObjectPool&)=delete;
+	ObjectPool& operator=(const ObjectPool&)=delete;
+
+	// make sure at least 'n' slots exist
+	void reserve(size_t n) {
+		futex_mutex_lock(&lock);
+		while(capacity<n) {
+			grow();
+		}
+		futex_mutex_unlock(&lock);
+	}
+	void* allocate() {
+		if(caches!=NULL) {
+			Cache& c=caches->local();
+			if(c.head==NULL) {
+				refill(c);
+			}
+			Slot* s=c.head;
+			c.head=s->next;
+			c.count--;
+			return s;
+		}
+		futex_mutex_lock(&lock);
+		if(free_list==NULL) {
+			grow();
+		}
+		Slot* s=free_list;
+		free_list=s->next;
+		futex_mutex_unlock(&lock);
+		return s;
+	}
+	void deallocate(void* p) {
+		Slot* s=(Slot*)p;
+		if(caches!=NULL) {
+			Cache& c=caches->local();
+			s->next=c.head;
+			c.head=s;
+			c.count++;
+			if(c.count>=2*batch) {
+				drain(c);
+			}
+			return;
+		}
+		futex_mutex_lock(&lock);
+		s->next=free_list;
+		free_list=s;
+		futex_mutex_unlock(&lock);
+	}
+	template <class... Args> T* create(Args&&... args) {
+		return new(allocate())T(std::forward<Args>(args)...);
+	}
+	void destroy(T* t) {
+		t->~T();
+		deallocate(t);
+	}
+	// the number of slots (free and used) the pool has
+	size_t size() {
+		futex_mutex_lock(&lock);
+		size_t ret=capacity;
+		futex_mutex_unlock(&lock);
+		return ret;
+	}
+};
+
+/*
+ * Derive from this to make 'new Derived(...)' and 'delete p' use a
+ * per class ObjectPool with thread caches:
+ *
+ *	class Message : public PoolAllocated<Message> {
+ *		...
+ *	};
+ *
+ * A class derived from Derived is bigger than a slot so its objects go
+ * to the global operator new/delete (the sized delete tells us which is
+ * which, give the hierarchy a virtual destructor). Arrays are not pooled.
+ * The pool is never destroyed since objects may outlive main().
+ */
+template <class Derived> class PoolAllocated {
+public:
+	static ObjectPool<Derived>& pool() {
+		static ObjectPool<Derived>* p=new ObjectPool<Derived>(0, true);
+		return *p;
+	}
+	static void* operator new(size_t size) {
+		if(size!=sizeof(Derived)) {
+			return ::operator new(size);
+		}
+		return pool().allocate();
+	}
+	static void operator delete(void* p, size_t size) {
+		if(p==NULL) {
+			return;
+		}
+		if(size!=sizeof(Derived)) {
+			::operator delete(p);
+			return;
+		}
+		pool().deallocate(p);
+	}
+};
+
+#endif	/* !__ObjectPool_hh */
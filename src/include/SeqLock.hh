@@ -0,0 +1,143 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SeqLock_hh
+#define __SeqLock_hh
+
+#include <firstinclude.h>
+#include <type_traits>	// for std::is_trivially_copyable
+#include <new>	// for placement new
+#include <atomic>	// for std::atomic_thread_fence
+#include <string.h>	// for memcpy(3)
+#include <atomic_utils.h>	// for cpu_relax()
+#include <CacheLine.hh>	// for CACHE_LINE_SIZE
+
+/*
+ * A sequence lock for a single writer and many readers.
+ *
+ * The writer makes the sequence number odd, updates the data and makes it
+ * even again. A reader reads the sequence number, copies the data and
+ * reads the sequence number again. If it was odd or changed the copy may
+ * be torn and the reader tries again.
+ *
+ * - readers never write to shared memory so they do not bounce the cache
+ * line between them (a reader/writer lock does, even for readers).
+ * - readers never block the writer, the writer never waits.
+ * - the object holds no pointers and uses no process local resources, so
+ * it can be placed in a shmget(2)/shm_open(3) segment (see placement())
+ * and used across processes.
+ * - more than one writer needs to be serialized by some other means.
+ *
+ * The data is copied with relaxed atomic word loads and stores. A plain
+ * memcpy(3) would be a data race (undefined behaviour) from the C++
+ * memory model point of view even though the result is thrown away.
+ * The words of the shared copy are aligned (it is on a cache line of its
+ * own), the T of the caller may not be, so the caller's side goes through
+ * an aligned buffer on the stack.
+ *
+ * References:
+ * https://en.wikipedia.org/wiki/Seqlock
+ * "Can Seqlocks Get Along With Programming Language Memory Models?",
+ * Hans Boehm, MSPC 2012
+ */
+
+template <class T> class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock data must be trivially copyable");
+
+private:
+	alignas(CACHE_LINE_SIZE) unsigned int seq;
+	// the data starts on its own cache line
+	alignas(CACHE_LINE_SIZE) T data;
+
+	// both must be aligned to unsigned long
+	static void copy(void* to, const void* from) {
+		if(sizeof(T)%sizeof(unsigned long)==0) {
+			unsigned long* t=(unsigned long*)to;
+			const unsigned long* f=(const unsigned long*)from;
+			for(unsigned int i=0; i<sizeof(T)/sizeof(unsigned long); i++) {
+				__atomic_store_n(t+i, __atomic_load_n(f+i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			}
+		} else {
+			unsigned char* t=(unsigned char*)to;
+			const unsigned char* f=(const unsigned char*)from;
+			for(unsigned int i=0; i<sizeof(T); i++) {
+				__atomic_store_n(t+i, __atomic_load_n(f+i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+public:
+	SeqLock() : seq(0), data() {
+	}
+	SeqLock(const T& t) : seq(0), data(t) {
+	}
+	// construct a seqlock in a piece of (shared) memory
+	static SeqLock<T>* placement(void* mem) {
+		return new(mem) SeqLock<T>();
+	}
+	void write_begin() {
+		unsigned int s=__atomic_load_n(&seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&seq, s+1, __ATOMIC_RELAXED);
+		// the odd sequence must be visible before any of the data stores
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+	void write_end() {
+		unsigned int s=__atomic_load_n(&seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&seq, s+1, __ATOMIC_RELEASE);
+	}
+	void write(const T& t) {
+		alignas(unsigned long) unsigned char buf[sizeof(T)];
+		memcpy(buf, &t, sizeof(T));
+		write_begin();
+		copy(&data, buf);
+		write_end();
+	}
+	/*
+	 * Read a consistent snapshot into 't'. Returns the number of retries
+	 * (torn or in progress reads), keep your own sum of these if you want
+	 * the statistic, the lock does not keep it since readers must not
+	 * write shared state.
+	 */
+	unsigned int read(T& t) const {
+		alignas(unsigned long) unsigned char buf[sizeof(T)];
+		unsigned int retries=0;
+		while(true) {
+			unsigned int s1=__atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+			if(s1 & 1) {
+				retries++;
+				cpu_relax();
+				continue;
+			}
+			copy(buf, &data);
+			// the data loads must be done before the second sequence load
+			std::atomic_thread_fence(std::memory_order_acquire);
+			unsigned int s2=__atomic_load_n(&seq, __ATOMIC_RELAXED);
+			if(s1==s2) {
+				memcpy(&t, buf, sizeof(T));
+				return retries;
+			}
+			retries++;
+		}
+	}
+	// the number of writes so far
+	unsigned int version() const {
+		return __atomic_load_n(&seq, __ATOMIC_ACQUIRE)/2;
+	}
+};
+
+#endif	/* !__SeqLock_hh */
@@ -0,0 +1,373 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SlabAllocator_hh
+#define __SlabAllocator_hh
+
+#include <firstinclude.h>
+#include <stdio.h>	// for printf(3)
+#include <stdlib.h>	// for malloc(3), free(3)
+#include <stdint.h>	// for uintptr_t
+#include <sys/mman.h>	// for mmap(2), munmap(2)
+#include <futex_utils.h>// for futex_mutex_t, futex_mutex_init(), futex_mutex_lock(), futex_mutex_unlock()
+#include <CacheLine.hh>	// for Padded
+#include <err_utils.h>	// for CHECK_NOT_VOIDP(), CHECK_NOT_M1(), CHECK_NOT_NULL(), CHECK_ASSERT()
+
+/*
+ * A thread caching slab allocator in the style of Bonwick's "Magazines
+ * and Vmem" (the Solaris/Linux kernel slab allocator brought to user space).
+ *
+ * - sizes are rounded up to a size class: multiples of 16 up to 256 and
+ * then powers of two up to 32K.
+ * - memory comes from the kernel in slabs of SLAB_SIZE bytes, aligned to
+ * SLAB_SIZE, mapped with mmap(2). The slab header (at the start of the slab)
+ * holds the size class so free() finds it by masking the pointer.
+ * - every thread keeps two magazines (small arrays of free objects) per
+ * size class. alloc() and free() are a pop or a push on the loaded
+ * magazine without any locking or atomics.
+ * - when both magazines are empty (alloc) or full (free) the thread trades
+ * a whole magazine with the per size class depot under a futex mutex.
+ * That is one lock for many (up to MAG_SIZE) objects.
+ * - an object freed by a thread other than the one which allocated it just
+ * goes into the freeing threads magazine and from there, via the depot, to
+ * whoever needs it. There is no ownership and no remote free list.
+ * - allocations larger than the biggest class get their own mapping
+ * and are unmapped on free.
+ * - a thread which exits returns its magazines to the depot.
+ *
+ * Notes:
+ * - slabs are never returned to the kernel. The memory footprint is the
+ * high watermark of live objects per size class plus what sits in the
+ * magazines.
+ * - objects are 16 byte aligned, like malloc(3).
+ * - there is a single process wide allocator (instance()) since the
+ * thread caches are thread_local.
+ *
+ * References:
+ * "Magazines and Vmem: Extending the Slab Allocator to Many CPUs and
+ * Arbitrary Resources", Bonwick and Adams, USENIX 2001
+ */
+
+class SlabAllocator {
+public:
+	static const size_t SLAB_SIZE=256*1024;
+	static const unsigned int MAG_SIZE=64;
+	static const unsigned int NUM_CLASSES=16+7;
+	static const size_t MAX_SMALL=32*1024;
+
+private:
+	static const unsigned int CLASS_LARGE=NUM_CLASSES;
+	// the header occupies the first cache line of every slab or large mapping
+	static const size_t HEADER_SIZE=64;
+
+	struct SlabHeader {
+		unsigned int size_class;
+		size_t map_size;
+	};
+
+	struct Magazine {
+		unsigned int count;
+		unsigned int capacity;
+		Magazine* next;
+		void* objs[MAG_SIZE];
+	};
+
+	struct Depot {
+		futex_mutex_t lock;
+		Magazine* full;
+		Magazine* empty;
+		// the slab we are carving new objects from
+		char* bump;
+		char* bump_end;
+		unsigned long slabs;
+		unsigned long exchanges;
+	};
+
+	struct ThreadCache {
+		Magazine* loaded[NUM_CLASSES];
+		Magazine* previous[NUM_CLASSES];
+		~ThreadCache() {
+			instance().flush(*this);
+		}
+	};
+
+	Padded<Depot> depots[NUM_CLASSES];
+	unsigned long large_allocs;
+
+	SlabAllocator() : large_allocs(0) {
+		for(unsigned int c=0; c<NUM_CLASSES; c++) {
+			Depot& d=depots[c].get();
+			futex_mutex_init(&d.lock);
+			d.full=NULL;
+			d.empty=NULL;
+			d.bump=NULL;
+			d.bump_end=NULL;
+			d.slabs=0;
+			d.exchanges=0;
+		}
+	}
+
+	static ThreadCache& cache() {
+		static thread_local ThreadCache tc;
+		return tc;
+	}
+
+	static unsigned int size_to_class(size_t size) {
+		if(size<=256) {
+			return size==0 ? 0 : (size-1)/16;
+		}
+		// 257..512 is class 16, 513..1024 is class 17 and so on
+		return 16+(64-__builtin_clzl(size-1))-9;
+	}
+
+	static size_t class_to_size(unsigned int c) {
+		if(c<16) {
+			return (c+1)*16;
+		}
+		return 512UL << (c-16);
+	}
+
+	// larger objects get smaller magazines to bound per thread caching
+	static unsigned int class_to_capacity(unsigned int c) {
+		size_t cap=SLAB_SIZE/8/class_to_size(c);
+		if(cap<4) {
+			return 4;
+		}
+		if(cap>MAG_SIZE) {
+			return MAG_SIZE;
+		}
+		return cap;
+	}
+
+	static SlabHeader* header_of(void* ptr) {
+		return (SlabHeader*)((uintptr_t)ptr & ~(SLAB_SIZE-1));
+	}
+
+	// map 'size' bytes aligned to SLAB_SIZE by over mapping and trimming
+	static void* map_aligned(size_t size) {
+		size_t over=size+SLAB_SIZE;
+		char* p=(char*)CHECK_NOT_VOIDP(mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), MAP_FAILED);
+		char* aligned=(char*)(((uintptr_t)p+SLAB_SIZE-1) & ~(SLAB_SIZE-1));
+		if(aligned>p) {
+			CHECK_NOT_M1(munmap(p, aligned-p));
+		}
+		size_t tail=(p+over)-(aligned+size);
+		if(tail>0) {
+			CHECK_NOT_M1(munmap(aligned+size, tail));
+		}
+		return aligned;
+	}
+
+	static Magazine* new_magazine(unsigned int c) {
+		Magazine* m=(Magazine*)CHECK_NOT_NULL(malloc(sizeof(Magazine)));
+		m->count=0;
+		m->capacity=class_to_capacity(c);
+		m->next=NULL;
+		return m;
+	}
+
+	static void push(Magazine*& list, Magazine* m) {
+		m->next=list;
+		list=m;
+	}
+
+	static Magazine* pop(Magazine*& list) {
+		Magazine* m=list;
+		if(m!=NULL) {
+			list=m->next;
+		}
+		return m;
+	}
+
+	// fill 'm' with fresh objects, called with the depot locked
+	void carve(unsigned int c, Magazine* m) {
+		Depot& d=depots[c].get();
+		size_t size=class_to_size(c);
+		while(m->count<m->capacity) {
+			if(d.bump+size>d.bump_end) {
+				char* slab=(char*)map_aligned(SLAB_SIZE);
+				SlabHeader* h=(SlabHeader*)slab;
+				h->size_class=c;
+				h->map_size=SLAB_SIZE;
+				d.bump=slab+HEADER_SIZE;
+				d.bump_end=slab+SLAB_SIZE;
+				d.slabs++;
+			}
+			m->objs[m->count++]=d.bump;
+			d.bump+=size;
+		}
+	}
+
+	void* alloc_large(size_t size) {
+		size_t map_size=(size+HEADER_SIZE+4095) & ~4095UL;
+		SlabHeader* h=(SlabHeader*)map_aligned(map_size);
+		h->size_class=CLASS_LARGE;
+		h->map_size=map_size;
+		__atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+		return (char*)h+HEADER_SIZE;
+	}
+
+	void* alloc_slow(ThreadCache& tc, unsigned int c) {
+		Magazine*& loaded=tc.loaded[c];
+		Magazine*& previous=tc.previous[c];
+		if(previous!=NULL && previous->count>0) {
+			Magazine* t=loaded;
+			loaded=previous;
+			previous=t;
+		} else {
+			Depot& d=depots[c].get();
+			futex_mutex_lock(&d.lock);
+			d.exchanges++;
+			Magazine* full=pop(d.full);
+			if(full!=NULL) {
+				// both our magazines are empty, keep one and give the other back
+				if(previous!=NULL) {
+					push(d.empty, previous);
+				}
+				previous=loaded;
+				loaded=full;
+			} else {
+				if(loaded==NULL) {
+					loaded=pop(d.empty);
+				}
+				if(loaded==NULL) {
+					loaded=new_magazine(c);
+				}
+				carve(c, loaded);
+			}
+			futex_mutex_unlock(&d.lock);
+		}
+		return loaded->objs[--loaded->count];
+	}
+
+	void free_slow(ThreadCache& tc, unsigned int c, void* ptr) {
+		Magazine*& loaded=tc.loaded[c];
+		Magazine*& previous=tc.previous[c];
+		if(previous!=NULL && previous->count==0) {
+			Magazine* t=loaded;
+			loaded=previous;
+			previous=t;
+		} else {
+			Depot& d=depots[c].get();
+			futex_mutex_lock(&d.lock);
+			d.exchanges++;
+			// both our magazines are full (or missing), hand one to the depot
+			if(previous!=NULL) {
+				push(d.full, previous);
+			}
+			previous=loaded;
+			loaded=pop(d.empty);
+			futex_mutex_unlock(&d.lock);
+			if(loaded==NULL) {
+				loaded=new_magazine(c);
+			}
+		}
+		loaded->objs[loaded->count++]=ptr;
+	}
+
+	void give_back(Depot& d, Magazine* m) {
+		if(m==NULL) {
+			return;
+		}
+		if(m->count>0) {
+			push(d.full, m);
+		} else {
+			push(d.empty, m);
+		}
+	}
+
+	void flush(ThreadCache& tc) {
+		for(unsigned int c=0; c<NUM_CLASSES; c++) {
+			Depot& d=depots[c].get();
+			futex_mutex_lock(&d.lock);
+			give_back(d, tc.loaded[c]);
+			give_back(d, tc.previous[c]);
+			futex_mutex_unlock(&d.lock);
+			tc.loaded[c]=NULL;
+			tc.previous[c]=NULL;
+		}
+	}
+
+public:
+	// the process wide allocator, never destroyed since threads may outlive main
+	static SlabAllocator& instance() {
+		static SlabAllocator* a=new SlabAllocator();
+		return *a;
+	}
+	void* alloc(size_t size) {
+		if(size>MAX_SMALL) {
+			return alloc_large(size);
+		}
+		unsigned int c=size_to_class(size);
+		ThreadCache& tc=cache();
+		Magazine* m=tc.loaded[c];
+		if(m!=NULL && m->count>0) {
+			return m->objs[--m->count];
+		}
+		return alloc_slow(tc, c);
+	}
+	void free(void* ptr) {
+		if(ptr==NULL) {
+			return;
+		}
+		SlabHeader* h=header_of(ptr);
+		unsigned int c=h->size_class;
+		if(c==CLASS_LARGE) {
+			CHECK_NOT_M1(munmap(h, h->map_size));
+			return;
+		}
+		ThreadCache& tc=cache();
+		Magazine* m=tc.loaded[c];
+		if(m!=NULL && m->count<m->capacity) {
+			m->objs[m->count++]=ptr;
+			return;
+		}
+		free_slow(tc, c, ptr);
+	}
+	// the usable size of an allocation, like malloc_usable_size(3)
+	size_t usable_size(void* ptr) {
+		SlabHeader* h=header_of(ptr);
+		if(h->size_class==CLASS_LARGE) {
+			return h->map_size-HEADER_SIZE;
+		}
+		return class_to_size(h->size_class);
+	}
+	void print_stats() {
+		unsigned long slabs=0;
+		for(unsigned int c=0; c<NUM_CLASSES; c++) {
+			Depot& d=depots[c].get();
+			futex_mutex_lock(&d.lock);
+			if(d.slabs>0) {
+				printf("class %6zd slabs %6lu depot exchanges %10lu\n", class_to_size(c), d.slabs, d.exchanges);
+			}
+			slabs+=d.slabs;
+			futex_mutex_unlock(&d.lock);
+		}
+		printf("total slab memory %lu KB, large allocations %lu\n", slabs*SLAB_SIZE/1024, __atomic_load_n(&large_allocs, __ATOMIC_RELAXED));
+	}
+};
+
+static inline void* slab_malloc(size_t size) {
+	return SlabAllocator::instance().alloc(size);
+}
+
+static inline void slab_free(void* ptr) {
+	SlabAllocator::instance().free(ptr);
+}
+
+#endif	/* !__SlabAllocator_hh */
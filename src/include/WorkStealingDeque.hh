@@ -0,0 +1,141 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WorkStealingDeque_hh
+#define __WorkStealingDeque_hh
+
+#include <firstinclude.h>
+#include <atomic>	// for std::atomic, std::atomic_thread_fence
+#include <vector>	// for std::vector
+
+/*
+ * A Chase-Lev work stealing deque.
+ *
+ * The owner thread pushes and takes at the bottom (LIFO, which is cache
+ * friendly for fork/join), thieves steal from the top (FIFO, they get
+ * the oldest and therefore biggest pieces of work).
+ * Only the owner may call push() and take(). Anyone may call steal().
+ * The buffer grows when full. Old buffers are kept until the deque is
+ * destroyed since a thief may still be reading from them.
+ *
+ * T must be a pointer type (NULL means "nothing").
+ *
+ * References:
+ * "Dynamic Circular Work-Stealing Deque", Chase and Lev, SPAA 2005
+ * "Correct and Efficient Work-Stealing for Weak Memory Models", Le, Pop,
+ * Cohen and Zappa Nardelli, PPoPP 2013 (the memory orders are from here)
+ */
+
+template <class T> class WorkStealingDeque {
+private:
+	class Array {
+	public:
+		long size;
+		long mask;
+		std::atomic<T>* buf;
+		Array(long isize) : size(isize), mask(isize-1), buf(new std::atomic<T>[isize]) {
+		}
+		~Array() {
+			delete[] buf;
+		}
+		T get(long i) {
+			return buf[i & mask].load(std::memory_order_relaxed);
+		}
+		void put(long i, T x) {
+			buf[i & mask].store(x, std::memory_order_relaxed);
+		}
+		Array* grow(long bottom, long top) {
+			Array* a=new Array(size*2);
+			for(long i=top; i<bottom; i++) {
+				a->put(i, get(i));
+			}
+			return a;
+		}
+	};
+	// top and bottom are on different cache lines, thieves hammer top
+	alignas(64) std::atomic<long> top;
+	alignas(64) std::atomic<long> bottom;
+	std::atomic<Array*> array;
+	std::vector<Array*> garbage;
+
+public:
+	WorkStealingDeque(long size=1024) : top(0), bottom(0), array(new Array(size)) {
+	}
+	~WorkStealingDeque() {
+		for(Array* a : garbage) {
+			delete a;
+		}
+		delete array.load();
+	}
+	void push(T x) {
+		long b=bottom.load(std::memory_order_relaxed);
+		long t=top.load(std::memory_order_acquire);
+		Array* a=array.load(std::memory_order_relaxed);
+		if(b-t>a->size-1) {
+			garbage.push_back(a);
+			a=a->grow(b, t);
+			array.store(a, std::memory_order_release);
+		}
+		a->put(b, x);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b+1, std::memory_order_relaxed);
+	}
+	T take() {
+		long b=bottom.load(std::memory_order_relaxed)-1;
+		Array* a=array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long t=top.load(std::memory_order_relaxed);
+		if(t>b) {
+			// empty
+			bottom.store(b+1, std::memory_order_relaxed);
+			return NULL;
+		}
+		T x=a->get(b);
+		if(t==b) {
+			// last element, race against the thieves
+			if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				x=NULL;
+			}
+			bottom.store(b+1, std::memory_order_relaxed);
+		}
+		return x;
+	}
+	T steal() {
+		long t=top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long b=bottom.load(std::memory_order_acquire);
+		if(t>=b) {
+			return NULL;
+		}
+		Array* a=array.load(std::memory_order_acquire);
+		T x=a->get(t);
+		if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			// lost the race to another thief or to the owner
+			return NULL;
+		}
+		return x;
+	}
+	bool empty() {
+		long t=top.load(std::memory_order_relaxed);
+		long b=bottom.load(std::memory_order_relaxed);
+		return b<=t;
+	}
+};
+
+#endif	/* !__WorkStealingDeque_hh */
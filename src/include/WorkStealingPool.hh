@@ -0,0 +1,339 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WorkStealingPool_hh
+#define __WorkStealingPool_hh
+
+#include <firstinclude.h>
+#include <functional>	// for std::function
+#include <deque>	// for std::deque
+#include <pthread.h>	// for pthread_create(3), pthread_join(3), pthread_mutex_*
+#include <stdio.h>	// for printf(3)
+#include <limits.h>	// for INT_MAX
+#include <sched.h>	// for sched_yield(2)
+#include <WorkStealingDeque.hh>	// for WorkStealingDeque
+#include <futex_utils.h>// for futex_wait_checked(), futex_wake()
+#include <atomic_utils.h>	// for cpu_relax()
+#include <cpu_set_utils.h>	// for cpu_set_get_allowed(), cpu_set_get_nth(), cpu_set_pin_self()
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO(), CHECK_NOT_M1(), CHECK_ASSERT()
+
+/*
+ * A work stealing thread pool with fork/join semantics.
+ *
+ * - every worker has its own Chase-Lev deque (see WorkStealingDeque.hh).
+ * A task spawned from a worker goes to the bottom of that workers deque.
+ * - a worker which runs out of work steals from the top of the deque of
+ * a randomly selected victim.
+ * - tasks spawned from threads outside the pool go to a mutex protected
+ * injection queue.
+ * - workers are pinned round robin to the cpus this process is allowed
+ * to run on (pass pin=false to let the scheduler decide).
+ * - a worker which failed to find work for a while parks on a futex.
+ * Spawning only enters the kernel to wake a worker if some are parked.
+ *
+ * Fork/join is done with a TaskGroup:
+ *
+ *	WorkStealingPool::TaskGroup g;
+ *	pool.spawn(g, [&] { left(); });
+ *	pool.spawn(g, [&] { right(); });
+ *	pool.sync(g);
+ *
+ * sync() called from a worker does not block: it runs other tasks (its
+ * own first, then stolen ones) until the group is done. sync() called
+ * from outside the pool sleeps on the group.
+ */
+
+class WorkStealingPool {
+public:
+	/*
+	 * pending is the futex word: the number of unfinished tasks times two,
+	 * the low bit is set when a thread outside the pool sleeps on it.
+	 * The decrement of the last task releases the waiter, which may then
+	 * destroy the group (it is usually on its stack) while the task still
+	 * has to wake it. 'finishing' counts the tasks between their
+	 * decrement and their last touch of the group and sync() only returns
+	 * when it is 0.
+	 */
+	class TaskGroup {
+	public:
+		int pending;
+		int finishing;
+		TaskGroup() : pending(0), finishing(0) {
+		}
+		~TaskGroup() {
+			CHECK_ASSERT((pending >> 1)==0 && finishing==0);
+		}
+	};
+
+private:
+	struct Task {
+		std::function<void()> f;
+		TaskGroup* g;
+	};
+	struct Worker {
+		WorkStealingPool* pool;
+		unsigned int num;
+		pthread_t thread;
+		WorkStealingDeque<Task*> deque;
+		unsigned int seed;
+		unsigned long long executed;
+		unsigned long long stolen;
+		unsigned long long parked;
+	};
+	unsigned int worker_num;
+	Worker** workers;
+	bool pin;
+	int stop;
+	// the futex word idle workers sleep on, bumped whenever new work appears
+	int epoch;
+	int sleepers;
+	pthread_mutex_t inject_mutex;
+	std::deque<Task*> inject;
+	int inject_size;
+	// how many failed rounds of stealing before parking
+	static const unsigned int idle_rounds=64;
+
+	static Worker*& current() {
+		static thread_local Worker* w=NULL;
+		return w;
+	}
+	Worker* current_worker() {
+		Worker* w=current();
+		if(w!=NULL && w->pool==this) {
+			return w;
+		}
+		return NULL;
+	}
+	void notify() {
+		__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST)>0) {
+			CHECK_NOT_M1(futex_wake(&epoch, 1));
+		}
+	}
+	void execute(Worker* w, Task* t) {
+		t->f();
+		TaskGroup* g=t->g;
+		delete t;
+		w->executed++;
+		__atomic_add_fetch(&g->finishing, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_sub_fetch(&g->pending, 2, __ATOMIC_SEQ_CST)==1) {
+			CHECK_NOT_M1(futex_wake(&g->pending, INT_MAX));
+		}
+		// the last touch of the group
+		__atomic_sub_fetch(&g->finishing, 1, __ATOMIC_RELEASE);
+	}
+	// wait for the tasks which are done but may still touch the group, a few instructions and maybe a futex_wake(2)
+	static void wait_finishing(TaskGroup& g) {
+		unsigned int spins=0;
+		while(__atomic_load_n(&g.finishing, __ATOMIC_ACQUIRE)!=0) {
+			if(++spins<idle_rounds) {
+				cpu_relax();
+			} else {
+				// the waker may be preempted, on one cpu it only runs if we let it
+				sched_yield();
+			}
+		}
+	}
+	Task* take_injected() {
+		if(__atomic_load_n(&inject_size, __ATOMIC_ACQUIRE)==0) {
+			return NULL;
+		}
+		Task* t=NULL;
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&inject_mutex));
+		if(!inject.empty()) {
+			t=inject.front();
+			inject.pop_front();
+			__atomic_sub_fetch(&inject_size, 1, __ATOMIC_RELEASE);
+		}
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&inject_mutex));
+		return t;
+	}
+	Task* find_work(Worker* w) {
+		Task* t=w->deque.take();
+		if(t!=NULL) {
+			return t;
+		}
+		t=take_injected();
+		if(t!=NULL) {
+			return t;
+		}
+		// randomized stealing (rand_r(3) would be a libc call per attempt)
+		for(unsigned int i=0; i<worker_num; i++) {
+			w->seed^=w->seed << 13;
+			w->seed^=w->seed >> 17;
+			w->seed^=w->seed << 5;
+			Worker* victim=workers[w->seed%worker_num];
+			if(victim==w) {
+				continue;
+			}
+			t=victim->deque.steal();
+			if(t!=NULL) {
+				w->stolen++;
+				return t;
+			}
+		}
+		return NULL;
+	}
+	bool have_work() {
+		if(__atomic_load_n(&inject_size, __ATOMIC_ACQUIRE)>0) {
+			return true;
+		}
+		for(unsigned int i=0; i<worker_num; i++) {
+			if(!workers[i]->deque.empty()) {
+				return true;
+			}
+		}
+		return false;
+	}
+	void park(Worker* w) {
+		int e=__atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+		// look again after announcing ourselves, work pushed after this
+		// look will bump the epoch and fail the futex_wait
+		if(!have_work() && !__atomic_load_n(&stop, __ATOMIC_SEQ_CST)) {
+			w->parked++;
+			futex_wait_checked(&epoch, e);
+		}
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+	static void* worker_main(void* p) {
+		Worker* w=(Worker*)p;
+		WorkStealingPool* pool=w->pool;
+		current()=w;
+		if(pool->pin) {
+			cpu_set_t set;
+			cpu_set_get_allowed(&set);
+			cpu_set_pin_self(cpu_set_get_nth(&set, w->num));
+		}
+		unsigned int idle=0;
+		while(!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+			Task* t=pool->find_work(w);
+			if(t!=NULL) {
+				idle=0;
+				pool->execute(w, t);
+			} else {
+				if(++idle<idle_rounds) {
+					cpu_relax();
+				} else {
+					idle=0;
+					pool->park(w);
+				}
+			}
+		}
+		current()=NULL;
+		return NULL;
+	}
+
+public:
+	WorkStealingPool(unsigned int iworker_num=0, bool ipin=true) {
+		if(iworker_num==0) {
+			iworker_num=cpu_set_allowed_count();
+		}
+		worker_num=iworker_num;
+		pin=ipin;
+		stop=0;
+		epoch=0;
+		sleepers=0;
+		inject_size=0;
+		CHECK_ZERO_ERRNO(pthread_mutex_init(&inject_mutex, NULL));
+		workers=new Worker*[worker_num];
+		for(unsigned int i=0; i<worker_num; i++) {
+			Worker* w=new Worker();
+			w->pool=this;
+			w->num=i;
+			w->seed=i*2654435761U+1;
+			w->executed=0;
+			w->stolen=0;
+			w->parked=0;
+			workers[i]=w;
+		}
+		for(unsigned int i=0; i<worker_num; i++) {
+			CHECK_ZERO_ERRNO(pthread_create(&workers[i]->thread, NULL, worker_main, workers[i]));
+		}
+	}
+	~WorkStealingPool() {
+		__atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+		CHECK_NOT_M1(futex_wake(&epoch, INT_MAX));
+		for(unsigned int i=0; i<worker_num; i++) {
+			CHECK_ZERO_ERRNO(pthread_join(workers[i]->thread, NULL));
+			delete workers[i];
+		}
+		delete[] workers;
+		CHECK_ASSERT(inject.empty());
+		CHECK_ZERO_ERRNO(pthread_mutex_destroy(&inject_mutex));
+	}
+	unsigned int size() {
+		return worker_num;
+	}
+	void spawn(TaskGroup& g, std::function<void()> f) {
+		Task* t=new Task();
+		t->f=std::move(f);
+		t->g=&g;
+		__atomic_add_fetch(&g.pending, 2, __ATOMIC_SEQ_CST);
+		Worker* w=current_worker();
+		if(w!=NULL) {
+			w->deque.push(t);
+		} else {
+			CHECK_ZERO_ERRNO(pthread_mutex_lock(&inject_mutex));
+			inject.push_back(t);
+			__atomic_add_fetch(&inject_size, 1, __ATOMIC_RELEASE);
+			CHECK_ZERO_ERRNO(pthread_mutex_unlock(&inject_mutex));
+		}
+		notify();
+	}
+	void sync(TaskGroup& g) {
+		Worker* w=current_worker();
+		if(w!=NULL) {
+			// help until the group is done
+			while((__atomic_load_n(&g.pending, __ATOMIC_ACQUIRE) >> 1)!=0) {
+				Task* t=find_work(w);
+				if(t!=NULL) {
+					execute(w, t);
+				} else {
+					cpu_relax();
+				}
+			}
+		} else {
+			int c;
+			while(((c=__atomic_load_n(&g.pending, __ATOMIC_ACQUIRE)) >> 1)!=0) {
+				if((c & 1)==0) {
+					// announce that we are going to sleep
+					__atomic_compare_exchange_n(&g.pending, &c, c | 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+					continue;
+				}
+				futex_wait_checked(&g.pending, c);
+			}
+		}
+		wait_finishing(g);
+	}
+	// run a single function in the pool and wait for it
+	void run(std::function<void()> f) {
+		TaskGroup g;
+		spawn(g, std::move(f));
+		sync(g);
+	}
+	void print_stats() {
+		for(unsigned int i=0; i<worker_num; i++) {
+			Worker* w=workers[i];
+			printf("worker %u: executed %llu, stolen %llu, parked %llu\n", i, w->executed, w->stolen, w->parked);
+		}
+	}
+};
+
+#endif	/* !__WorkStealingPool_hh */
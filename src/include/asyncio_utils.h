@@ -0,0 +1,320 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __asyncio_utils_h
+#define __asyncio_utils_h
+
+/*
+ * Batched asynchronous reads with the two native Linux interfaces:
+ * - io_uring(7): two rings shared with the kernel, requests are put in
+ * the submission ring and results taken from the completion ring, one
+ * io_uring_enter(2) both submits a batch and waits for completions.
+ * - native aio: io_setup(2), io_submit(2), io_getevents(2). Only really
+ * asynchronous for O_DIRECT files, on buffered files io_submit(2) blocks.
+ * Both are used through raw system calls (glibc has no wrappers and this
+ * way neither liburing nor libaio is needed).
+ *
+ * Unlike POSIX aio(7) in glibc, which emulates asynchronous IO with
+ * threads doing blocking reads, these keep many reads in the device
+ * queue from one thread.
+ *
+ * Use:
+ *	asyncio_init(&a, ASYNCIO_URING, depth);
+ *	asyncio_prep_read(&a, fd, buf, len, offset, data); (up to depth in flight)
+ *	n=asyncio_submit_and_wait(&a, 1, completions, depth);
+ *	... completions[i].data and completions[i].res ...
+ *	asyncio_free(&a);
+ *
+ * asyncio_pool is a pool of aligned buffers for O_DIRECT.
+ *
+ * References:
+ * https://kernel.dk/io_uring.pdf
+ * man 2 io_uring_setup, man 2 io_uring_enter, man 2 io_submit
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/syscall.h>	// for SYS_io_setup, SYS_io_submit, SYS_io_getevents, SYS_io_destroy, __NR_io_uring_setup, __NR_io_uring_enter
+#include <unistd.h>	// for syscall(2), close(2)
+#include <sys/mman.h>	// for mmap(2), munmap(2)
+#include <linux/io_uring.h>	// for struct io_uring_params, struct io_uring_sqe, struct io_uring_cqe
+#include <linux/aio_abi.h>	// for aio_context_t, struct iocb, struct io_event, IOCB_CMD_PREAD
+#include <stdlib.h>	// for malloc(3), free(3), posix_memalign(3)
+#include <string.h>	// for memset(3)
+#include <stdint.h>	// for uint64_t
+#include <errno.h>	// for errno
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_NULL(), CHECK_ASSERT(), CHECK_ZERO_ERRNO(), CHECK_NOT_VOIDP()
+
+typedef enum _asyncio_backend {
+	ASYNCIO_URING,
+	ASYNCIO_AIO,
+	ASYNCIO_BACKENDS,
+} asyncio_backend;
+
+static inline const char* asyncio_backend_name(int backend) {
+	static const char* names[ASYNCIO_BACKENDS]={
+		"uring", "aio",
+	};
+	CHECK_ASSERT(backend>=0 && backend<ASYNCIO_BACKENDS);
+	return names[backend];
+}
+
+typedef struct _asyncio_completion {
+	void* data;
+	// bytes read or -errno
+	long res;
+} asyncio_completion;
+
+typedef struct _asyncio {
+	asyncio_backend backend;
+	unsigned int depth;
+	// prepared and not yet submitted
+	unsigned int pending;
+	// io_uring
+	int ring_fd;
+	void* sq_ptr;
+	size_t sq_size;
+	void* cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_tail;
+	unsigned int sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe* cqes;
+	// native aio
+	aio_context_t ctx;
+	struct iocb* iocbs;
+	struct iocb** iocbps;
+	struct io_event* events;
+} asyncio;
+
+static inline int asyncio_init_uring(asyncio* a) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	a->ring_fd=syscall(__NR_io_uring_setup, a->depth, &p);
+	if(a->ring_fd==-1) {
+		return -1;
+	}
+	a->sq_size=p.sq_off.array+p.sq_entries*sizeof(unsigned int);
+	a->cq_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(a->cq_size>a->sq_size) {
+			a->sq_size=a->cq_size;
+		}
+		a->cq_size=0;
+	}
+	a->sq_ptr=CHECK_NOT_VOIDP(mmap(NULL, a->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQ_RING), MAP_FAILED);
+	if(a->cq_size==0) {
+		a->cq_ptr=a->sq_ptr;
+	} else {
+		a->cq_ptr=CHECK_NOT_VOIDP(mmap(NULL, a->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_CQ_RING), MAP_FAILED);
+	}
+	a->sqes_size=p.sq_entries*sizeof(struct io_uring_sqe);
+	a->sqes=(struct io_uring_sqe*)CHECK_NOT_VOIDP(mmap(NULL, a->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQES), MAP_FAILED);
+	char* sq=(char*)a->sq_ptr;
+	char* cq=(char*)a->cq_ptr;
+	a->sq_tail=(unsigned int*)(sq+p.sq_off.tail);
+	a->sq_mask=*(unsigned int*)(sq+p.sq_off.ring_mask);
+	a->sq_array=(unsigned int*)(sq+p.sq_off.array);
+	a->cq_head=(unsigned int*)(cq+p.cq_off.head);
+	a->cq_tail=(unsigned int*)(cq+p.cq_off.tail);
+	a->cq_mask=*(unsigned int*)(cq+p.cq_off.ring_mask);
+	a->cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+	return 0;
+}
+
+static inline int asyncio_init_aio(asyncio* a) {
+	a->ctx=0;
+	if(syscall(SYS_io_setup, a->depth, &a->ctx)==-1) {
+		return -1;
+	}
+	a->iocbs=(struct iocb*)CHECK_NOT_NULL(malloc(a->depth*sizeof(struct iocb)));
+	a->iocbps=(struct iocb**)CHECK_NOT_NULL(malloc(a->depth*sizeof(struct iocb*)));
+	a->events=(struct io_event*)CHECK_NOT_NULL(malloc(a->depth*sizeof(struct io_event)));
+	for(unsigned int i=0; i<a->depth; i++) {
+		a->iocbps[i]=a->iocbs+i;
+	}
+	return 0;
+}
+
+/*
+ * Returns -1 (and errno) if the backend is not available (old kernel,
+ * io_uring disabled by sysctl or seccomp, aio-max-nr reached)
+ */
+static inline int asyncio_init(asyncio* a, asyncio_backend backend, unsigned int depth) {
+	memset(a, 0, sizeof(*a));
+	a->backend=backend;
+	a->depth=depth;
+	if(backend==ASYNCIO_URING) {
+		return asyncio_init_uring(a);
+	}
+	return asyncio_init_aio(a);
+}
+
+static inline void asyncio_free(asyncio* a) {
+	if(a->backend==ASYNCIO_URING) {
+		CHECK_NOT_M1(munmap(a->sqes, a->sqes_size));
+		if(a->cq_ptr!=a->sq_ptr) {
+			CHECK_NOT_M1(munmap(a->cq_ptr, a->cq_size));
+		}
+		CHECK_NOT_M1(munmap(a->sq_ptr, a->sq_size));
+		CHECK_NOT_M1(close(a->ring_fd));
+	} else {
+		CHECK_NOT_M1(syscall(SYS_io_destroy, a->ctx));
+		free(a->events);
+		free(a->iocbps);
+		free(a->iocbs);
+	}
+}
+
+/*
+ * Queue a read, it goes to the kernel at the next asyncio_submit_and_wait().
+ * The caller must not have more than 'depth' reads in flight.
+ */
+static inline void asyncio_prep_read(asyncio* a, int fd, void* buf, size_t len, off_t offset, void* data) {
+	CHECK_ASSERT(a->pending<a->depth);
+	if(a->backend==ASYNCIO_URING) {
+		// only we write the tail
+		unsigned int tail=*a->sq_tail;
+		unsigned int index=tail & a->sq_mask;
+		struct io_uring_sqe* sqe=a->sqes+index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode=IORING_OP_READ;
+		sqe->fd=fd;
+		sqe->addr=(uint64_t)buf;
+		sqe->len=len;
+		sqe->off=offset;
+		sqe->user_data=(uint64_t)data;
+		a->sq_array[index]=index;
+		// the kernel must see the entry before the new tail
+		__atomic_store_n(a->sq_tail, tail+1, __ATOMIC_RELEASE);
+	} else {
+		struct iocb* cb=a->iocbs+a->pending;
+		memset(cb, 0, sizeof(*cb));
+		cb->aio_lio_opcode=IOCB_CMD_PREAD;
+		cb->aio_fildes=fd;
+		cb->aio_buf=(uint64_t)buf;
+		cb->aio_nbytes=len;
+		cb->aio_offset=offset;
+		cb->aio_data=(uint64_t)data;
+	}
+	a->pending++;
+}
+
+static inline unsigned int asyncio_reap_uring(asyncio* a, asyncio_completion* out, unsigned int max) {
+	unsigned int head=*a->cq_head;
+	// the entries must be read after the tail
+	unsigned int tail=__atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int n=0;
+	while(head!=tail && n<max) {
+		struct io_uring_cqe* cqe=a->cqes+(head & a->cq_mask);
+		out[n].data=(void*)cqe->user_data;
+		out[n].res=cqe->res;
+		n++;
+		head++;
+	}
+	// and the kernel may reuse them after the head moves
+	__atomic_store_n(a->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/*
+ * Submit everything prepared and wait for at least 'min' completions,
+ * return how many completions were put in 'out' (at most 'max')
+ */
+static inline unsigned int asyncio_submit_and_wait(asyncio* a, unsigned int min, asyncio_completion* out, unsigned int max) {
+	if(a->backend==ASYNCIO_URING) {
+		unsigned int n=asyncio_reap_uring(a, out, max);
+		if(a->pending==0 && n>=min) {
+			return n;
+		}
+		unsigned int wait=n>=min ? 0 : min-n;
+		unsigned int flags=wait>0 ? IORING_ENTER_GETEVENTS : 0;
+		// the kernel may take only part of the queue (and then does not wait), the rest stays in the ring
+		do {
+			int ret=syscall(__NR_io_uring_enter, a->ring_fd, a->pending, wait, flags, NULL, 0);
+			if(ret==-1 && errno==EINTR) {
+				continue;
+			}
+			a->pending-=CHECK_NOT_M1(ret);
+		} while(a->pending>0);
+		return n+asyncio_reap_uring(a, out+n, max-n);
+	}
+	unsigned int submitted=0;
+	while(submitted<a->pending) {
+		submitted+=CHECK_NOT_M1(syscall(SYS_io_submit, a->ctx, a->pending-submitted, a->iocbps+submitted));
+	}
+	a->pending=0;
+	if(max>a->depth) {
+		max=a->depth;
+	}
+	long ret;
+	do {
+		ret=syscall(SYS_io_getevents, a->ctx, min, max, a->events, NULL);
+	} while(ret==-1 && errno==EINTR);
+	CHECK_NOT_M1(ret);
+	for(long i=0; i<ret; i++) {
+		out[i].data=(void*)a->events[i].data;
+		out[i].res=a->events[i].res;
+	}
+	return ret;
+}
+
+/*
+ * A pool of aligned buffers
+ */
+typedef struct _asyncio_pool {
+	char* mem;
+	size_t size;
+	unsigned int* free;
+	unsigned int nfree;
+} asyncio_pool;
+
+static inline void asyncio_pool_init(asyncio_pool* p, unsigned int count, size_t size, size_t alignment) {
+	// keep every buffer aligned
+	p->size=(size+alignment-1)/alignment*alignment;
+	void* mem;
+	CHECK_ZERO_ERRNO(posix_memalign(&mem, alignment, count*p->size));
+	p->mem=(char*)mem;
+	p->free=(unsigned int*)CHECK_NOT_NULL(malloc(count*sizeof(unsigned int)));
+	for(unsigned int i=0; i<count; i++) {
+		p->free[i]=i;
+	}
+	p->nfree=count;
+}
+
+static inline void* asyncio_pool_get(asyncio_pool* p) {
+	CHECK_ASSERT(p->nfree>0);
+	return p->mem+p->free[--p->nfree]*p->size;
+}
+
+static inline void asyncio_pool_put(asyncio_pool* p, void* buf) {
+	p->free[p->nfree++]=((char*)buf-p->mem)/p->size;
+}
+
+static inline void asyncio_pool_free(asyncio_pool* p) {
+	free(p->free);
+	free(p->mem);
+}
+
+#endif	/* !__asyncio_utils_h */
@@ -32,4 +32,18 @@
 # define atomic_full_barrier() asm volatile ("" ::: "memory")
 #endif
 
+/*
+ * Tell the cpu that we are in a spin loop. On intel this is the 'pause'
+ * instruction (rep;nop) which saves power and avoids a memory order
+ * violation pipeline flush when the loop exits.
+ * See examples/synchronization/rep_nop.cc
+ */
+static inline void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__ ("rep;nop" : : : "memory");
+#else
+	__asm__ __volatile__ ("" : : : "memory");
+#endif
+}
+
 #endif	/* !__atomic_utils_h */
@@ -0,0 +1,249 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __branchless_utils_h
+#define __branchless_utils_h
+
+/*
+ * Branchless selection: when the condition depends on the data and the
+ * data is random, a branch is mispredicted half of the time and every
+ * misprediction costs 15-20 cycles. Computing both sides and selecting
+ * with a mask costs a couple of cycles, always.
+ *
+ * - branchless_select for 32 and 64 bit integers picks one of two values
+ * with a mask. The compiler often turns a ?: into a cmov on its own but
+ * it does not have to (and does not when it guesses that the branch is
+ * predictable), this is always branchless.
+ * - branchless_min/max/clamp are written as ?: on purpose: the compiler
+ * recognizes this form as a MIN/MAX operation which becomes a cmov (or
+ * pminsd/pmaxsd when the loop is vectorized), which beats the mask. Unlike
+ * the (a-b)>>31 trick in performance/min_max_without_branching.cc they
+ * do not overflow.
+ * - branchless_filter_gt_i32() copies the elements which are bigger than
+ * a threshold (the "WHERE x>t" of a database). The scalar branchless
+ * version always writes and advances the output by 0 or 1. The AVX2
+ * version compares 8 elements at once and compacts the ones which pass
+ * with one permute whose indices come from a table of all 256 masks
+ * (AVX2 has no compress instruction, AVX-512 has and uses it).
+ * - branchless_partition_i32() splits an array into the elements which
+ * are bigger than a pivot and the rest (the inner loop of quicksort),
+ * the same way (AVX-512 with two compressing stores, one per side).
+ *
+ * Notes:
+ * - the filters and partitions may be done in place (out==in).
+ * - the AVX2 versions store 8 elements at a time at the output position,
+ * which is never ahead of the input position, so the output needs no
+ * room beyond n elements.
+ *
+ * References:
+ * https://lemire.me/blog/2017/04/10/removing-duplicates-from-lists-quickly/
+ * https://arxiv.org/abs/1604.01697 (Bramas, a fast vectorized sorting implementation based on AVX-512)
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <stddef.h>	// for size_t
+#include <stdint.h>	// for int32_t, int64_t
+#include <immintrin.h>	// for _mm256_cmpgt_epi32(), _mm256_permutevar8x32_epi32(), _mm512_mask_compressstoreu_epi32()
+
+static inline int32_t branchless_select_i32(int cond, int32_t a, int32_t b) {
+	// all ones if cond, all zeros if not
+	int32_t mask=-(int32_t)(cond!=0);
+	return b ^ ((a ^ b) & mask);
+}
+
+static inline int64_t branchless_select_i64(int cond, int64_t a, int64_t b) {
+	int64_t mask=-(int64_t)(cond!=0);
+	return b ^ ((a ^ b) & mask);
+}
+
+static inline int32_t branchless_min_i32(int32_t a, int32_t b) {
+	return a<b ? a : b;
+}
+
+static inline int32_t branchless_max_i32(int32_t a, int32_t b) {
+	return a>b ? a : b;
+}
+
+static inline int32_t branchless_clamp_i32(int32_t x, int32_t lo, int32_t hi) {
+	return branchless_min_i32(branchless_max_i32(x, lo), hi);
+}
+
+static inline int64_t branchless_min_i64(int64_t a, int64_t b) {
+	return a<b ? a : b;
+}
+
+static inline int64_t branchless_max_i64(int64_t a, int64_t b) {
+	return a>b ? a : b;
+}
+
+static inline int64_t branchless_clamp_i64(int64_t x, int64_t lo, int64_t hi) {
+	return branchless_min_i64(branchless_max_i64(x, lo), hi);
+}
+
+/*
+ * Copy the elements of 'in' bigger than 'threshold' to 'out', return
+ * how many there are.
+ */
+static inline size_t branchless_filter_gt_i32_scalar(const int32_t* in, size_t n, int32_t threshold, int32_t* out) {
+	size_t k=0;
+	for(size_t i=0; i<n; i++) {
+		int32_t v=in[i];
+		out[k]=v;
+		k+=v>threshold;
+	}
+	return k;
+}
+
+/*
+ * For every 8 bit mask, the indices of its set bits first. Filled once
+ * at startup, before any thread can use it.
+ */
+static int32_t branchless_compress_table[256][8];
+
+__attribute__((constructor)) static void branchless_compress_table_init(void) {
+	for(int mask=0; mask<256; mask++) {
+		int k=0;
+		for(int bit=0; bit<8; bit++) {
+			if(mask & (1 << bit)) {
+				branchless_compress_table[mask][k++]=bit;
+			}
+		}
+		// the rest does not matter, it is overwritten or beyond the result
+		for(; k<8; k++) {
+			branchless_compress_table[mask][k]=0;
+		}
+	}
+}
+
+__attribute__((target("avx2,popcnt"))) static inline size_t branchless_filter_gt_i32_avx2(const int32_t* in, size_t n, int32_t threshold, int32_t* out) {
+	__m256i t=_mm256_set1_epi32(threshold);
+	size_t k=0;
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		__m256i v=_mm256_loadu_si256((const __m256i*)(in+i));
+		unsigned int mask=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, t)));
+		__m256i perm=_mm256_loadu_si256((const __m256i*)branchless_compress_table[mask]);
+		_mm256_storeu_si256((__m256i*)(out+k), _mm256_permutevar8x32_epi32(v, perm));
+		k+=__builtin_popcount(mask);
+	}
+	return k+branchless_filter_gt_i32_scalar(in+i, n-i, threshold, out+k);
+}
+
+__attribute__((target("avx512f"))) static inline size_t branchless_filter_gt_i32_avx512(const int32_t* in, size_t n, int32_t threshold, int32_t* out) {
+	__m512i t=_mm512_set1_epi32(threshold);
+	size_t k=0;
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m512i v=_mm512_loadu_si512(in+i);
+		__mmask16 mask=_mm512_cmpgt_epi32_mask(v, t);
+		_mm512_mask_compressstoreu_epi32(out+k, mask, v);
+		k+=__builtin_popcount(mask);
+	}
+	return k+branchless_filter_gt_i32_scalar(in+i, n-i, threshold, out+k);
+}
+
+/*
+ * Elements bigger than 'pivot' go to 'high', the rest to 'low'. Returns
+ * the number of high elements. 'low' may be 'in'.
+ */
+static inline size_t branchless_partition_i32_scalar(const int32_t* in, size_t n, int32_t pivot, int32_t* low, int32_t* high) {
+	size_t kl=0;
+	size_t kh=0;
+	for(size_t i=0; i<n; i++) {
+		int32_t v=in[i];
+		int gt=v>pivot;
+		low[kl]=v;
+		high[kh]=v;
+		kl+=1-gt;
+		kh+=gt;
+	}
+	return kh;
+}
+
+__attribute__((target("avx2,popcnt"))) static inline size_t branchless_partition_i32_avx2(const int32_t* in, size_t n, int32_t pivot, int32_t* low, int32_t* high) {
+	__m256i p=_mm256_set1_epi32(pivot);
+	size_t kl=0;
+	size_t kh=0;
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		__m256i v=_mm256_loadu_si256((const __m256i*)(in+i));
+		unsigned int mask=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, p)));
+		__m256i ph=_mm256_loadu_si256((const __m256i*)branchless_compress_table[mask]);
+		__m256i pl=_mm256_loadu_si256((const __m256i*)branchless_compress_table[mask ^ 0xff]);
+		_mm256_storeu_si256((__m256i*)(high+kh), _mm256_permutevar8x32_epi32(v, ph));
+		_mm256_storeu_si256((__m256i*)(low+kl), _mm256_permutevar8x32_epi32(v, pl));
+		unsigned int count=__builtin_popcount(mask);
+		kh+=count;
+		kl+=8-count;
+	}
+	return kh+branchless_partition_i32_scalar(in+i, n-i, pivot, low+kl, high+kh);
+}
+
+__attribute__((target("avx512f"))) static inline size_t branchless_partition_i32_avx512(const int32_t* in, size_t n, int32_t pivot, int32_t* low, int32_t* high) {
+	__m512i p=_mm512_set1_epi32(pivot);
+	size_t kl=0;
+	size_t kh=0;
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m512i v=_mm512_loadu_si512(in+i);
+		__mmask16 mask=_mm512_cmpgt_epi32_mask(v, p);
+		_mm512_mask_compressstoreu_epi32(high+kh, mask, v);
+		_mm512_mask_compressstoreu_epi32(low+kl, (__mmask16)~mask, v);
+		unsigned int count=__builtin_popcount(mask);
+		kh+=count;
+		kl+=16-count;
+	}
+	return kh+branchless_partition_i32_scalar(in+i, n-i, pivot, low+kl, high+kh);
+}
+
+static inline int branchless_have_avx2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+static inline int branchless_have_avx512(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+/*
+ * The best version for this cpu
+ */
+static inline size_t branchless_filter_gt_i32(const int32_t* in, size_t n, int32_t threshold, int32_t* out) {
+	if(branchless_have_avx512()) {
+		return branchless_filter_gt_i32_avx512(in, n, threshold, out);
+	}
+	if(branchless_have_avx2()) {
+		return branchless_filter_gt_i32_avx2(in, n, threshold, out);
+	}
+	return branchless_filter_gt_i32_scalar(in, n, threshold, out);
+}
+
+static inline size_t branchless_partition_i32(const int32_t* in, size_t n, int32_t pivot, int32_t* low, int32_t* high) {
+	if(branchless_have_avx512()) {
+		return branchless_partition_i32_avx512(in, n, pivot, low, high);
+	}
+	if(branchless_have_avx2()) {
+		return branchless_partition_i32_avx2(in, n, pivot, low, high);
+	}
+	return branchless_partition_i32_scalar(in, n, pivot, low, high);
+}
+
+#endif	/* !__branchless_utils_h */
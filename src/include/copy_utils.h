@@ -0,0 +1,356 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __copy_utils_h
+#define __copy_utils_h
+
+/*
+ * Copying files the fastest way the kernel and the file systems allow.
+ *
+ * The strategies, from best to worst:
+ * - clone: ioctl(FICLONE) shares the extents of the source with the
+ * destination (btrfs, xfs, bcachefs, ocfs2), nothing is copied and it
+ * takes the same time for any size.
+ * - range: copy_file_range(2) copies inside the kernel. The file system
+ * may turn it into a reflink or a server side copy (nfs, cifs), else
+ * the kernel copies through the page cache.
+ * - sendfile: sendfile(2), a copy inside the kernel for older kernels and
+ * cross file system copies (copy_file_range(2) across file systems only
+ * works from 5.19 and not for every file system).
+ * - splice: splice(2) through a pipe enlarged with F_SETPIPE_SZ, which
+ * works for anything that can be spliced.
+ * - readwrite: pread(2)/pwrite(2) with a big page aligned buffer, which
+ * works for everything.
+ *
+ * copy_fd() with COPY_AUTO tries them in this order and falls back when
+ * a strategy is not supported for these files (EXDEV, EINVAL, ENOSYS,
+ * EOPNOTSUPP...). All strategies except clone are sparse aware: only the
+ * data segments of the source (found with SEEK_DATA/SEEK_HOLE) are
+ * copied and the output is extended with ftruncate(2) at the end, so
+ * holes stay holes and are not read at all.
+ * Inputs that are not regular files (pipes) are read until end of file
+ * with read(2)/write(2), and so are regular files of size 0 whatever the
+ * strategy: /proc and /sys files say 0 and have content, an empty file
+ * is done with one read(2).
+ *
+ * Notes:
+ * - errors other than "not supported" are fatal, like in the rest of
+ * these utilities.
+ * - falling back is decided per data segment, on the first call for the
+ * segment: the segments already copied stay as they are and the rest go
+ * with the next strategy. An error in the middle of a segment is an
+ * error.
+ *
+ * References:
+ * man 2 copy_file_range, man 2 ioctl_ficlone, man 2 lseek (SEEK_DATA)
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t, loff_t
+#include <sys/stat.h>	// for fstat(2), struct stat
+#include <sys/ioctl.h>	// for ioctl(2)
+#include <sys/sendfile.h>	// for sendfile(2)
+#include <linux/fs.h>	// for FICLONE
+#include <fcntl.h>	// for open(2), splice(2), fcntl(2), F_SETPIPE_SZ, posix_fadvise(2)
+#include <unistd.h>	// for copy_file_range(2), lseek(2), read(2), write(2), pread(2), pwrite(2), ftruncate(2), pipe(2), close(2)
+#include <errno.h>	// for errno, EXDEV, EINVAL, ENOSYS, EOPNOTSUPP, ENXIO
+#include <stdlib.h>	// for posix_memalign(3), free(3)
+#include <string.h>	// for strcmp(3)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ZERO_ERRNO(), CHECK_ASSERT(), CHECK_ERROR()
+
+typedef enum _copy_strategy {
+	COPY_AUTO,
+	COPY_CLONE,
+	COPY_RANGE,
+	COPY_SENDFILE,
+	COPY_SPLICE,
+	COPY_READWRITE,
+	COPY_STRATEGIES,
+} copy_strategy;
+
+static const char* copy_strategy_names[COPY_STRATEGIES]={
+	"auto", "clone", "range", "sendfile", "splice", "readwrite",
+};
+
+static inline const char* copy_strategy_name(copy_strategy s) {
+	CHECK_ASSERT(s>=0 && s<COPY_STRATEGIES);
+	return copy_strategy_names[s];
+}
+
+static inline copy_strategy copy_strategy_parse(const char* name) {
+	for(int s=0; s<COPY_STRATEGIES; s++) {
+		if(strcmp(name, copy_strategy_names[s])==0) {
+			return (copy_strategy)s;
+		}
+	}
+	CHECK_ERROR("unknown copy strategy");
+	return COPY_AUTO;
+}
+
+/*
+ * The chunk sizes: a call per chunk for the in kernel strategies, the
+ * buffer size for readwrite
+ */
+static const size_t copy_chunk=1024*1024*1024;
+static const size_t copy_pipe_size=1024*1024;
+static const size_t copy_buffer_size=1024*1024;
+
+/*
+ * Is this error a "this strategy does not work for these files"?
+ */
+static inline int copy_not_supported(int err) {
+	return err==EXDEV || err==EINVAL || err==ENOSYS || err==EOPNOTSUPP;
+}
+
+/*
+ * In a copy loop: if the first call failed because the strategy is not
+ * supported return -1 so that the caller can fall back, any other
+ * failure is fatal
+ */
+#define COPY_CHECK_FIRST(ret, copied) \
+	do { \
+		if((ret)==-1) { \
+			if((copied)==0 && copy_not_supported(errno)) { \
+				return -1; \
+			} \
+			CHECK_NOT_M1(ret); \
+		} \
+	} while(0)
+
+/*
+ * The copy of one segment [off, off+len) of fdin into the same place in
+ * fdout with one strategy. Return 0 or -1 if the strategy is not
+ * supported, in which case nothing was copied.
+ */
+static inline int copy_segment_range(int fdin, int fdout, off_t off, size_t len) {
+	loff_t off_in=off;
+	loff_t off_out=off;
+	size_t copied=0;
+	while(copied<len) {
+		size_t ask=len-copied < copy_chunk ? len-copied : copy_chunk;
+		ssize_t ret=copy_file_range(fdin, &off_in, fdout, &off_out, ask, 0);
+		COPY_CHECK_FIRST(ret, copied);
+		if(ret==0) {
+			// the file shrank under us
+			break;
+		}
+		copied+=ret;
+	}
+	return 0;
+}
+
+static inline int copy_segment_sendfile(int fdin, int fdout, off_t off, size_t len) {
+	CHECK_NOT_M1(lseek(fdout, off, SEEK_SET));
+	off_t off_in=off;
+	size_t copied=0;
+	while(copied<len) {
+		size_t ask=len-copied < copy_chunk ? len-copied : copy_chunk;
+		ssize_t ret=sendfile(fdout, fdin, &off_in, ask);
+		COPY_CHECK_FIRST(ret, copied);
+		if(ret==0) {
+			break;
+		}
+		copied+=ret;
+	}
+	return 0;
+}
+
+static inline int copy_segment_splice(int fdin, int fdout, off_t off, size_t len) {
+	int pipe_fds[2];
+	CHECK_NOT_M1(pipe(pipe_fds));
+	// a bigger pipe means fewer calls, it is ok if we are not allowed
+	int pipe_size=fcntl(pipe_fds[1], F_SETPIPE_SZ, copy_pipe_size);
+	if(pipe_size==-1) {
+		pipe_size=CHECK_NOT_M1(fcntl(pipe_fds[1], F_GETPIPE_SZ));
+	}
+	loff_t off_in=off;
+	loff_t off_out=off;
+	size_t copied=0;
+	int ret_value=0;
+	while(copied<len) {
+		size_t ask=len-copied < (size_t)pipe_size ? len-copied : (size_t)pipe_size;
+		ssize_t ret=splice(fdin, &off_in, pipe_fds[1], NULL, ask, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(ret==-1 && copied==0 && copy_not_supported(errno)) {
+			ret_value=-1;
+			break;
+		}
+		CHECK_NOT_M1(ret);
+		if(ret==0) {
+			break;
+		}
+		ssize_t in_pipe=ret;
+		while(in_pipe>0) {
+			ssize_t out=splice(pipe_fds[0], NULL, fdout, &off_out, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+			CHECK_NOT_M1(out);
+			in_pipe-=out;
+		}
+		copied+=ret;
+	}
+	CHECK_NOT_M1(close(pipe_fds[0]));
+	CHECK_NOT_M1(close(pipe_fds[1]));
+	return ret_value;
+}
+
+static inline int copy_segment_readwrite(int fdin, int fdout, off_t off, size_t len) {
+	void* buf;
+	CHECK_ZERO_ERRNO(posix_memalign(&buf, 4096, copy_buffer_size));
+	size_t copied=0;
+	while(copied<len) {
+		size_t ask=len-copied < copy_buffer_size ? len-copied : copy_buffer_size;
+		ssize_t ret=CHECK_NOT_M1(pread(fdin, buf, ask, off+copied));
+		if(ret==0) {
+			break;
+		}
+		ssize_t written=0;
+		while(written<ret) {
+			written+=CHECK_NOT_M1(pwrite(fdout, (char*)buf+written, ret-written, off+copied+written));
+		}
+		copied+=ret;
+	}
+	free(buf);
+	return 0;
+}
+
+static inline int copy_segment(copy_strategy s, int fdin, int fdout, off_t off, size_t len) {
+	switch(s) {
+	case COPY_RANGE:
+		return copy_segment_range(fdin, fdout, off, len);
+	case COPY_SENDFILE:
+		return copy_segment_sendfile(fdin, fdout, off, len);
+	case COPY_SPLICE:
+		return copy_segment_splice(fdin, fdout, off, len);
+	case COPY_READWRITE:
+		return copy_segment_readwrite(fdin, fdout, off, len);
+	default:
+		CHECK_ERROR("not a segment strategy");
+		return -1;
+	}
+}
+
+/*
+ * Copy all the data segments of fdin with strategy s, falling back to
+ * the next strategy if 'fallback' and s is not supported. Return the
+ * strategy that was used or -1.
+ */
+static inline int copy_segments(int fdin, int fdout, off_t size, copy_strategy s, int fallback) {
+	off_t off=0;
+	while(off<size) {
+		off_t data=lseek(fdin, off, SEEK_DATA);
+		if(data==-1) {
+			if(errno==ENXIO) {
+				// only a hole from here to the end
+				break;
+			}
+			// no SEEK_DATA on this file system, all of it is data
+			CHECK_ASSERT(errno==EINVAL);
+			data=off;
+		}
+		off_t hole=lseek(fdin, data, SEEK_HOLE);
+		if(hole==-1) {
+			hole=size;
+		}
+		if(hole>size) {
+			hole=size;
+		}
+		while(copy_segment(s, fdin, fdout, data, hole-data)==-1) {
+			if(!fallback || s==COPY_READWRITE) {
+				return -1;
+			}
+			s=(copy_strategy)(s+1);
+		}
+		off=hole;
+	}
+	// the trailing hole, and the holes when nothing was written after them (not for /dev/null or a pipe)
+	struct stat st;
+	CHECK_NOT_M1(fstat(fdout, &st));
+	if(S_ISREG(st.st_mode)) {
+		CHECK_NOT_M1(ftruncate(fdout, size));
+	}
+	return s;
+}
+
+/*
+ * Copy from the current position of fdin until end of file with read(2)
+ * and write(2), for inputs which have no size to go by
+ */
+static inline size_t copy_stream(int fdin, int fdout) {
+	void* buf;
+	CHECK_ZERO_ERRNO(posix_memalign(&buf, 4096, copy_buffer_size));
+	size_t total=0;
+	ssize_t ret;
+	while((ret=CHECK_NOT_M1(read(fdin, buf, copy_buffer_size)))>0) {
+		ssize_t written=0;
+		while(written<ret) {
+			written+=CHECK_NOT_M1(write(fdout, (char*)buf+written, ret-written));
+		}
+		total+=ret;
+	}
+	free(buf);
+	return total;
+}
+
+/*
+ * Copy the whole content of fdin into fdout, which should be empty.
+ * Return the strategy that was used, COPY_AUTO if there was nothing to
+ * copy, or -1 if the one asked for is not supported for these files.
+ */
+static inline int copy_fd(int fdin, int fdout, copy_strategy s) {
+	struct stat st;
+	CHECK_NOT_M1(fstat(fdin, &st));
+	// pipes, sockets and devices are read until end of file
+	if(!S_ISREG(st.st_mode)) {
+		if(s!=COPY_AUTO && s!=COPY_READWRITE) {
+			return -1;
+		}
+		copy_stream(fdin, fdout);
+		return COPY_READWRITE;
+	}
+	// empty, or a /proc or /sys file which does not know its size
+	if(st.st_size==0) {
+		return copy_stream(fdin, fdout)==0 ? COPY_AUTO : COPY_READWRITE;
+	}
+	if(s==COPY_AUTO || s==COPY_CLONE) {
+		if(ioctl(fdout, FICLONE, fdin)==0) {
+			return COPY_CLONE;
+		}
+		if(s==COPY_CLONE) {
+			return -1;
+		}
+	}
+	// this only doubles the read ahead window, the source stays in the page cache
+	CHECK_ZERO_ERRNO(posix_fadvise(fdin, 0, 0, POSIX_FADV_SEQUENTIAL));
+	if(s==COPY_AUTO) {
+		return copy_segments(fdin, fdout, st.st_size, COPY_RANGE, 1);
+	}
+	return copy_segments(fdin, fdout, st.st_size, s, 0);
+}
+
+static inline int copy_file(const char* filein, const char* fileout, copy_strategy s) {
+	int fdin=CHECK_NOT_M1(open(filein, O_RDONLY));
+	struct stat st;
+	CHECK_NOT_M1(fstat(fdin, &st));
+	int fdout=CHECK_NOT_M1(open(fileout, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777));
+	int ret=copy_fd(fdin, fdout, s);
+	CHECK_NOT_M1(close(fdout));
+	CHECK_NOT_M1(close(fdin));
+	return ret;
+}
+
+#endif	/* !__copy_utils_h */
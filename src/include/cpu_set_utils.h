@@ -27,8 +27,11 @@
 /* THIS IS A C FILE, NO C++ here */
 
 #include <firstinclude.h>
-#include <sched.h>	// for CPU_COUNT(3), CPU_SETSIZE, CPU_ISSET(3)
+#include <sched.h>	// for CPU_COUNT(3), CPU_SETSIZE, CPU_ISSET(3), CPU_ZERO(3), CPU_SET(3), CPU_AND(3), sched_getaffinity(2), getcpu(2)
+#include <stdio.h>	// for FILE, fopen(3), fscanf(3), fgetc(3), fclose(3), snprintf(3)
+#include <pthread.h>	// for pthread_setaffinity_np(3), pthread_self(3)
 #include <trace_utils.h>// for INFO()
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ZERO_ERRNO(), CHECK_ERROR(), CHECK_ZERO()
 
 /*
  * A function to print cpu sets
@@ -58,4 +61,102 @@ static inline void cpu_set_print_file(FILE* pfile, cpu_set_t *p) {
 	}
 }
 
+/*
+ * Get the set of cpus the current process is allowed to run on.
+ * This respects taskset(1), cpusets and cgroups, which
+ * sysconf(_SC_NPROCESSORS_ONLN) does not.
+ */
+static inline void cpu_set_get_allowed(cpu_set_t *p) {
+	CPU_ZERO(p);
+	CHECK_NOT_M1(sched_getaffinity(0, sizeof(cpu_set_t), p));
+}
+
+/*
+ * Number of cpus the current process is allowed to run on
+ */
+static inline int cpu_set_allowed_count(void) {
+	cpu_set_t set;
+	cpu_set_get_allowed(&set);
+	return CPU_COUNT(&set);
+}
+
+/*
+ * Return the n'th cpu (modulo the number of cpus) in a cpu set.
+ * Use this to spread n threads over the cpus you are allowed to use.
+ */
+static inline int cpu_set_get_nth(cpu_set_t *p, int n) {
+	int count=CPU_COUNT(p);
+	int j;
+	if(count==0) {
+		CHECK_ERROR("empty cpu set");
+	}
+	n%=count;
+	for(j=0; j<CPU_SETSIZE; j++) {
+		if (CPU_ISSET(j, p)) {
+			if(n==0) {
+				return j;
+			}
+			n--;
+		}
+	}
+	CHECK_ERROR("cpu not found");
+}
+
+/*
+ * Pin the current thread to a single cpu
+ */
+static inline void cpu_set_pin_self(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	CHECK_ZERO_ERRNO(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set));
+}
+
+/*
+ * Get the cpus of NUMA node 'node' which the current process is allowed
+ * to run on. Returns the number of such cpus, 0 if the node does not
+ * exist (for instance a kernel without NUMA support).
+ */
+static inline int cpu_set_get_node(cpu_set_t *p, int node) {
+	char filename[128];
+	snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node);
+	CPU_ZERO(p);
+	FILE* f=fopen(filename, "r");
+	if(f==NULL) {
+		return 0;
+	}
+	// the format is a comma separated list of ranges: "0-3,8-11"
+	int first, last;
+	while(fscanf(f, "%d", &first)==1) {
+		last=first;
+		int c=fgetc(f);
+		if(c=='-') {
+			if(fscanf(f, "%d", &last)!=1) {
+				break;
+			}
+			c=fgetc(f);
+		}
+		for(int cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, p);
+		}
+		if(c!=',') {
+			break;
+		}
+	}
+	CHECK_ZERO(fclose(f));
+	cpu_set_t allowed;
+	cpu_set_get_allowed(&allowed);
+	CPU_AND(p, p, &allowed);
+	return CPU_COUNT(p);
+}
+
+/*
+ * The NUMA node the calling thread is running on right now
+ */
+static inline int cpu_set_current_node(void) {
+	unsigned int cpu, node;
+	CHECK_NOT_M1(getcpu(&cpu, &node));
+	return node;
+}
+
 #endif	/* !__cpu_set_utils_h */
@@ -0,0 +1,263 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __direct_utils_h
+#define __direct_utils_h
+
+/*
+ * Direct IO (O_DIRECT) without the EINVAL surprises.
+ *
+ * O_DIRECT transfers go straight between the device and the user buffer,
+ * so the buffer address, the file offset and the length must all be
+ * aligned to what the device and the file system can do. What that is:
+ * - statx(2) with STATX_DIOALIGN (Linux 6.1 and file systems which
+ * support it) says exactly: stx_dio_mem_align for the buffer and
+ * stx_dio_offset_align for the offset and length, or 0 if the file can
+ * not do direct IO at all.
+ * - otherwise the logical block size of the device: BLKSSZGET on the
+ * device (needs the right to open it), or the same number from
+ * /sys/dev/block/MAJOR:MINOR/queue/logical_block_size (for a partition
+ * the queue is in the parent folder).
+ * - otherwise 4096, which works for almost everything.
+ * The physical block size (BLKPBSZGET or sysfs) is what the device
+ * writes without read-modify-write, reading and writing in multiples of
+ * it is the fast path.
+ *
+ * direct_file keeps two descriptors of the same file, one with O_DIRECT
+ * and one without. direct_pread()/direct_pwrite() do the aligned part of
+ * a request with the first and the unaligned tail (the end of a file
+ * is rarely a multiple of 4096) with the second. A request whose buffer
+ * or offset is not aligned goes buffered all the way, and so does
+ * everything if the file system does not do O_DIRECT (tmpfs before 6.6).
+ *
+ * References:
+ * man 2 open (the O_DIRECT section), man 2 statx
+ * https://lwn.net/Articles/896113/
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t
+#include <sys/stat.h>	// for statx(2), struct statx, STATX_DIOALIGN
+#include <sys/ioctl.h>	// for ioctl(2)
+#include <linux/fs.h>	// for BLKSSZGET, BLKPBSZGET
+#include <fcntl.h>	// for open(2), O_DIRECT, AT_EMPTY_PATH
+#include <unistd.h>	// for pread(2), pwrite(2), close(2)
+#include <stdio.h>	// for snprintf(3), FILE, fopen(3), fscanf(3), fclose(3)
+#include <stdlib.h>	// for posix_memalign(3)
+#include <errno.h>	// for errno, EINVAL
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ZERO_ERRNO(), CHECK_ASSERT(), CHECK_ZERO()
+
+typedef struct _direct_info {
+	// alignment of the buffer address
+	unsigned int mem_align;
+	// alignment of the file offset and of the length
+	unsigned int offset_align;
+	// of the device, 0 if not known
+	unsigned int logical_block;
+	unsigned int physical_block;
+	// where mem_align and offset_align came from
+	const char* source;
+	// can this file do O_DIRECT at all?
+	int supported;
+} direct_info;
+
+/*
+ * Read one number from a sysfs file, 0 if it is not there
+ */
+static inline unsigned int direct_sysfs_read(const char* path) {
+	FILE* f=fopen(path, "r");
+	if(f==NULL) {
+		return 0;
+	}
+	unsigned int value=0;
+	if(fscanf(f, "%u", &value)!=1) {
+		value=0;
+	}
+	CHECK_ZERO(fclose(f));
+	return value;
+}
+
+static inline void direct_device_blocks(unsigned int maj, unsigned int min, direct_info* info) {
+	char path[256];
+	// the device node, root usually
+	snprintf(path, sizeof(path), "/dev/block/%u:%u", maj, min);
+	int fd=open(path, O_RDONLY);
+	if(fd!=-1) {
+		int logical;
+		unsigned int physical;
+		if(ioctl(fd, BLKSSZGET, &logical)==0 && ioctl(fd, BLKPBSZGET, &physical)==0) {
+			info->logical_block=logical;
+			info->physical_block=physical;
+		}
+		CHECK_NOT_M1(close(fd));
+		if(info->logical_block!=0) {
+			return;
+		}
+	}
+	// sysfs, anyone, first as a whole disk then as a partition
+	const char* queues[]={ "queue", "../queue" };
+	for(unsigned int i=0; i<sizeof(queues)/sizeof(queues[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/logical_block_size", maj, min, queues[i]);
+		info->logical_block=direct_sysfs_read(path);
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/physical_block_size", maj, min, queues[i]);
+		info->physical_block=direct_sysfs_read(path);
+		if(info->logical_block!=0) {
+			return;
+		}
+	}
+}
+
+/*
+ * Find out the direct IO requirements of an open file
+ */
+static inline void direct_info_get(int fd, direct_info* info) {
+	struct statx stx;
+	CHECK_NOT_M1(statx(fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_DIOALIGN, &stx));
+	info->logical_block=0;
+	info->physical_block=0;
+	// for a block device it is itself, for a file the device it is on
+	if(S_ISBLK(stx.stx_mode)) {
+		direct_device_blocks(stx.stx_rdev_major, stx.stx_rdev_minor, info);
+	} else {
+		direct_device_blocks(stx.stx_dev_major, stx.stx_dev_minor, info);
+	}
+	if(stx.stx_mask & STATX_DIOALIGN) {
+		info->mem_align=stx.stx_dio_mem_align;
+		info->offset_align=stx.stx_dio_offset_align;
+		info->supported=info->offset_align!=0;
+		info->source="statx";
+		return;
+	}
+	info->supported=1;
+	if(info->logical_block!=0) {
+		info->mem_align=info->logical_block;
+		info->offset_align=info->logical_block;
+		info->source="device";
+		return;
+	}
+	info->mem_align=4096;
+	info->offset_align=4096;
+	info->source="default";
+}
+
+typedef struct _direct_file {
+	// -1 if the file can not do O_DIRECT
+	int fd_direct;
+	int fd_buffered;
+	direct_info info;
+} direct_file;
+
+/*
+ * flags are those of open(2), without O_DIRECT
+ */
+static inline void direct_open(direct_file* f, const char* path, int flags, mode_t mode) {
+	f->fd_buffered=CHECK_NOT_M1(open(path, flags, mode));
+	direct_info_get(f->fd_buffered, &f->info);
+	f->fd_direct=-1;
+	if(f->info.supported) {
+		// O_CREAT and O_TRUNC were already done
+		f->fd_direct=open(path, (flags & ~(O_CREAT | O_TRUNC | O_EXCL)) | O_DIRECT);
+		if(f->fd_direct==-1) {
+			CHECK_ASSERT(errno==EINVAL);
+			f->info.supported=0;
+		}
+	}
+}
+
+static inline void direct_close(direct_file* f) {
+	if(f->fd_direct!=-1) {
+		CHECK_NOT_M1(close(f->fd_direct));
+	}
+	CHECK_NOT_M1(close(f->fd_buffered));
+}
+
+/*
+ * A buffer good for direct IO of this file, of at least 'size' bytes,
+ * free it with free(3)
+ */
+static inline void* direct_alloc(direct_file* f, size_t size) {
+	size_t align=f->info.mem_align;
+	// posix_memalign(3) wants a multiple of sizeof(void*)
+	if(align<sizeof(void*)) {
+		align=sizeof(void*);
+	}
+	size_t round=f->info.offset_align>0 ? f->info.offset_align : 1;
+	void* buf;
+	CHECK_ZERO_ERRNO(posix_memalign(&buf, align, (size+round-1)/round*round));
+	return buf;
+}
+
+/*
+ * How much of a request of len bytes at off into buf can go direct
+ */
+static inline size_t direct_aligned_part(direct_file* f, const void* buf, size_t len, off_t off) {
+	if(f->fd_direct==-1) {
+		return 0;
+	}
+	if((unsigned long)buf % f->info.mem_align!=0 || off % f->info.offset_align!=0) {
+		return 0;
+	}
+	return len/f->info.offset_align*f->info.offset_align;
+}
+
+/*
+ * Like pread(2), returns less than len only at the end of the file
+ */
+static inline ssize_t direct_pread(direct_file* f, void* buf, size_t len, off_t off) {
+	size_t done=0;
+	size_t aligned=direct_aligned_part(f, buf, len, off);
+	while(done<aligned) {
+		ssize_t ret=CHECK_NOT_M1(pread(f->fd_direct, (char*)buf+done, aligned-done, off+done));
+		if(ret==0) {
+			return done;
+		}
+		done+=ret;
+		// a short read that is not aligned is the end of the file
+		if(done%f->info.offset_align!=0) {
+			return done;
+		}
+	}
+	while(done<len) {
+		ssize_t ret=CHECK_NOT_M1(pread(f->fd_buffered, (char*)buf+done, len-done, off+done));
+		if(ret==0) {
+			break;
+		}
+		done+=ret;
+	}
+	return done;
+}
+
+static inline ssize_t direct_pwrite(direct_file* f, const void* buf, size_t len, off_t off) {
+	size_t done=0;
+	size_t aligned=direct_aligned_part(f, buf, len, off);
+	while(done<aligned) {
+		done+=CHECK_NOT_M1(pwrite(f->fd_direct, (const char*)buf+done, aligned-done, off+done));
+		// the rest is not aligned any more
+		if(done%f->info.offset_align!=0) {
+			break;
+		}
+	}
+	while(done<len) {
+		done+=CHECK_NOT_M1(pwrite(f->fd_buffered, (const char*)buf+done, len-done, off+done));
+	}
+	return done;
+}
+
+#endif	/* !__direct_utils_h */
@@ -0,0 +1,532 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __fastmem_utils_h
+#define __fastmem_utils_h
+
+/*
+ * A bulk copy (memcpy(3)) and fill (memset(3)) engine which picks a
+ * strategy according to the size:
+ * - up to 64 bytes: inline code, two (overlapping) loads and stores of
+ * the biggest power of two which fits, no loop and no call.
+ * - up to the size of the last level cache: an AVX-512 (or AVX2) loop
+ * with the destination aligned, the ragged head and tail are done with
+ * two unaligned (overlapping) vector stores.
+ * - above the last level cache: the same loop with non temporal
+ * (streaming) stores which go to memory without first reading the
+ * destination into the cache and without evicting everything else from
+ * it. A buffer that big would not stay in the cache anyway.
+ * - above 'mt_threshold': the buffer is split into page aligned chunks
+ * which threads copy in parallel. One core cannot saturate the memory
+ * bandwidth of a modern machine. The threads are pinned to the cpus of the
+ * NUMA node the caller was on when the engine was initialized (see
+ * cpu_set_get_node()), which is where first touch most likely put the
+ * buffers.
+ *
+ * The strategies are also exported one by one (fastmem_copy_avx2_nt() and
+ * co) so that you can measure them, see performance/memcpy_comparison.cc.
+ *
+ * Notes:
+ * - the instruction set is checked at runtime (__builtin_cpu_supports())
+ * and the vector functions are compiled for it with the 'target'
+ * attribute, so you do not need -mavx2 and the code runs anywhere.
+ * - AVX-512 may lower the clock of the core on some Intel cpus, set
+ * fastmem_cfg.avx512=0 after fastmem_init() to stay with AVX2.
+ * - the thresholds are in fastmem_cfg too, tune them for your machine.
+ * - the threads are created per call, which costs tens of microseconds,
+ * nothing compared to copying 'mt_threshold' bytes.
+ * - like memcpy(3) the buffers must not overlap.
+ *
+ * References:
+ * https://www.intel.com/content/www/us/en/developer/articles/technical/intel-sdm.html
+ * (volume 1, 10.4.6 "Cacheability Control, Prefetch, and Memory Ordering Instructions")
+ * https://sourceware.org/glibc/wiki/Tunables (glibc.cpu.x86_non_temporal_threshold)
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <string.h>	// for memcpy(3), memset(3)
+#include <stdint.h>	// for uintptr_t, uint16_t, uint32_t, uint64_t
+#include <unistd.h>	// for sysconf(3), _SC_LEVEL3_CACHE_SIZE
+#include <sched.h>	// for cpu_set_t, CPU_COUNT(3), CPU_CLR(3), sched_getcpu(3)
+#include <pthread.h>	// for pthread_t, pthread_create(3), pthread_join(3)
+#ifdef __x86_64__
+#include <immintrin.h>	// for _mm256_loadu_si256(), _mm256_stream_si256(), _mm512_loadu_si512(), _mm512_stream_si512(), _mm_sfence()
+#endif	/* __x86_64__ */
+#include <cpu_set_utils.h>	// for cpu_set_get_node(), cpu_set_current_node(), cpu_set_get_allowed(), cpu_set_get_nth(), cpu_set_pin_self()
+#include <err_utils.h>	// for CHECK_ZERO_ERRNO()
+
+#define FASTMEM_MAX_THREADS 64
+
+typedef struct _fastmem_config {
+	int init;
+	int avx2;
+	int avx512;
+	// streaming stores from this size up
+	size_t nt_threshold;
+	// threads from this size up
+	size_t mt_threshold;
+	// how many threads (including the caller) split a big buffer
+	int threads;
+	// which cpus the helper threads run on
+	cpu_set_t cpus;
+} fastmem_config;
+
+static fastmem_config fastmem_cfg;
+
+__attribute__((noinline)) static void fastmem_init_slow(void) {
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	fastmem_cfg.avx2=__builtin_cpu_supports("avx2")!=0;
+	fastmem_cfg.avx512=__builtin_cpu_supports("avx512f")!=0;
+#endif	/* __x86_64__ */
+	long llc=sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if(llc<=0) {
+		llc=8*1024*1024;
+	}
+	fastmem_cfg.nt_threshold=llc;
+	fastmem_cfg.mt_threshold=64*1024*1024;
+	if(cpu_set_get_node(&fastmem_cfg.cpus, cpu_set_current_node())==0) {
+		cpu_set_get_allowed(&fastmem_cfg.cpus);
+	}
+	// a handful of cores saturate the memory controllers of a node
+	fastmem_cfg.threads=CPU_COUNT(&fastmem_cfg.cpus);
+	if(fastmem_cfg.threads>8) {
+		fastmem_cfg.threads=8;
+	}
+	__atomic_store_n(&fastmem_cfg.init, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Called by the first big copy or fill, call it yourself to change the
+ * configuration. Initializing twice gives the same result so threads
+ * racing here do no harm.
+ */
+static inline void fastmem_init(void) {
+	if(!__atomic_load_n(&fastmem_cfg.init, __ATOMIC_ACQUIRE)) {
+		fastmem_init_slow();
+	}
+}
+
+/*
+ * Copy up to 64 bytes. The two copies of each branch overlap unless 'n'
+ * is a power of two, and the fixed size memcpy(3) calls are compiled to
+ * single register moves.
+ */
+static inline void fastmem_copy_small(void* dst, const void* src, size_t n) {
+	char* d=(char*)dst;
+	const char* s=(const char*)src;
+	if(n>=32) {
+		memcpy(d, s, 32);
+		memcpy(d+n-32, s+n-32, 32);
+	} else if(n>=16) {
+		memcpy(d, s, 16);
+		memcpy(d+n-16, s+n-16, 16);
+	} else if(n>=8) {
+		memcpy(d, s, 8);
+		memcpy(d+n-8, s+n-8, 8);
+	} else if(n>=4) {
+		memcpy(d, s, 4);
+		memcpy(d+n-4, s+n-4, 4);
+	} else if(n>=2) {
+		memcpy(d, s, 2);
+		memcpy(d+n-2, s+n-2, 2);
+	} else if(n==1) {
+		*d=*s;
+	}
+}
+
+static inline void fastmem_fill_small(void* dst, int c, size_t n) {
+	char* d=(char*)dst;
+	uint64_t v=0x0101010101010101ULL*(unsigned char)c;
+	if(n>=32) {
+		uint64_t vv[4]={v, v, v, v};
+		memcpy(d, vv, 32);
+		memcpy(d+n-32, vv, 32);
+	} else if(n>=16) {
+		uint64_t vv[2]={v, v};
+		memcpy(d, vv, 16);
+		memcpy(d+n-16, vv, 16);
+	} else if(n>=8) {
+		memcpy(d, &v, 8);
+		memcpy(d+n-8, &v, 8);
+	} else if(n>=4) {
+		uint32_t v4=v;
+		memcpy(d, &v4, 4);
+		memcpy(d+n-4, &v4, 4);
+	} else if(n>=2) {
+		uint16_t v2=v;
+		memcpy(d, &v2, 2);
+		memcpy(d+n-2, &v2, 2);
+	} else if(n==1) {
+		*d=c;
+	}
+}
+
+#ifdef __x86_64__
+
+/*
+ * The vector loops. 'nt' selects streaming stores (and a store fence at
+ * the end, streaming stores are weakly ordered). The first and the last
+ * vector are stored unaligned at the beginning, the loop stores aligned
+ * vectors from the first aligned address on and stops when what is
+ * left is covered by the last vector.
+ */
+__attribute__((target("avx2"))) static inline void fastmem_copy_avx2_nt(void* dst, const void* src, size_t n, int nt) {
+	if(n<=64) {
+		fastmem_copy_small(dst, src, n);
+		return;
+	}
+	char* d=(char*)dst;
+	const char* s=(const char*)src;
+	__m256i head=_mm256_loadu_si256((const __m256i*)s);
+	__m256i tail=_mm256_loadu_si256((const __m256i*)(s+n-32));
+	char* dtail=d+n-32;
+	_mm256_storeu_si256((__m256i*)d, head);
+	size_t skew=32-((uintptr_t)d & 31);
+	d+=skew;
+	s+=skew;
+	n-=skew;
+	if(nt) {
+		while(n>=128) {
+			__m256i a=_mm256_loadu_si256((const __m256i*)s);
+			__m256i b=_mm256_loadu_si256((const __m256i*)(s+32));
+			__m256i e=_mm256_loadu_si256((const __m256i*)(s+64));
+			__m256i f=_mm256_loadu_si256((const __m256i*)(s+96));
+			_mm256_stream_si256((__m256i*)d, a);
+			_mm256_stream_si256((__m256i*)(d+32), b);
+			_mm256_stream_si256((__m256i*)(d+64), e);
+			_mm256_stream_si256((__m256i*)(d+96), f);
+			d+=128;
+			s+=128;
+			n-=128;
+		}
+		_mm_sfence();
+	} else {
+		while(n>=128) {
+			__m256i a=_mm256_loadu_si256((const __m256i*)s);
+			__m256i b=_mm256_loadu_si256((const __m256i*)(s+32));
+			__m256i e=_mm256_loadu_si256((const __m256i*)(s+64));
+			__m256i f=_mm256_loadu_si256((const __m256i*)(s+96));
+			_mm256_store_si256((__m256i*)d, a);
+			_mm256_store_si256((__m256i*)(d+32), b);
+			_mm256_store_si256((__m256i*)(d+64), e);
+			_mm256_store_si256((__m256i*)(d+96), f);
+			d+=128;
+			s+=128;
+			n-=128;
+		}
+	}
+	while(n>32) {
+		_mm256_store_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+		d+=32;
+		s+=32;
+		n-=32;
+	}
+	_mm256_storeu_si256((__m256i*)dtail, tail);
+}
+
+__attribute__((target("avx512f"))) static inline void fastmem_copy_avx512_nt(void* dst, const void* src, size_t n, int nt) {
+	if(n<=64) {
+		fastmem_copy_small(dst, src, n);
+		return;
+	}
+	char* d=(char*)dst;
+	const char* s=(const char*)src;
+	__m512i head=_mm512_loadu_si512(s);
+	__m512i tail=_mm512_loadu_si512(s+n-64);
+	char* dtail=d+n-64;
+	_mm512_storeu_si512(d, head);
+	size_t skew=64-((uintptr_t)d & 63);
+	if(skew>=n) {
+		_mm512_storeu_si512(dtail, tail);
+		return;
+	}
+	d+=skew;
+	s+=skew;
+	n-=skew;
+	if(nt) {
+		while(n>=256) {
+			__m512i a=_mm512_loadu_si512(s);
+			__m512i b=_mm512_loadu_si512(s+64);
+			__m512i e=_mm512_loadu_si512(s+128);
+			__m512i f=_mm512_loadu_si512(s+192);
+			_mm512_stream_si512((__m512i*)d, a);
+			_mm512_stream_si512((__m512i*)(d+64), b);
+			_mm512_stream_si512((__m512i*)(d+128), e);
+			_mm512_stream_si512((__m512i*)(d+192), f);
+			d+=256;
+			s+=256;
+			n-=256;
+		}
+		_mm_sfence();
+	} else {
+		while(n>=256) {
+			__m512i a=_mm512_loadu_si512(s);
+			__m512i b=_mm512_loadu_si512(s+64);
+			__m512i e=_mm512_loadu_si512(s+128);
+			__m512i f=_mm512_loadu_si512(s+192);
+			_mm512_store_si512(d, a);
+			_mm512_store_si512(d+64, b);
+			_mm512_store_si512(d+128, e);
+			_mm512_store_si512(d+192, f);
+			d+=256;
+			s+=256;
+			n-=256;
+		}
+	}
+	while(n>64) {
+		_mm512_store_si512(d, _mm512_loadu_si512(s));
+		d+=64;
+		s+=64;
+		n-=64;
+	}
+	_mm512_storeu_si512(dtail, tail);
+}
+
+__attribute__((target("avx2"))) static inline void fastmem_fill_avx2_nt(void* dst, int c, size_t n, int nt) {
+	if(n<=64) {
+		fastmem_fill_small(dst, c, n);
+		return;
+	}
+	char* d=(char*)dst;
+	__m256i v=_mm256_set1_epi8(c);
+	char* dtail=d+n-32;
+	_mm256_storeu_si256((__m256i*)d, v);
+	size_t skew=32-((uintptr_t)d & 31);
+	d+=skew;
+	n-=skew;
+	if(nt) {
+		while(n>=128) {
+			_mm256_stream_si256((__m256i*)d, v);
+			_mm256_stream_si256((__m256i*)(d+32), v);
+			_mm256_stream_si256((__m256i*)(d+64), v);
+			_mm256_stream_si256((__m256i*)(d+96), v);
+			d+=128;
+			n-=128;
+		}
+		_mm_sfence();
+	} else {
+		while(n>=128) {
+			_mm256_store_si256((__m256i*)d, v);
+			_mm256_store_si256((__m256i*)(d+32), v);
+			_mm256_store_si256((__m256i*)(d+64), v);
+			_mm256_store_si256((__m256i*)(d+96), v);
+			d+=128;
+			n-=128;
+		}
+	}
+	while(n>32) {
+		_mm256_store_si256((__m256i*)d, v);
+		d+=32;
+		n-=32;
+	}
+	_mm256_storeu_si256((__m256i*)dtail, v);
+}
+
+__attribute__((target("avx512f"))) static inline void fastmem_fill_avx512_nt(void* dst, int c, size_t n, int nt) {
+	if(n<=64) {
+		fastmem_fill_small(dst, c, n);
+		return;
+	}
+	char* d=(char*)dst;
+	__m512i v=_mm512_set1_epi32(0x01010101*(unsigned char)c);
+	char* dtail=d+n-64;
+	_mm512_storeu_si512(d, v);
+	size_t skew=64-((uintptr_t)d & 63);
+	if(skew>=n) {
+		_mm512_storeu_si512(dtail, v);
+		return;
+	}
+	d+=skew;
+	n-=skew;
+	if(nt) {
+		while(n>=256) {
+			_mm512_stream_si512((__m512i*)d, v);
+			_mm512_stream_si512((__m512i*)(d+64), v);
+			_mm512_stream_si512((__m512i*)(d+128), v);
+			_mm512_stream_si512((__m512i*)(d+192), v);
+			d+=256;
+			n-=256;
+		}
+		_mm_sfence();
+	} else {
+		while(n>=256) {
+			_mm512_store_si512(d, v);
+			_mm512_store_si512(d+64, v);
+			_mm512_store_si512(d+128, v);
+			_mm512_store_si512(d+192, v);
+			d+=256;
+			n-=256;
+		}
+	}
+	while(n>64) {
+		_mm512_store_si512(d, v);
+		d+=64;
+		n-=64;
+	}
+	_mm512_storeu_si512(dtail, v);
+}
+
+#endif	/* __x86_64__ */
+
+/*
+ * Single threaded copy and fill with the best instruction set there is,
+ * 'nt' selects streaming stores. Without AVX2 it is glibc's job.
+ */
+static inline void fastmem_copy_st(void* dst, const void* src, size_t n, int nt) {
+	fastmem_init();
+#ifdef __x86_64__
+	if(fastmem_cfg.avx512) {
+		fastmem_copy_avx512_nt(dst, src, n, nt);
+		return;
+	}
+	if(fastmem_cfg.avx2) {
+		fastmem_copy_avx2_nt(dst, src, n, nt);
+		return;
+	}
+#endif	/* __x86_64__ */
+	memcpy(dst, src, n);
+}
+
+static inline void fastmem_fill_st(void* dst, int c, size_t n, int nt) {
+	fastmem_init();
+#ifdef __x86_64__
+	if(fastmem_cfg.avx512) {
+		fastmem_fill_avx512_nt(dst, c, n, nt);
+		return;
+	}
+	if(fastmem_cfg.avx2) {
+		fastmem_fill_avx2_nt(dst, c, n, nt);
+		return;
+	}
+#endif	/* __x86_64__ */
+	memset(dst, c, n);
+}
+
+typedef struct _fastmem_job {
+	char* dst;
+	// NULL for a fill
+	const char* src;
+	int c;
+	size_t n;
+	int nt;
+	// -1 to stay where we are
+	int cpu;
+} fastmem_job;
+
+static inline void* fastmem_worker(void* p) {
+	fastmem_job* job=(fastmem_job*)p;
+	if(job->cpu!=-1) {
+		cpu_set_pin_self(job->cpu);
+	}
+	if(job->src!=NULL) {
+		fastmem_copy_st(job->dst, job->src, job->n, job->nt);
+	} else {
+		fastmem_fill_st(job->dst, job->c, job->n, job->nt);
+	}
+	return NULL;
+}
+
+/*
+ * Split a copy (src!=NULL) or a fill into 'threads' page aligned chunks.
+ * The caller does the first chunk itself, the other threads are pinned
+ * to the configured cpus other than the one the caller is on.
+ */
+static inline void fastmem_split(void* dst, const void* src, int c, size_t n, int threads, int nt) {
+	fastmem_init();
+	if(n==0) {
+		return;
+	}
+	if(threads>FASTMEM_MAX_THREADS) {
+		threads=FASTMEM_MAX_THREADS;
+	}
+	cpu_set_t cpus=fastmem_cfg.cpus;
+	int self=sched_getcpu();
+	if(self!=-1) {
+		CPU_CLR(self, &cpus);
+	}
+	size_t chunk=((n+threads-1)/threads+4095) & ~4095UL;
+	fastmem_job jobs[FASTMEM_MAX_THREADS];
+	pthread_t tids[FASTMEM_MAX_THREADS];
+	int count=0;
+	for(size_t off=0; off<n && count<threads; off+=chunk) {
+		fastmem_job* job=jobs+count;
+		job->dst=(char*)dst+off;
+		job->src=src==NULL ? NULL : (const char*)src+off;
+		job->c=c;
+		job->n=n-off<chunk ? n-off : chunk;
+		job->nt=nt;
+		job->cpu=count>0 && CPU_COUNT(&cpus)>0 ? cpu_set_get_nth(&cpus, count-1) : -1;
+		count++;
+	}
+	for(int i=1; i<count; i++) {
+		CHECK_ZERO_ERRNO(pthread_create(tids+i, NULL, fastmem_worker, jobs+i));
+	}
+	fastmem_worker(jobs);
+	for(int i=1; i<count; i++) {
+		CHECK_ZERO_ERRNO(pthread_join(tids[i], NULL));
+	}
+}
+
+/*
+ * The part of the engine which is not inlined: everything above 64 bytes
+ */
+__attribute__((noinline)) static void fastmem_copy_large(void* dst, const void* src, size_t n) {
+	fastmem_init();
+	int nt=n>=fastmem_cfg.nt_threshold;
+	if(n>=fastmem_cfg.mt_threshold && fastmem_cfg.threads>1) {
+		fastmem_split(dst, src, 0, n, fastmem_cfg.threads, nt);
+	} else {
+		fastmem_copy_st(dst, src, n, nt);
+	}
+}
+
+__attribute__((noinline)) static void fastmem_fill_large(void* dst, int c, size_t n) {
+	fastmem_init();
+	int nt=n>=fastmem_cfg.nt_threshold;
+	if(n>=fastmem_cfg.mt_threshold && fastmem_cfg.threads>1) {
+		fastmem_split(dst, NULL, c, n, fastmem_cfg.threads, nt);
+	} else {
+		fastmem_fill_st(dst, c, n, nt);
+	}
+}
+
+/*
+ * The engine: memcpy(3) and memset(3) replacements
+ */
+static inline void* fastmem_copy(void* dst, const void* src, size_t n) {
+	if(n<=64) {
+		fastmem_copy_small(dst, src, n);
+	} else {
+		fastmem_copy_large(dst, src, n);
+	}
+	return dst;
+}
+
+static inline void* fastmem_fill(void* dst, int c, size_t n) {
+	if(n<=64) {
+		fastmem_fill_small(dst, c, n);
+	} else {
+		fastmem_fill_large(dst, c, n);
+	}
+	return dst;
+}
+
+#endif	/* !__fastmem_utils_h */
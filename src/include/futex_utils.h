@@ -0,0 +1,297 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __futex_utils_h
+#define __futex_utils_h
+
+/*
+ * This is a collection of synchronization primitives built directly
+ * on top of futex(2): a mutex, a condition variable, manual/auto reset
+ * events and a countdown latch.
+ *
+ * The common theme is that every primitive keeps a count of sleepers
+ * so that the waking side does not enter the kernel when nobody is
+ * waiting. Compare this to an eventfd(2) based emulation where every
+ * signal is a write(2) and every wait is a read(2).
+ *
+ * Notes:
+ * - all primitives are process private (FUTEX_PRIVATE_FLAG). If you want
+ * to place them in shared memory drop that flag.
+ * - the mutex is the "mutex3" of Ulrich Drepper's "Futexes Are Tricky".
+ * 0 means unlocked, 1 means locked, 2 means locked with (possible) waiters.
+ * - the condition variable uses FUTEX_CMP_REQUEUE on broadcast to move
+ * all waiters but one from the condition futex to the mutex futex, so
+ * that a broadcast does not cause a thundering herd on the mutex.
+ * - futex_cond_signal_unlock() uses FUTEX_WAKE_OP to release the mutex
+ * and wake a waiter on the condition in a single system call.
+ *
+ * References:
+ * http://www.akkadia.org/drepper/futex.pdf
+ * man 2 futex
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <linux/futex.h>// for FUTEX_* constants
+#include <sys/syscall.h>// for SYS_futex
+#include <unistd.h>	// for syscall(2)
+#include <limits.h>	// for INT_MAX
+#include <errno.h>	// for errno, EAGAIN, EINTR, ETIMEDOUT
+#include <time.h>	// for struct timespec
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ASSERT()
+
+/*
+ * Raw wrappers for futex(2) which is not supplied by glibc
+ */
+static inline int futex_wait(int* uaddr, int val, const struct timespec* timeout) {
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline int futex_wake(int* uaddr, int nr_wake) {
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nr_wake, NULL, NULL, 0);
+}
+
+static inline int futex_cmp_requeue(int* uaddr, int nr_wake, int nr_requeue, int* uaddr2, int val) {
+	return syscall(SYS_futex, uaddr, FUTEX_CMP_REQUEUE_PRIVATE, nr_wake, (unsigned long)nr_requeue, uaddr2, val);
+}
+
+static inline int futex_wake_op(int* uaddr, int nr_wake, int nr_wake2, int* uaddr2, int op) {
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE_OP_PRIVATE, nr_wake, (unsigned long)nr_wake2, uaddr2, op);
+}
+
+/*
+ * Sleep on a futex, the only acceptable errors are the ones
+ * which mean "the value changed" or "we were interrupted"
+ */
+static inline void futex_wait_checked(int* uaddr, int val) {
+	if(futex_wait(uaddr, val, NULL)==-1) {
+		CHECK_ASSERT(errno==EAGAIN || errno==EINTR);
+	}
+}
+
+/*
+ * futex based mutex
+ */
+typedef struct _futex_mutex_t {
+	int val;
+} futex_mutex_t;
+
+static inline void futex_mutex_init(futex_mutex_t* m) {
+	m->val=0;
+}
+
+/*
+ * Lock assuming that there are other waiters. This is what a thread
+ * which was requeued from a condition variable must do: it does not
+ * know whether it is the last one on the mutex futex so it must leave
+ * the mutex in the contended (2) state.
+ */
+static inline void futex_mutex_lock_contended(futex_mutex_t* m) {
+	int c;
+	while((c=__atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE))!=0) {
+		futex_wait_checked(&m->val, 2);
+	}
+}
+
+static inline void futex_mutex_lock(futex_mutex_t* m) {
+	int c=0;
+	if(__atomic_compare_exchange_n(&m->val, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+	futex_mutex_lock_contended(m);
+}
+
+static inline int futex_mutex_trylock(futex_mutex_t* m) {
+	int c=0;
+	return __atomic_compare_exchange_n(&m->val, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void futex_mutex_unlock(futex_mutex_t* m) {
+	if(__atomic_exchange_n(&m->val, 0, __ATOMIC_RELEASE)==2) {
+		CHECK_NOT_M1(futex_wake(&m->val, 1));
+	}
+}
+
+/*
+ * futex based condition variable
+ * seq - bumped on every signal/broadcast, this is the futex word
+ * waiters - number of threads inside futex_cond_wait()
+ */
+typedef struct _futex_cond_t {
+	int seq;
+	int waiters;
+} futex_cond_t;
+
+static inline void futex_cond_init(futex_cond_t* c) {
+	c->seq=0;
+	c->waiters=0;
+}
+
+/*
+ * Wait on the condition. Must be called with the mutex held.
+ * Like pthread_cond_wait(3) spurious wakeups are possible so always
+ * call this in a loop which checks your predicate.
+ */
+static inline void futex_cond_wait(futex_cond_t* c, futex_mutex_t* m) {
+	__atomic_add_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	int seq=__atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+	futex_mutex_unlock(m);
+	futex_wait_checked(&c->seq, seq);
+	__atomic_sub_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	// we may have been requeued onto the mutex, take it as contended
+	futex_mutex_lock_contended(m);
+}
+
+/*
+ * Wake one waiter. Does not enter the kernel if there are no waiters.
+ */
+static inline void futex_cond_signal(futex_cond_t* c) {
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST)>0) {
+		CHECK_NOT_M1(futex_wake(&c->seq, 1));
+	}
+}
+
+/*
+ * Wake all waiters. Only one is actually woken, the rest are moved
+ * (requeued) to the mutex futex and will be woken one by one as the
+ * mutex is released. Must be called with the mutex held.
+ */
+static inline void futex_cond_broadcast(futex_cond_t* c, futex_mutex_t* m) {
+	int seq=__atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST)==0) {
+		return;
+	}
+	// the requeued waiters will sleep on the mutex so mark it contended
+	__atomic_store_n(&m->val, 2, __ATOMIC_SEQ_CST);
+	while(futex_cmp_requeue(&c->seq, 1, INT_MAX, &m->val, seq)==-1) {
+		CHECK_ASSERT(errno==EAGAIN);
+		seq=__atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Wake all waiters without requeue. This is here to compare against
+ * futex_cond_broadcast(), do not use it.
+ */
+static inline void futex_cond_broadcast_wakeall(futex_cond_t* c) {
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST)>0) {
+		CHECK_NOT_M1(futex_wake(&c->seq, INT_MAX));
+	}
+}
+
+/*
+ * Signal the condition and release the mutex. With waiters present this
+ * is a single FUTEX_WAKE_OP which wakes one waiter of the condition,
+ * sets the mutex to 0 and wakes one mutex waiter if it was contended.
+ */
+static inline void futex_cond_signal_unlock(futex_cond_t* c, futex_mutex_t* m) {
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST)==0) {
+		futex_mutex_unlock(m);
+		return;
+	}
+	CHECK_NOT_M1(futex_wake_op(&c->seq, 1, 1, &m->val, FUTEX_OP(FUTEX_OP_SET, 0, FUTEX_OP_CMP_GT, 1)));
+}
+
+/*
+ * futex based event
+ * state - 0 not signaled, 1 signaled, this is the futex word
+ * manual - 1 if this is a manual reset event
+ * A manual reset event stays signaled until futex_event_reset() and
+ * releases all waiters. An auto reset event releases exactly one waiter
+ * and goes back to the non signaled state.
+ */
+typedef struct _futex_event_t {
+	int state;
+	int waiters;
+	int manual;
+} futex_event_t;
+
+static inline void futex_event_init(futex_event_t* e, int manual, int state) {
+	e->state=state;
+	e->waiters=0;
+	e->manual=manual;
+}
+
+static inline void futex_event_set(futex_event_t* e) {
+	if(__atomic_exchange_n(&e->state, 1, __ATOMIC_SEQ_CST)==1) {
+		return;
+	}
+	if(__atomic_load_n(&e->waiters, __ATOMIC_SEQ_CST)>0) {
+		CHECK_NOT_M1(futex_wake(&e->state, e->manual ? INT_MAX : 1));
+	}
+}
+
+static inline void futex_event_reset(futex_event_t* e) {
+	__atomic_store_n(&e->state, 0, __ATOMIC_SEQ_CST);
+}
+
+static inline void futex_event_wait(futex_event_t* e) {
+	while(true) {
+		if(e->manual) {
+			if(__atomic_load_n(&e->state, __ATOMIC_ACQUIRE)==1) {
+				return;
+			}
+		} else {
+			int c=1;
+			if(__atomic_compare_exchange_n(&e->state, &c, 0, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return;
+			}
+		}
+		__atomic_add_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+		futex_wait_checked(&e->state, 0);
+		__atomic_sub_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * futex based countdown latch
+ * count - number of count downs left, this is the futex word
+ * Waiters are released when the count reaches zero.
+ */
+typedef struct _futex_latch_t {
+	int count;
+	int waiters;
+} futex_latch_t;
+
+static inline void futex_latch_init(futex_latch_t* l, int count) {
+	l->count=count;
+	l->waiters=0;
+}
+
+static inline void futex_latch_count_down(futex_latch_t* l) {
+	int c=__atomic_sub_fetch(&l->count, 1, __ATOMIC_SEQ_CST);
+	CHECK_ASSERT(c>=0);
+	if(c==0 && __atomic_load_n(&l->waiters, __ATOMIC_SEQ_CST)>0) {
+		CHECK_NOT_M1(futex_wake(&l->count, INT_MAX));
+	}
+}
+
+static inline void futex_latch_wait(futex_latch_t* l) {
+	int c;
+	while((c=__atomic_load_n(&l->count, __ATOMIC_ACQUIRE))!=0) {
+		__atomic_add_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+		futex_wait_checked(&l->count, c);
+		__atomic_sub_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+#endif	/* !__futex_utils_h */
@@ -0,0 +1,308 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __grouplog_utils_h
+#define __grouplog_utils_h
+
+/*
+ * A durable append only log of fixed size records with group commit.
+ *
+ * grouplog_append() returns when the record is on the device. Doing a
+ * write and an fdatasync(2) per record limits the log to the number of
+ * flushes the device can do per second, whatever the number of clients.
+ * Here the clients only queue a pointer to their record and sleep, and a
+ * single writer thread takes everything that was queued while it was
+ * flushing, writes it with one pwritev(2) (straight from the buffers of
+ * the clients, which are waiting anyway) and does one fdatasync(2) for
+ * all of it. The more clients, the bigger the groups and a flush is paid
+ * once per group.
+ *
+ * Next to the log there are two files of one page, mapped shared by the
+ * writer and by any number of readers, in any process:
+ * - the index ('log'.index) holds the number of records which are
+ * durable. Only the writer moves it, after the flush, readers open it
+ * read only and map it PROT_READ.
+ * - the cursor ('log'.cursor) holds the number of records already taken
+ * by consumers, they move it with compare and swap.
+ * A consumer finds the next record to process in O(1), without scanning
+ * the log and without a file lock.
+ *
+ * Notes:
+ * - after a crash the log is trusted up to its size (a partial record at
+ * the end is cut), the index is only a cache of that.
+ * - records are never removed, a real log would also rotate or truncate
+ * the consumed prefix (FALLOC_FL_COLLAPSE_RANGE or a new file).
+ *
+ * References:
+ * https://en.wikipedia.org/wiki/Group_commit
+ * man 2 pwritev, man 2 fdatasync
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t
+#include <sys/stat.h>	// for fstat(2)
+#include <sys/mman.h>	// for mmap(2), munmap(2), msync(2)
+#include <sys/uio.h>	// for pwritev(2), struct iovec
+#include <fcntl.h>	// for open(2)
+#include <unistd.h>	// for pread(2), fdatasync(2), ftruncate(2), close(2)
+#include <limits.h>	// for IOV_MAX
+#include <pthread.h>	// for pthread_create(3), pthread_join(3), pthread_mutex_t, pthread_cond_t
+#include <stdio.h>	// for snprintf(3)
+#include <stdlib.h>	// for malloc(3), realloc(3), free(3)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_NULL(), CHECK_ZERO_ERRNO(), CHECK_NOT_VOIDP(), CHECK_ASSERT()
+
+static const unsigned long grouplog_magic=0x676f6c70756f7267UL;
+
+typedef struct _grouplog_index {
+	unsigned long magic;
+	unsigned long record_size;
+	// records which are durable in the log
+	unsigned long committed;
+} grouplog_index;
+
+typedef struct _grouplog_cursor {
+	// records taken by consumers
+	unsigned long consumed;
+} grouplog_cursor;
+
+/*
+ * Map a page of 'path'.'suffix'. Only the writer creates (and sizes) the
+ * file, the others check that it is all there.
+ */
+static inline void* grouplog_map(const char* path, const char* suffix, int flags, int prot) {
+	char name[4096];
+	snprintf(name, sizeof(name), "%s.%s", path, suffix);
+	int fd=CHECK_NOT_M1(open(name, flags, 0666));
+	long page=sysconf(_SC_PAGESIZE);
+	if(flags & O_CREAT) {
+		CHECK_NOT_M1(ftruncate(fd, page));
+	} else {
+		struct stat st;
+		CHECK_NOT_M1(fstat(fd, &st));
+		CHECK_ASSERT(st.st_size==page);
+	}
+	void* p=CHECK_NOT_VOIDP(mmap(NULL, page, prot, MAP_SHARED, fd, 0), MAP_FAILED);
+	// the mapping stays after the close
+	CHECK_NOT_M1(close(fd));
+	return p;
+}
+
+typedef struct _grouplog {
+	int fd;
+	size_t record_size;
+	grouplog_index* idx;
+	grouplog_cursor* cursor;
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	// the writer waits on this for work
+	pthread_cond_t work;
+	// the clients wait on this for their record to be durable
+	pthread_cond_t done;
+	// records handed out (the next record number) and on the device
+	unsigned long queued;
+	unsigned long durable;
+	// what the clients queued since the writer took the last group
+	struct iovec* pending;
+	unsigned int npending;
+	unsigned int cpending;
+	int stop;
+	// number of groups written (and of fdatasync(2) calls)
+	unsigned long groups;
+} grouplog;
+
+/*
+ * Write a whole group, pwritev(2) takes IOV_MAX buffers at most and may
+ * write less than asked
+ */
+static inline void grouplog_write_group(grouplog* l, struct iovec* iov, unsigned int n, off_t off) {
+	while(n>0) {
+		unsigned int now=n<IOV_MAX ? n : IOV_MAX;
+		size_t ret=CHECK_NOT_M1(pwritev(l->fd, iov, now, off));
+		off+=ret;
+		while(n>0 && ret>=iov->iov_len) {
+			ret-=iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(ret>0) {
+			iov->iov_base=(char*)iov->iov_base+ret;
+			iov->iov_len-=ret;
+		}
+	}
+}
+
+static inline void* grouplog_writer(void* arg) {
+	grouplog* l=(grouplog*)arg;
+	struct iovec* group=NULL;
+	unsigned int cgroup=0;
+	CHECK_ZERO_ERRNO(pthread_mutex_lock(&l->mutex));
+	while(1) {
+		while(l->npending==0 && !l->stop) {
+			CHECK_ZERO_ERRNO(pthread_cond_wait(&l->work, &l->mutex));
+		}
+		if(l->npending==0) {
+			break;
+		}
+		// take the group, the clients queue into the other array meanwhile
+		struct iovec* tmp=group;
+		unsigned int ctmp=cgroup;
+		group=l->pending;
+		cgroup=l->cpending;
+		unsigned int n=l->npending;
+		l->pending=tmp;
+		l->cpending=ctmp;
+		l->npending=0;
+		off_t off=l->durable*l->record_size;
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&l->mutex));
+		grouplog_write_group(l, group, n, off);
+		CHECK_NOT_M1(fdatasync(l->fd));
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&l->mutex));
+		l->durable+=n;
+		__atomic_store_n(&l->idx->committed, l->durable, __ATOMIC_RELEASE);
+		l->groups++;
+		CHECK_ZERO_ERRNO(pthread_cond_broadcast(&l->done));
+	}
+	CHECK_ZERO_ERRNO(pthread_mutex_unlock(&l->mutex));
+	free(group);
+	return NULL;
+}
+
+static inline void grouplog_open(grouplog* l, const char* path, size_t record_size) {
+	l->fd=CHECK_NOT_M1(open(path, O_RDWR | O_CREAT, 0666));
+	l->record_size=record_size;
+	l->idx=(grouplog_index*)grouplog_map(path, "index", O_RDWR | O_CREAT, PROT_READ | PROT_WRITE);
+	l->cursor=(grouplog_cursor*)grouplog_map(path, "cursor", O_RDWR | O_CREAT, PROT_READ | PROT_WRITE);
+	if(l->idx->magic!=grouplog_magic || l->idx->record_size!=record_size) {
+		l->idx->record_size=record_size;
+		l->idx->committed=0;
+		l->cursor->consumed=0;
+		l->idx->magic=grouplog_magic;
+	}
+	// recover: the log is the truth, cut a partial record at the end
+	struct stat st;
+	CHECK_NOT_M1(fstat(l->fd, &st));
+	unsigned long records=st.st_size/record_size;
+	if((off_t)(records*record_size)!=st.st_size) {
+		CHECK_NOT_M1(ftruncate(l->fd, records*record_size));
+	}
+	l->idx->committed=records;
+	if(l->cursor->consumed>records) {
+		l->cursor->consumed=records;
+	}
+	l->queued=records;
+	l->durable=records;
+	l->pending=NULL;
+	l->npending=0;
+	l->cpending=0;
+	l->stop=0;
+	l->groups=0;
+	CHECK_ZERO_ERRNO(pthread_mutex_init(&l->mutex, NULL));
+	CHECK_ZERO_ERRNO(pthread_cond_init(&l->work, NULL));
+	CHECK_ZERO_ERRNO(pthread_cond_init(&l->done, NULL));
+	CHECK_ZERO_ERRNO(pthread_create(&l->writer, NULL, grouplog_writer, l));
+}
+
+/*
+ * Append one record (record_size bytes), returns its number once it is
+ * durable. Thread safe, record must stay valid until this returns.
+ */
+static inline unsigned long grouplog_append(grouplog* l, const void* record) {
+	CHECK_ZERO_ERRNO(pthread_mutex_lock(&l->mutex));
+	if(l->npending==l->cpending) {
+		l->cpending=l->cpending ? l->cpending*2 : 64;
+		l->pending=(struct iovec*)CHECK_NOT_NULL(realloc(l->pending, l->cpending*sizeof(struct iovec)));
+	}
+	l->pending[l->npending].iov_base=(void*)record;
+	l->pending[l->npending].iov_len=l->record_size;
+	l->npending++;
+	unsigned long seq=l->queued++;
+	// the writer only needs a kick if it is idle
+	if(l->npending==1) {
+		CHECK_ZERO_ERRNO(pthread_cond_signal(&l->work));
+	}
+	while(l->durable<=seq) {
+		CHECK_ZERO_ERRNO(pthread_cond_wait(&l->done, &l->mutex));
+	}
+	CHECK_ZERO_ERRNO(pthread_mutex_unlock(&l->mutex));
+	return seq;
+}
+
+/*
+ * Flushes what was queued, stops the writer and closes the log
+ */
+static inline void grouplog_close(grouplog* l) {
+	CHECK_ZERO_ERRNO(pthread_mutex_lock(&l->mutex));
+	l->stop=1;
+	CHECK_ZERO_ERRNO(pthread_cond_signal(&l->work));
+	CHECK_ZERO_ERRNO(pthread_mutex_unlock(&l->mutex));
+	CHECK_ZERO_ERRNO(pthread_join(l->writer, NULL));
+	CHECK_ZERO_ERRNO(pthread_cond_destroy(&l->done));
+	CHECK_ZERO_ERRNO(pthread_cond_destroy(&l->work));
+	CHECK_ZERO_ERRNO(pthread_mutex_destroy(&l->mutex));
+	free(l->pending);
+	long page=sysconf(_SC_PAGESIZE);
+	CHECK_NOT_M1(msync(l->idx, page, MS_SYNC));
+	CHECK_NOT_M1(munmap(l->idx, page));
+	CHECK_NOT_M1(munmap(l->cursor, page));
+	CHECK_NOT_M1(close(l->fd));
+}
+
+typedef struct _grouplog_reader {
+	int fd;
+	size_t record_size;
+	const grouplog_index* idx;
+	grouplog_cursor* cursor;
+} grouplog_reader;
+
+/*
+ * A consumer, in this process or any other, of a log which exists
+ */
+static inline void grouplog_reader_open(grouplog_reader* r, const char* path) {
+	r->fd=CHECK_NOT_M1(open(path, O_RDONLY));
+	r->idx=(const grouplog_index*)grouplog_map(path, "index", O_RDONLY, PROT_READ);
+	CHECK_ASSERT(r->idx->magic==grouplog_magic);
+	r->cursor=(grouplog_cursor*)grouplog_map(path, "cursor", O_RDWR, PROT_READ | PROT_WRITE);
+	r->record_size=r->idx->record_size;
+}
+
+/*
+ * Take the next record which nobody took yet, copy it to record and
+ * return its number, -1 if there is none (for now)
+ */
+static inline long grouplog_next(grouplog_reader* r, void* record) {
+	unsigned long consumed=__atomic_load_n(&r->cursor->consumed, __ATOMIC_ACQUIRE);
+	do {
+		if(consumed>=__atomic_load_n(&r->idx->committed, __ATOMIC_ACQUIRE)) {
+			return -1;
+		}
+	} while(!__atomic_compare_exchange_n(&r->cursor->consumed, &consumed, consumed+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	ssize_t ret=CHECK_NOT_M1(pread(r->fd, record, r->record_size, consumed*r->record_size));
+	CHECK_ASSERT(ret==(ssize_t)r->record_size);
+	return consumed;
+}
+
+static inline void grouplog_reader_close(grouplog_reader* r) {
+	long page=sysconf(_SC_PAGESIZE);
+	CHECK_NOT_M1(munmap((void*)r->idx, page));
+	CHECK_NOT_M1(munmap(r->cursor, page));
+	CHECK_NOT_M1(close(r->fd));
+}
+
+#endif	/* !__grouplog_utils_h */
@@ -0,0 +1,191 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __hugepage_utils_h
+#define __hugepage_utils_h
+
+/*
+ * This is a collection of helpers to allocate memory backed by huge pages
+ * with a transparent fallback:
+ * 1. MAP_HUGETLB with 1G pages (only if asked for, a 1G page for a small
+ * buffer is a waste).
+ * 2. MAP_HUGETLB with 2M pages. These come from the hugetlbfs pool which
+ * is empty by default, fill it with:
+ *	echo 512 | sudo tee /proc/sys/vm/nr_hugepages
+ * 3. transparent huge pages: a 2M aligned anonymous mapping with
+ * madvise(MADV_HUGEPAGE). This works when
+ * /sys/kernel/mm/transparent_hugepage/enabled is 'always' or 'madvise'
+ * but the kernel may still give us small pages if it has no free huge
+ * pages, see hugepage_thp_kb().
+ * 4. regular pages.
+ *
+ * The buffer records which one was used so you can report it.
+ *
+ * Huge pages cover the same memory with 512 (2M) or 262144 (1G) times
+ * fewer TLB entries, which matters for large working sets accessed
+ * randomly. Use perf_utils.h to count the dTLB misses.
+ *
+ * References:
+ * https://www.kernel.org/doc/Documentation/vm/hugetlbpage.txt
+ * https://www.kernel.org/doc/Documentation/vm/transhuge.txt
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/mman.h>	// for mmap(2), munmap(2), madvise(2), MAP_HUGETLB, MADV_HUGEPAGE
+#include <linux/mman.h>	// for MAP_HUGE_2MB, MAP_HUGE_1GB
+#include <stdint.h>	// for uintptr_t
+#include <unistd.h>	// for getpagesize(2)
+#include <stdio.h>	// for fopen(3), fgets(3), fclose(3), sscanf(3)
+#include <string.h>	// for strstr(3), strncmp(3)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_VOIDP(), CHECK_ZERO()
+
+typedef enum _hugepage_kind {
+	HUGEPAGE_1G,
+	HUGEPAGE_2M,
+	HUGEPAGE_THP,
+	HUGEPAGE_NONE,
+} hugepage_kind;
+
+typedef struct _hugepage_buf {
+	void* ptr;
+	// what was asked for and what was actually mapped
+	size_t size;
+	size_t mapped;
+	hugepage_kind kind;
+} hugepage_buf;
+
+static inline const char* hugepage_kind_name(hugepage_kind kind) {
+	switch(kind) {
+	case HUGEPAGE_1G:
+		return "hugetlb 1G";
+	case HUGEPAGE_2M:
+		return "hugetlb 2M";
+	case HUGEPAGE_THP:
+		return "transparent huge pages";
+	case HUGEPAGE_NONE:
+		return "regular pages";
+	}
+	return "unknown";
+}
+
+static const size_t HUGEPAGE_SIZE_2M=2*1024*1024;
+static const size_t HUGEPAGE_SIZE_1G=1024*1024*1024;
+
+static inline size_t hugepage_round(size_t size, size_t page) {
+	return (size+page-1)/page*page;
+}
+
+/*
+ * Is THP enabled (in 'always' or 'madvise' mode)?
+ */
+static inline int hugepage_thp_enabled() {
+	FILE* f=fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if(f==NULL) {
+		return 0;
+	}
+	char line[256];
+	int ret=0;
+	if(fgets(line, sizeof(line), f)!=NULL) {
+		ret=strstr(line, "[never]")==NULL;
+	}
+	CHECK_ZERO(fclose(f));
+	return ret;
+}
+
+/*
+ * How much of our anonymous memory is backed by transparent huge pages
+ * right now (in KB), -1 if the kernel does not say.
+ */
+static inline long hugepage_thp_kb() {
+	FILE* f=fopen("/proc/self/smaps_rollup", "r");
+	if(f==NULL) {
+		return -1;
+	}
+	char line[256];
+	long kb=-1;
+	while(fgets(line, sizeof(line), f)!=NULL) {
+		if(strncmp(line, "AnonHugePages:", 14)==0) {
+			CHECK_ASSERT(sscanf(line+14, "%ld", &kb)==1);
+			break;
+		}
+	}
+	CHECK_ZERO(fclose(f));
+	return kb;
+}
+
+static inline void* hugepage_try_hugetlb(size_t size, int flag) {
+	void* p=mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flag, -1, 0);
+	if(p==MAP_FAILED) {
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Allocate 'size' bytes, trying huge page kinds starting at 'first'
+ * and going down to regular pages. Never fails (fatal errors aside),
+ * check b->kind to see what you got.
+ */
+static inline void hugepage_alloc(hugepage_buf* b, size_t size, hugepage_kind first) {
+	b->size=size;
+	if(first<=HUGEPAGE_1G) {
+		b->mapped=hugepage_round(size, HUGEPAGE_SIZE_1G);
+		if((b->ptr=hugepage_try_hugetlb(b->mapped, MAP_HUGE_1GB))!=NULL) {
+			b->kind=HUGEPAGE_1G;
+			return;
+		}
+	}
+	if(first<=HUGEPAGE_2M) {
+		b->mapped=hugepage_round(size, HUGEPAGE_SIZE_2M);
+		if((b->ptr=hugepage_try_hugetlb(b->mapped, MAP_HUGE_2MB))!=NULL) {
+			b->kind=HUGEPAGE_2M;
+			return;
+		}
+	}
+	if(first<=HUGEPAGE_THP && hugepage_thp_enabled()) {
+		// over map and trim so that the buffer is 2M aligned, otherwise
+		// the first and last partial huge pages cannot be huge
+		b->mapped=hugepage_round(size, HUGEPAGE_SIZE_2M);
+		size_t over=b->mapped+HUGEPAGE_SIZE_2M;
+		char* p=(char*)CHECK_NOT_VOIDP(mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), MAP_FAILED);
+		char* aligned=(char*)(((uintptr_t)p+HUGEPAGE_SIZE_2M-1) & ~(HUGEPAGE_SIZE_2M-1));
+		if(aligned>p) {
+			CHECK_NOT_M1(munmap(p, aligned-p));
+		}
+		size_t tail=(p+over)-(aligned+b->mapped);
+		if(tail>0) {
+			CHECK_NOT_M1(munmap(aligned+b->mapped, tail));
+		}
+		CHECK_NOT_M1(madvise(aligned, b->mapped, MADV_HUGEPAGE));
+		b->ptr=aligned;
+		b->kind=HUGEPAGE_THP;
+		return;
+	}
+	b->mapped=hugepage_round(size, getpagesize());
+	b->ptr=CHECK_NOT_VOIDP(mmap(NULL, b->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), MAP_FAILED);
+	b->kind=HUGEPAGE_NONE;
+}
+
+static inline void hugepage_free(hugepage_buf* b) {
+	CHECK_NOT_M1(munmap(b->ptr, b->mapped));
+	b->ptr=NULL;
+}
+
+#endif	/* !__hugepage_utils_h */
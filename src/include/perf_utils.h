@@ -0,0 +1,120 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __perf_utils_h
+#define __perf_utils_h
+
+/*
+ * This is a collection of helpers to count hardware and software events
+ * of the current thread around a piece of code using perf_event_open(2),
+ * the same counters that 'perf stat' uses.
+ *
+ *	int fd=perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+ *	perf_counter_start(fd);
+ *	... code ...
+ *	long long misses=perf_counter_stop(fd);
+ *	perf_counter_close(fd);
+ *
+ * Notes:
+ * - only user space events are counted so this works with the default
+ * /proc/sys/kernel/perf_event_paranoid=2.
+ * - virtual machines and containers often have no PMU or forbid
+ * perf_event_open(2). In that case perf_counter_open() warns and returns
+ * -1, all other functions accept -1 and perf_counter_stop() returns -1,
+ * so callers can print "n/a" and go on.
+ *
+ * References:
+ * man 2 perf_event_open
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <linux/perf_event.h>	// for perf_event_attr:struct, PERF_* constants
+#include <sys/syscall.h>// for SYS_perf_event_open
+#include <sys/ioctl.h>	// for ioctl(2)
+#include <unistd.h>	// for syscall(2), read(2), close(2)
+#include <string.h>	// for memset(3), strerror(3)
+#include <stdio.h>	// for fprintf(3)
+#include <errno.h>	// for errno
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ASSERT()
+
+/*
+ * The config of the cache events, see PERF_TYPE_HW_CACHE in perf_event_open(2)
+ */
+static inline unsigned long long perf_cache_config(int cache, int op, int result) {
+	return cache | (op << 8) | (result << 16);
+}
+
+/*
+ * Open a counter for the calling thread on any cpu, disabled.
+ * Returns -1 if the counter is not available.
+ */
+static inline int perf_counter_open(unsigned int type, unsigned long long config) {
+	struct perf_event_attr pe;
+	memset(&pe, 0, sizeof(pe));
+	pe.size=sizeof(pe);
+	pe.type=type;
+	pe.config=config;
+	pe.disabled=1;
+	pe.exclude_kernel=1;
+	pe.exclude_hv=1;
+	int fd=syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+	if(fd==-1) {
+		fprintf(stderr, "WARNING: perf_event_open(type=%u, config=%llx): %s\n", type, config, strerror(errno));
+	}
+	return fd;
+}
+
+/*
+ * Two events which say a lot about memory access patterns
+ */
+static inline int perf_counter_open_dtlb_misses() {
+	return perf_counter_open(PERF_TYPE_HW_CACHE, perf_cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+}
+
+static inline int perf_counter_open_page_faults() {
+	return perf_counter_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+}
+
+static inline void perf_counter_start(int fd) {
+	if(fd==-1) {
+		return;
+	}
+	CHECK_NOT_M1(ioctl(fd, PERF_EVENT_IOC_RESET, 0));
+	CHECK_NOT_M1(ioctl(fd, PERF_EVENT_IOC_ENABLE, 0));
+}
+
+static inline long long perf_counter_stop(int fd) {
+	if(fd==-1) {
+		return -1;
+	}
+	CHECK_NOT_M1(ioctl(fd, PERF_EVENT_IOC_DISABLE, 0));
+	long long count;
+	CHECK_ASSERT(CHECK_NOT_M1(read(fd, &count, sizeof(count)))==sizeof(count));
+	return count;
+}
+
+static inline void perf_counter_close(int fd) {
+	if(fd==-1) {
+		return;
+	}
+	CHECK_NOT_M1(close(fd));
+}
+
+#endif	/* !__perf_utils_h */
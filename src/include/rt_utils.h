@@ -0,0 +1,287 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __rt_utils_h
+#define __rt_utils_h
+
+/*
+ * This is a collection of helpers to set up the memory of a real time
+ * application so that it takes no page faults once it is running.
+ * It puts together what real_time/disable_malloc.cc,
+ * memory_allocation/lazy.cc and pthread_stack_prefault() each show:
+ *
+ * rt_memory_init(heap, reservoir) at startup:
+ * - tunes malloc(3) with mallopt(3) to never return memory to the kernel
+ * (M_TRIM_THRESHOLD) and to never use mmap(2) for big blocks (M_MMAP_MAX)
+ * so that everything comes from the heap we prefault.
+ * - locks all current and future memory with mlockall(2).
+ * - grows the malloc heap by 'heap' bytes, touches every page and frees
+ * it again: the memory stays in the (locked, faulted) heap.
+ * - maps a 'reservoir' of 'reservoir' bytes with MAP_POPULATE for
+ * rt_reservoir_alloc(), a bump allocator for memory which lives as long
+ * as the application.
+ * - prefaults the stack of the calling thread.
+ *
+ * rt_pthread_create() starts a thread which prefaults its own stack
+ * before running your function.
+ *
+ * rt_malloc_lock(RT_MALLOC_COUNT or RT_MALLOC_TRAP) after init makes
+ * every malloc(3)/free(3) count or abort the process. This needs the
+ * malloc hook: the __malloc_hook variables used by disable_malloc.cc
+ * are gone since glibc 2.34, so instead we interpose malloc(3) and
+ * friends and call the glibc implementations (__libc_malloc and co).
+ * Define RT_MALLOC_HOOK before including this file in exactly one
+ * source file of your program to get the interposers.
+ *
+ * rt_faults_start()/rt_faults_end() use getrusage(2) with
+ * RUSAGE_THREAD to count the page faults the calling thread took in
+ * between, which is how a real time thread proves that its steady
+ * state is fault free.
+ *
+ * Notes:
+ * - mlockall(2) needs CAP_IPC_LOCK or a big enough RLIMIT_MEMLOCK
+ * (ulimit -l). If it fails we warn and go on, the faults report
+ * will tell you the price.
+ * - M_ARENA_MAX is set to 1 so that new threads do not create new
+ * (unfaulted) malloc arenas. This serializes malloc(3) between threads,
+ * which real time threads should not call anyway.
+ * - like everything in these headers the state is static, so call all
+ * of this from the same source file (all examples are a single file).
+ *
+ * References:
+ * https://wiki.linuxfoundation.org/realtime/documentation/howto/applications/memory
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/mman.h>	// for mlockall(2), mmap(2), MAP_POPULATE
+#include <sys/time.h>	// for getrusage(2), rusage:struct
+#include <sys/resource.h>	// for getrusage(2), RUSAGE_THREAD
+#include <malloc.h>	// for mallopt(3), M_TRIM_THRESHOLD, M_MMAP_MAX, M_ARENA_MAX
+#include <pthread.h>	// for pthread_create(3), pthread_t, pthread_attr_t
+#include <stdio.h>	// for printf(3), fprintf(3)
+#include <stdlib.h>	// for malloc(3), free(3), abort(3)
+#include <string.h>	// for strerror(3), strlen(3)
+#include <unistd.h>	// for getpagesize(2), write(2)
+#include <errno.h>	// for errno, EINVAL, ENOMEM
+#include <pthread_utils.h>	// for pthread_stack_prefault()
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_VOIDP(), CHECK_NOT_NULL(), CHECK_ZERO_ERRNO(), CHECK_ASSERT()
+
+typedef enum _rt_malloc_mode {
+	// malloc(3) works and is not counted, this is the init phase
+	RT_MALLOC_ALLOW,
+	// malloc(3) works but every call is counted
+	RT_MALLOC_COUNT,
+	// malloc(3) aborts the process
+	RT_MALLOC_TRAP,
+} rt_malloc_mode;
+
+static rt_malloc_mode rt_malloc_mode_current=RT_MALLOC_ALLOW;
+static unsigned long rt_malloc_count=0;
+static unsigned long rt_free_count=0;
+
+/*
+ * The reservoir, a populated (and locked) mapping we bump allocate from
+ */
+static char* rt_reservoir_cur=NULL;
+static char* rt_reservoir_end=NULL;
+
+/*
+ * Change what happens on malloc(3)/free(3). Only has an effect if the
+ * hook was compiled in (RT_MALLOC_HOOK).
+ */
+static inline void rt_malloc_lock(rt_malloc_mode mode) {
+	__atomic_store_n(&rt_malloc_mode_current, mode, __ATOMIC_SEQ_CST);
+}
+
+static inline unsigned long rt_malloc_calls() {
+	return __atomic_load_n(&rt_malloc_count, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long rt_free_calls() {
+	return __atomic_load_n(&rt_free_count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get 'size' bytes from the reservoir. Never blocks, never faults,
+ * never freed.
+ */
+static inline void* rt_reservoir_alloc(size_t size) {
+	size=(size+15) & ~15UL;
+	char* p=__atomic_fetch_add(&rt_reservoir_cur, size, __ATOMIC_RELAXED);
+	CHECK_ASSERT(p+size<=rt_reservoir_end);
+	return p;
+}
+
+static inline void rt_memory_init(size_t heap, size_t reservoir) {
+	CHECK_ASSERT(mallopt(M_TRIM_THRESHOLD, -1)==1);
+	CHECK_ASSERT(mallopt(M_MMAP_MAX, 0)==1);
+	CHECK_ASSERT(mallopt(M_ARENA_MAX, 1)==1);
+	if(mlockall(MCL_CURRENT | MCL_FUTURE)==-1) {
+		fprintf(stderr, "WARNING: mlockall(2) failed: %s, memory is not locked\n", strerror(errno));
+	}
+	if(heap>0) {
+		int page_size=getpagesize();
+		char* p=(char*)CHECK_NOT_NULL(malloc(heap));
+		for(size_t i=0; i<heap; i+=page_size) {
+			p[i]=0;
+		}
+		// since M_TRIM_THRESHOLD is off this stays in the heap
+		free(p);
+	}
+	if(reservoir>0) {
+		rt_reservoir_cur=(char*)CHECK_NOT_VOIDP(mmap(NULL, reservoir, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0), MAP_FAILED);
+		rt_reservoir_end=rt_reservoir_cur+reservoir;
+	}
+	pthread_stack_prefault();
+}
+
+typedef struct _rt_thread_start {
+	void* (*start_routine)(void*);
+	void* arg;
+} rt_thread_start;
+
+static inline void* rt_thread_trampoline(void* p) {
+	rt_thread_start s=*(rt_thread_start*)p;
+	free(p);
+	pthread_stack_prefault();
+	return s.start_routine(s.arg);
+}
+
+/*
+ * pthread_create(3) for threads which prefault their stack before
+ * doing anything else. Call it during init, it mallocs.
+ */
+static inline void rt_pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg) {
+	rt_thread_start* s=(rt_thread_start*)CHECK_NOT_NULL(malloc(sizeof(rt_thread_start)));
+	s->start_routine=start_routine;
+	s->arg=arg;
+	CHECK_ZERO_ERRNO(pthread_create(thread, attr, rt_thread_trampoline, s));
+}
+
+typedef struct _rt_faults {
+	long minflt;
+	long majflt;
+} rt_faults;
+
+static inline void rt_faults_start(rt_faults* f) {
+	struct rusage usage;
+	CHECK_NOT_M1(getrusage(RUSAGE_THREAD, &usage));
+	f->minflt=usage.ru_minflt;
+	f->majflt=usage.ru_majflt;
+}
+
+/*
+ * Turn 'f' into the number of faults since rt_faults_start()
+ */
+static inline void rt_faults_end(rt_faults* f) {
+	struct rusage usage;
+	CHECK_NOT_M1(getrusage(RUSAGE_THREAD, &usage));
+	f->minflt=usage.ru_minflt-f->minflt;
+	f->majflt=usage.ru_majflt-f->majflt;
+}
+
+static inline void rt_faults_print(const char* name, const rt_faults* f) {
+	printf("%s: %ld minor faults, %ld major faults\n", name, f->minflt, f->majflt);
+}
+
+#ifdef RT_MALLOC_HOOK
+
+#ifdef __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+/*
+ * No stdio here, it may call malloc(3)
+ */
+static inline void rt_malloc_check(unsigned long* counter) {
+	switch(__atomic_load_n(&rt_malloc_mode_current, __ATOMIC_RELAXED)) {
+	case RT_MALLOC_ALLOW:
+		break;
+	case RT_MALLOC_COUNT:
+		__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+		break;
+	case RT_MALLOC_TRAP: {
+		const char msg[]="ERROR: malloc(3)/free(3) called in the real time phase\n";
+		ssize_t ret __attribute__((unused))=write(2, msg, strlen(msg));
+		abort();
+	}
+	}
+}
+
+void* malloc(size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+	rt_malloc_check(&rt_malloc_count);
+	// what glibc checks, __libc_memalign() would round the alignment up
+	if(alignment%sizeof(void*)!=0 || (alignment & (alignment-1))!=0 || alignment==0) {
+		return EINVAL;
+	}
+	void* p=__libc_memalign(alignment, size);
+	if(p==NULL) {
+		return ENOMEM;
+	}
+	*memptr=p;
+	return 0;
+}
+
+void free(void* ptr) {
+	if(ptr==NULL) {
+		return;
+	}
+	rt_malloc_check(&rt_free_count);
+	__libc_free(ptr);
+}
+
+#ifdef __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* RT_MALLOC_HOOK */
+
+#endif	/* !__rt_utils_h */
@@ -0,0 +1,444 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __scan_utils_h
+#define __scan_utils_h
+
+/*
+ * Streaming scans of big files: read a file once, from start to end,
+ * as fast as possible, and (optionally) without pushing the rest of the
+ * system out of the page cache.
+ *
+ * The modes, which are ways of telling the kernel what is coming:
+ * - SCAN_READ: plain read(2), the kernel read ahead detects the pattern.
+ * - SCAN_FADVISE: posix_fadvise(2) SEQUENTIAL (double read ahead window)
+ * and WILLNEED for the window ahead of the reader.
+ * - SCAN_READAHEAD: readahead(2) of the window ahead of the reader.
+ * - SCAN_MMAP: mmap(2) of a chunk at a time with MADV_SEQUENTIAL and
+ * POSIX_FADV_WILLNEED for the next chunk, no copy at all.
+ *
+ * Options:
+ * - threaded: a helper thread reads the next chunk into a second buffer
+ * while the callback works on the current one (double buffering). The
+ * disk and the cpu work at the same time. Not for SCAN_MMAP, where the
+ * read ahead does this.
+ * - polite: every chunk is dropped from the page cache (POSIX_FADV_DONTNEED)
+ * after the callback saw it, except for the pages which were in the
+ * cache before the scan started (found with mincore(2)): they are
+ * someone's hot data. The check is done once at the start since the
+ * read ahead brings pages in before the reader gets to them. The page
+ * cache holds big files in large folios (up to 2MB on x86-64), which
+ * POSIX_FADV_DONTNEED only drops when the whole folio is in the range,
+ * so the range dropped starts at the last big aligned boundary. A polite
+ * scan of a file of any size leaves the page cache as it found it.
+ *
+ * scan_resident_pages() is the page cache footprint of a file. scan_file()
+ * samples the footprint as it goes, looking only at the pages read since
+ * the last sample (and, when polite, at those not dropped yet), which keeps
+ * the sampling linear in the size of the file.
+ *
+ * Notes:
+ * - without the polite option a scan of a file larger than the free
+ * memory evicts other cached data, the pages it reads are new and the
+ * kernel keeps them at first.
+ * - the chunk size is the read size, 1MB or more is right for disks.
+ *
+ * References:
+ * man 2 readahead, man 2 posix_fadvise, man 2 madvise, man 2 mincore
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t
+#include <sys/stat.h>	// for fstat(2)
+#include <sys/mman.h>	// for mmap(2), munmap(2), madvise(2), mincore(2)
+#include <fcntl.h>	// for open(2), posix_fadvise(2), readahead(2)
+#include <unistd.h>	// for pread(2), close(2), sysconf(3)
+#include <pthread.h>	// for pthread_create(3), pthread_join(3), pthread_mutex_t, pthread_cond_t
+#include <stdlib.h>	// for malloc(3), free(3), posix_memalign(3)
+#include <string.h>	// for strcmp(3)
+#include <time.h>	// for clock_gettime(2)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_NULL(), CHECK_ZERO_ERRNO(), CHECK_NOT_VOIDP(), CHECK_ERROR(), CHECK_ASSERT()
+
+typedef enum _scan_mode {
+	SCAN_READ,
+	SCAN_FADVISE,
+	SCAN_READAHEAD,
+	SCAN_MMAP,
+	SCAN_MODES,
+} scan_mode;
+
+static const char* scan_mode_names[SCAN_MODES]={
+	"read", "fadvise", "readahead", "mmap",
+};
+
+static inline scan_mode scan_mode_parse(const char* name) {
+	for(int m=0; m<SCAN_MODES; m++) {
+		if(strcmp(name, scan_mode_names[m])==0) {
+			return (scan_mode)m;
+		}
+	}
+	CHECK_ERROR("unknown scan mode");
+	return SCAN_READ;
+}
+
+typedef struct _scan_cfg {
+	scan_mode mode;
+	// bytes per read (and per callback)
+	size_t chunk;
+	// how far ahead to hint, for SCAN_FADVISE, SCAN_READAHEAD
+	size_t window;
+	int threaded;
+	int polite;
+} scan_cfg;
+
+typedef struct _scan_result {
+	size_t bytes;
+	double seconds;
+	// page cache pages of the file
+	size_t resident_before;
+	size_t resident_peak;
+	size_t resident_after;
+} scan_result;
+
+/*
+ * Called for every chunk, in order
+ */
+typedef void (*scan_func)(const void* data, size_t len, void* arg);
+
+static inline void scan_cfg_init(scan_cfg* cfg, scan_mode mode) {
+	cfg->mode=mode;
+	cfg->chunk=1024*1024;
+	cfg->window=16*1024*1024;
+	cfg->threaded=0;
+	cfg->polite=0;
+}
+
+/*
+ * Which pages of [off, off+len) of the file are in the page cache,
+ * in vec (one byte per page), return how many. off must be page aligned.
+ */
+static inline size_t scan_resident(int fd, off_t off, size_t len, unsigned char* vec) {
+	if(len==0) {
+		return 0;
+	}
+	// mapping without touching does not read anything
+	void* p=CHECK_NOT_VOIDP(mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off), MAP_FAILED);
+	CHECK_NOT_M1(mincore(p, len, vec));
+	CHECK_NOT_M1(munmap(p, len));
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	size_t pages=(len+page_size-1)/page_size;
+	size_t count=0;
+	for(size_t i=0; i<pages; i++) {
+		count+=vec[i] & 1;
+	}
+	return count;
+}
+
+static inline size_t scan_resident_pages(int fd) {
+	struct stat st;
+	CHECK_NOT_M1(fstat(fd, &st));
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	unsigned char* vec=(unsigned char*)CHECK_NOT_NULL(malloc(st.st_size/page_size+1));
+	size_t count=scan_resident(fd, 0, st.st_size, vec);
+	free(vec);
+	return count;
+}
+
+/*
+ * Drop the pages of [off, off+len) which were not resident according to
+ * vec, they are ours
+ */
+static inline void scan_drop(int fd, off_t off, size_t len, const unsigned char* vec) {
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	size_t pages=(len+page_size-1)/page_size;
+	size_t i=0;
+	while(i<pages) {
+		if(vec[i] & 1) {
+			i++;
+			continue;
+		}
+		size_t start=i;
+		while(i<pages && !(vec[i] & 1)) {
+			i++;
+		}
+		CHECK_ZERO_ERRNO(posix_fadvise(fd, off+start*page_size, (i-start)*page_size, POSIX_FADV_DONTNEED));
+	}
+}
+
+/*
+ * One chunk in flight
+ */
+typedef struct _scan_slot {
+	void* buf;
+	size_t len;
+	off_t off;
+	int full;
+} scan_slot;
+
+typedef struct _scan_state {
+	int fd;
+	off_t size;
+	const scan_cfg* cfg;
+	// which pages were resident before the scan
+	unsigned char* before;
+	// all below this is dropped
+	off_t dropped;
+	// up to where scan_sample() looked, the resident pages below it, and
+	// how many of those were resident before
+	off_t sampled;
+	size_t sampled_resident;
+	size_t sampled_before;
+	scan_slot slots[2];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} scan_state;
+
+/*
+ * Read a whole chunk (read(2) may return less), hint ahead first
+ */
+static inline void scan_fill(scan_state* s, scan_slot* slot, off_t off) {
+	const scan_cfg* cfg=s->cfg;
+	size_t len=s->size-off < (off_t)cfg->chunk ? (size_t)(s->size-off) : cfg->chunk;
+	// keep 'window' bytes ahead of the reader hinted
+	off_t ahead=off+cfg->window;
+	if(ahead<s->size) {
+		if(cfg->mode==SCAN_FADVISE) {
+			CHECK_ZERO_ERRNO(posix_fadvise(s->fd, ahead, cfg->chunk, POSIX_FADV_WILLNEED));
+		}
+		if(cfg->mode==SCAN_READAHEAD) {
+			CHECK_NOT_M1(readahead(s->fd, ahead, cfg->chunk));
+		}
+	}
+	size_t done=0;
+	while(done<len) {
+		ssize_t ret=CHECK_NOT_M1(pread(s->fd, (char*)slot->buf+done, len-done, off+done));
+		if(ret==0) {
+			// the file shrank
+			break;
+		}
+		done+=ret;
+	}
+	slot->off=off;
+	slot->len=done;
+}
+
+/*
+ * The largest folio in the page cache (PMD size, 2MB on x86-64, 32MB on
+ * arm64 with 16K pages)
+ */
+static const off_t scan_folio_max=32*1024*1024;
+
+/*
+ * Drop what was read up to 'end' and was not resident before
+ */
+static inline void scan_drop_behind(scan_state* s, off_t end) {
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	scan_drop(s->fd, s->dropped, end-s->dropped, s->before+s->dropped/page_size);
+	// a folio which crosses 'end' is dropped whole by a later call
+	if(end==s->size) {
+		s->dropped=end;
+	} else {
+		s->dropped=end/scan_folio_max*scan_folio_max;
+	}
+}
+
+static inline void* scan_producer(void* arg) {
+	scan_state* s=(scan_state*)arg;
+	off_t off=0;
+	for(unsigned int i=0; ; i++) {
+		scan_slot* slot=s->slots+i%2;
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&s->mutex));
+		while(slot->full) {
+			CHECK_ZERO_ERRNO(pthread_cond_wait(&s->cond, &s->mutex));
+		}
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&s->mutex));
+		// an empty chunk tells the consumer that this is the end
+		if(off<s->size) {
+			scan_fill(s, slot, off);
+		} else {
+			slot->len=0;
+		}
+		CHECK_ZERO_ERRNO(pthread_mutex_lock(&s->mutex));
+		slot->full=1;
+		CHECK_ZERO_ERRNO(pthread_cond_broadcast(&s->cond));
+		CHECK_ZERO_ERRNO(pthread_mutex_unlock(&s->mutex));
+		if(slot->len==0) {
+			return NULL;
+		}
+		off+=slot->len;
+	}
+}
+
+static inline size_t scan_before_count(const scan_state* s, off_t from, off_t to) {
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	size_t count=0;
+	for(off_t i=from/page_size; i<(to+(off_t)page_size-1)/(off_t)page_size; i++) {
+		count+=s->before[i] & 1;
+	}
+	return count;
+}
+
+/*
+ * Pages which were not read yet are as they were before the scan, so are
+ * the ones below s->dropped when polite. Only the rest is looked at.
+ */
+static inline void scan_sample(scan_state* s, scan_result* r, size_t* next_sample) {
+	const size_t sample_every=64*1024*1024;
+	if(r->bytes<*next_sample) {
+		return;
+	}
+	*next_sample+=sample_every;
+	off_t end=r->bytes;
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	s->sampled_before+=scan_before_count(s, s->sampled, end);
+	off_t from=s->sampled;
+	size_t below=s->sampled_resident;
+	if(s->cfg->polite) {
+		from=s->dropped;
+		below=s->sampled_before-scan_before_count(s, from, end);
+	}
+	unsigned char* vec=(unsigned char*)CHECK_NOT_NULL(malloc((end-from)/page_size+1));
+	s->sampled_resident=below+scan_resident(s->fd, from, end-from, vec);
+	free(vec);
+	s->sampled=end;
+	size_t resident=s->sampled_resident+r->resident_before-s->sampled_before;
+	if(resident>r->resident_peak) {
+		r->resident_peak=resident;
+	}
+}
+
+static inline void scan_consume(scan_state* s, scan_slot* slot, scan_func func, void* arg, scan_result* r, size_t* next_sample) {
+	func(slot->buf, slot->len, arg);
+	r->bytes+=slot->len;
+	scan_sample(s, r, next_sample);
+	if(s->cfg->polite) {
+		scan_drop_behind(s, slot->off+slot->len);
+	}
+}
+
+static inline void scan_mmap(scan_state* s, scan_func func, void* arg, scan_result* r, size_t* next_sample) {
+	const scan_cfg* cfg=s->cfg;
+	for(off_t off=0; off<s->size; off+=cfg->chunk) {
+		size_t len=s->size-off < (off_t)cfg->chunk ? (size_t)(s->size-off) : cfg->chunk;
+		void* p=CHECK_NOT_VOIDP(mmap(NULL, len, PROT_READ, MAP_SHARED, s->fd, off), MAP_FAILED);
+		CHECK_NOT_M1(madvise(p, len, MADV_SEQUENTIAL));
+		// and the next one, its mapping does not exist yet, so through the file
+		if(off+(off_t)len<s->size) {
+			CHECK_ZERO_ERRNO(posix_fadvise(s->fd, off+len, cfg->chunk, POSIX_FADV_WILLNEED));
+		}
+		func(p, len, arg);
+		// mapped pages can not be dropped
+		CHECK_NOT_M1(munmap(p, len));
+		r->bytes+=len;
+		scan_sample(s, r, next_sample);
+		if(cfg->polite) {
+			scan_drop_behind(s, off+len);
+		}
+	}
+}
+
+/*
+ * Scan the file 'fd' calling 'func' on every chunk
+ */
+static inline void scan_fd(int fd, const scan_cfg* cfg, scan_func func, void* arg, scan_result* r) {
+	scan_state s;
+	s.fd=fd;
+	s.cfg=cfg;
+	struct stat st;
+	CHECK_NOT_M1(fstat(fd, &st));
+	s.size=st.st_size;
+	size_t page_size=sysconf(_SC_PAGESIZE);
+	CHECK_ASSERT(cfg->chunk%page_size==0);
+	for(int i=0; i<2; i++) {
+		CHECK_ZERO_ERRNO(posix_memalign(&s.slots[i].buf, page_size, cfg->chunk));
+		s.slots[i].full=0;
+	}
+	s.before=(unsigned char*)CHECK_NOT_NULL(malloc(s.size/page_size+1));
+	s.dropped=0;
+	s.sampled=0;
+	s.sampled_resident=0;
+	s.sampled_before=0;
+	r->bytes=0;
+	r->resident_before=scan_resident(fd, 0, s.size, s.before);
+	r->resident_peak=r->resident_before;
+	size_t next_sample=0;
+	struct timespec t1, t2;
+	CHECK_NOT_M1(clock_gettime(CLOCK_MONOTONIC, &t1));
+	if(cfg->mode==SCAN_FADVISE) {
+		CHECK_ZERO_ERRNO(posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+		CHECK_ZERO_ERRNO(posix_fadvise(fd, 0, cfg->window, POSIX_FADV_WILLNEED));
+	}
+	if(cfg->mode==SCAN_READAHEAD) {
+		CHECK_NOT_M1(readahead(fd, 0, cfg->window));
+	}
+	if(cfg->mode==SCAN_MMAP) {
+		scan_mmap(&s, func, arg, r, &next_sample);
+	} else if(cfg->threaded) {
+		CHECK_ZERO_ERRNO(pthread_mutex_init(&s.mutex, NULL));
+		CHECK_ZERO_ERRNO(pthread_cond_init(&s.cond, NULL));
+		pthread_t producer;
+		CHECK_ZERO_ERRNO(pthread_create(&producer, NULL, scan_producer, &s));
+		for(unsigned int i=0; ; i++) {
+			scan_slot* slot=s.slots+i%2;
+			CHECK_ZERO_ERRNO(pthread_mutex_lock(&s.mutex));
+			while(!slot->full) {
+				CHECK_ZERO_ERRNO(pthread_cond_wait(&s.cond, &s.mutex));
+			}
+			CHECK_ZERO_ERRNO(pthread_mutex_unlock(&s.mutex));
+			if(slot->len==0) {
+				break;
+			}
+			scan_consume(&s, slot, func, arg, r, &next_sample);
+			CHECK_ZERO_ERRNO(pthread_mutex_lock(&s.mutex));
+			slot->full=0;
+			CHECK_ZERO_ERRNO(pthread_cond_broadcast(&s.cond));
+			CHECK_ZERO_ERRNO(pthread_mutex_unlock(&s.mutex));
+		}
+		CHECK_ZERO_ERRNO(pthread_join(producer, NULL));
+		CHECK_ZERO_ERRNO(pthread_cond_destroy(&s.cond));
+		CHECK_ZERO_ERRNO(pthread_mutex_destroy(&s.mutex));
+	} else {
+		for(off_t off=0; off<s.size; off+=s.slots[0].len) {
+			scan_fill(&s, s.slots, off);
+			if(s.slots[0].len==0) {
+				break;
+			}
+			scan_consume(&s, s.slots, func, arg, r, &next_sample);
+		}
+	}
+	CHECK_NOT_M1(clock_gettime(CLOCK_MONOTONIC, &t2));
+	r->seconds=(t2.tv_sec-t1.tv_sec)+(t2.tv_nsec-t1.tv_nsec)/1e9;
+	r->resident_after=scan_resident_pages(fd);
+	if(r->resident_after>r->resident_peak) {
+		r->resident_peak=r->resident_after;
+	}
+	free(s.before);
+	for(int i=0; i<2; i++) {
+		free(s.slots[i].buf);
+	}
+}
+
+static inline void scan_file(const char* filename, const scan_cfg* cfg, scan_func func, void* arg, scan_result* r) {
+	int fd=CHECK_NOT_M1(open(filename, O_RDONLY));
+	scan_fd(fd, cfg, func, arg, r);
+	CHECK_NOT_M1(close(fd));
+}
+
+#endif	/* !__scan_utils_h */
@@ -0,0 +1,608 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __simd_utils_h
+#define __simd_utils_h
+
+/*
+ * A small library of SIMD kernels with a scalar, an SSE2, an AVX2 and an
+ * AVX-512 version each:
+ * - sum_i32 - sum of 32 bit integers (into 64 bits so it never overflows).
+ * - minmax_i32 - minimum and maximum of 32 bit integers.
+ * - dot_f32 - dot product of two float vectors.
+ * - find_byte - memchr(3).
+ * - histogram_u8 - histogram of bytes.
+ * - f32_to_i16 - floats to 16 bit integers, rounded and saturated (the
+ * usual audio sample conversion).
+ *
+ * The vector versions are compiled with the 'target' attribute, so the
+ * program itself is compiled for the baseline x86-64 (no -march=native)
+ * and runs on any x86-64 machine. A constructor checks the cpu once at
+ * startup (__builtin_cpu_supports()) and fills 'simd_dispatch' with the
+ * best versions, so you call:
+ *	int64_t sum=simd_dispatch.sum_i32(array, n);
+ * which costs one indirect call. simd_select() fills a table with the
+ * versions of any level, which is how the benchmark compares them (see
+ * sse/simd_kernels.cc).
+ *
+ * Notes:
+ * - glibc does the same for its own string functions with ifunc (the
+ * dynamic linker calls a resolver which picks the implementation once).
+ * ifunc needs an exported symbol and all these functions are static in
+ * a header, so we use a table of function pointers instead.
+ * - there is no vector instruction which builds a histogram (AVX-512 CD
+ * conflict detection does not pay for bytes). The vector levels use four
+ * histograms updated in turn so that consecutive equal bytes do not wait
+ * for each other's increments, and one vector compare to count a vector
+ * which holds a single byte value (a run, zeros mostly) with one
+ * addition.
+ * - dot_f32 adds in a different order in each version so the results
+ * differ in the last bits.
+ * - f32_to_i16 of values outside the int32 range (and NaN) gives -32768
+ * in the vector versions like the hardware conversion does.
+ *
+ * References:
+ * https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+ * https://gcc.gnu.org/onlinedocs/gcc/x86-Function-Attributes.html
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <stddef.h>	// for size_t
+#include <stdint.h>	// for int32_t, int64_t, int16_t, uint8_t, uint64_t
+#include <string.h>	// for memset(3), memcpy(3)
+#include <math.h>	// for lrintf(3)
+#include <immintrin.h>	// for SSE2, AVX2 and AVX-512 intrinsics
+#include <err_utils.h>	// for CHECK_ASSERT()
+
+typedef enum _simd_level {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_LEVEL_NUM,
+} simd_level;
+
+typedef struct _simd_kernels {
+	simd_level level;
+	int64_t (*sum_i32)(const int32_t* a, size_t n);
+	void (*minmax_i32)(const int32_t* a, size_t n, int32_t* min, int32_t* max);
+	float (*dot_f32)(const float* a, const float* b, size_t n);
+	const void* (*find_byte)(const void* s, int c, size_t n);
+	// 'hist' has 256 entries and is overwritten
+	void (*histogram_u8)(const uint8_t* a, size_t n, uint64_t* hist);
+	void (*f32_to_i16)(const float* a, int16_t* out, size_t n);
+} simd_kernels;
+
+static inline const char* simd_level_name(simd_level level) {
+	switch(level) {
+	case SIMD_SCALAR:
+		return "scalar";
+	case SIMD_SSE2:
+		return "sse2";
+	case SIMD_AVX2:
+		return "avx2";
+	case SIMD_AVX512:
+		return "avx512";
+	default:
+		return "unknown";
+	}
+}
+
+static inline int simd_level_supported(simd_level level) {
+	__builtin_cpu_init();
+	switch(level) {
+	case SIMD_SCALAR:
+	case SIMD_SSE2:
+		// part of x86-64
+		return 1;
+	case SIMD_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case SIMD_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	default:
+		return 0;
+	}
+}
+
+/*
+ * scalar
+ */
+static int64_t simd_sum_i32_scalar(const int32_t* a, size_t n) {
+	int64_t sum=0;
+	for(size_t i=0; i<n; i++) {
+		sum+=a[i];
+	}
+	return sum;
+}
+
+static void simd_minmax_i32_scalar(const int32_t* a, size_t n, int32_t* min, int32_t* max) {
+	int32_t mn=INT32_MAX;
+	int32_t mx=INT32_MIN;
+	for(size_t i=0; i<n; i++) {
+		if(a[i]<mn) {
+			mn=a[i];
+		}
+		if(a[i]>mx) {
+			mx=a[i];
+		}
+	}
+	*min=mn;
+	*max=mx;
+}
+
+static float simd_dot_f32_scalar(const float* a, const float* b, size_t n) {
+	float sum=0;
+	for(size_t i=0; i<n; i++) {
+		sum+=a[i]*b[i];
+	}
+	return sum;
+}
+
+static const void* simd_find_byte_scalar(const void* s, int c, size_t n) {
+	const unsigned char* p=(const unsigned char*)s;
+	for(size_t i=0; i<n; i++) {
+		if(p[i]==(unsigned char)c) {
+			return p+i;
+		}
+	}
+	return NULL;
+}
+
+static void simd_histogram_u8_scalar(const uint8_t* a, size_t n, uint64_t* hist) {
+	memset(hist, 0, 256*sizeof(uint64_t));
+	for(size_t i=0; i<n; i++) {
+		hist[a[i]]++;
+	}
+}
+
+static inline int16_t simd_f32_to_i16_one(float f) {
+	long l=lrintf(f);
+	if(l>INT16_MAX) {
+		return INT16_MAX;
+	}
+	if(l<INT16_MIN) {
+		return INT16_MIN;
+	}
+	return l;
+}
+
+static void simd_f32_to_i16_scalar(const float* a, int16_t* out, size_t n) {
+	for(size_t i=0; i<n; i++) {
+		out[i]=simd_f32_to_i16_one(a[i]);
+	}
+}
+
+// add the eight bytes of v to the four tables in turn
+static inline void simd_histogram_u8_add8(uint64_t t[4][256], uint64_t v) {
+	t[0][v & 0xff]++;
+	t[1][(v >> 8) & 0xff]++;
+	t[2][(v >> 16) & 0xff]++;
+	t[3][(v >> 24) & 0xff]++;
+	t[0][(v >> 32) & 0xff]++;
+	t[1][(v >> 40) & 0xff]++;
+	t[2][(v >> 48) & 0xff]++;
+	t[3][v >> 56]++;
+}
+
+// the tail and the sum of the tables
+static inline void simd_histogram_u8_finish(uint64_t t[4][256], const uint8_t* a, size_t n, uint64_t* hist) {
+	for(size_t i=0; i<n; i++) {
+		t[0][a[i]]++;
+	}
+	for(int j=0; j<256; j++) {
+		hist[j]=t[0][j]+t[1][j]+t[2][j]+t[3][j];
+	}
+}
+
+/*
+ * SSE2
+ */
+static int64_t simd_sum_i32_sse2(const int32_t* a, size_t n) {
+	__m128i acc=_mm_setzero_si128();
+	size_t i=0;
+	for(; i+4<=n; i+=4) {
+		__m128i v=_mm_loadu_si128((const __m128i*)(a+i));
+		// sign extend to 64 bits, SSE2 has no instruction for it
+		__m128i sign=_mm_srai_epi32(v, 31);
+		acc=_mm_add_epi64(acc, _mm_unpacklo_epi32(v, sign));
+		acc=_mm_add_epi64(acc, _mm_unpackhi_epi32(v, sign));
+	}
+	int64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	int64_t sum=lanes[0]+lanes[1];
+	for(; i<n; i++) {
+		sum+=a[i];
+	}
+	return sum;
+}
+
+// SSE2 has no 32 bit min/max (pminsd is SSE4.1), select with masks
+static inline __m128i simd_select_sse2(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void simd_minmax_i32_sse2(const int32_t* a, size_t n, int32_t* min, int32_t* max) {
+	__m128i mn=_mm_set1_epi32(INT32_MAX);
+	__m128i mx=_mm_set1_epi32(INT32_MIN);
+	size_t i=0;
+	for(; i+4<=n; i+=4) {
+		__m128i v=_mm_loadu_si128((const __m128i*)(a+i));
+		mn=simd_select_sse2(_mm_cmplt_epi32(v, mn), v, mn);
+		mx=simd_select_sse2(_mm_cmpgt_epi32(v, mx), v, mx);
+	}
+	int32_t lmn[4], lmx[4];
+	_mm_storeu_si128((__m128i*)lmn, mn);
+	_mm_storeu_si128((__m128i*)lmx, mx);
+	int32_t rmn, rmx;
+	simd_minmax_i32_scalar(a+i, n-i, &rmn, &rmx);
+	for(int j=0; j<4; j++) {
+		if(lmn[j]<rmn) {
+			rmn=lmn[j];
+		}
+		if(lmx[j]>rmx) {
+			rmx=lmx[j];
+		}
+	}
+	*min=rmn;
+	*max=rmx;
+}
+
+static float simd_dot_f32_sse2(const float* a, const float* b, size_t n) {
+	__m128 acc0=_mm_setzero_ps();
+	__m128 acc1=_mm_setzero_ps();
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		acc0=_mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+		acc1=_mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	float sum=lanes[0]+lanes[1]+lanes[2]+lanes[3];
+	for(; i<n; i++) {
+		sum+=a[i]*b[i];
+	}
+	return sum;
+}
+
+static const void* simd_find_byte_sse2(const void* s, int c, size_t n) {
+	const char* p=(const char*)s;
+	__m128i needle=_mm_set1_epi8(c);
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		unsigned int m=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i)), needle));
+		if(m) {
+			return p+i+__builtin_ctz(m);
+		}
+	}
+	return simd_find_byte_scalar(p+i, c, n-i);
+}
+
+// four tables, a vector of a single byte value (a run) is one addition
+static void simd_histogram_u8_sse2(const uint8_t* a, size_t n, uint64_t* hist) {
+	uint64_t t[4][256];
+	memset(t, 0, sizeof(t));
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m128i v=_mm_loadu_si128((const __m128i*)(a+i));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(a[i])))==0xFFFF) {
+			t[0][a[i]]+=16;
+			continue;
+		}
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, v);
+		simd_histogram_u8_add8(t, lanes[0]);
+		simd_histogram_u8_add8(t, lanes[1]);
+	}
+	simd_histogram_u8_finish(t, a+i, n-i, hist);
+}
+
+static void simd_f32_to_i16_sse2(const float* a, int16_t* out, size_t n) {
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		__m128i lo=_mm_cvtps_epi32(_mm_loadu_ps(a+i));
+		__m128i hi=_mm_cvtps_epi32(_mm_loadu_ps(a+i+4));
+		// packs saturates
+		_mm_storeu_si128((__m128i*)(out+i), _mm_packs_epi32(lo, hi));
+	}
+	simd_f32_to_i16_scalar(a+i, out+i, n-i);
+}
+
+/*
+ * AVX2 (and FMA, which came with it)
+ */
+__attribute__((target("avx2,fma"))) static int64_t simd_sum_i32_avx2(const int32_t* a, size_t n) {
+	__m256i acc0=_mm256_setzero_si256();
+	__m256i acc1=_mm256_setzero_si256();
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		__m256i v=_mm256_loadu_si256((const __m256i*)(a+i));
+		acc0=_mm256_add_epi64(acc0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+		acc1=_mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+	}
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+	int64_t sum=lanes[0]+lanes[1]+lanes[2]+lanes[3];
+	for(; i<n; i++) {
+		sum+=a[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx2,fma"))) static void simd_minmax_i32_avx2(const int32_t* a, size_t n, int32_t* min, int32_t* max) {
+	__m256i mn=_mm256_set1_epi32(INT32_MAX);
+	__m256i mx=_mm256_set1_epi32(INT32_MIN);
+	size_t i=0;
+	for(; i+8<=n; i+=8) {
+		__m256i v=_mm256_loadu_si256((const __m256i*)(a+i));
+		mn=_mm256_min_epi32(mn, v);
+		mx=_mm256_max_epi32(mx, v);
+	}
+	int32_t lmn[8], lmx[8];
+	_mm256_storeu_si256((__m256i*)lmn, mn);
+	_mm256_storeu_si256((__m256i*)lmx, mx);
+	int32_t rmn, rmx;
+	simd_minmax_i32_scalar(a+i, n-i, &rmn, &rmx);
+	for(int j=0; j<8; j++) {
+		if(lmn[j]<rmn) {
+			rmn=lmn[j];
+		}
+		if(lmx[j]>rmx) {
+			rmx=lmx[j];
+		}
+	}
+	*min=rmn;
+	*max=rmx;
+}
+
+__attribute__((target("avx2,fma"))) static float simd_dot_f32_avx2(const float* a, const float* b, size_t n) {
+	// four accumulators hide the latency of the fma
+	__m256 acc0=_mm256_setzero_ps();
+	__m256 acc1=_mm256_setzero_ps();
+	__m256 acc2=_mm256_setzero_ps();
+	__m256 acc3=_mm256_setzero_ps();
+	size_t i=0;
+	for(; i+32<=n; i+=32) {
+		acc0=_mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), acc0);
+		acc1=_mm256_fmadd_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8), acc1);
+		acc2=_mm256_fmadd_ps(_mm256_loadu_ps(a+i+16), _mm256_loadu_ps(b+i+16), acc2);
+		acc3=_mm256_fmadd_ps(_mm256_loadu_ps(a+i+24), _mm256_loadu_ps(b+i+24), acc3);
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+	float sum=0;
+	for(int j=0; j<8; j++) {
+		sum+=lanes[j];
+	}
+	for(; i<n; i++) {
+		sum+=a[i]*b[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx2,fma"))) static const void* simd_find_byte_avx2(const void* s, int c, size_t n) {
+	const char* p=(const char*)s;
+	__m256i needle=_mm256_set1_epi8(c);
+	size_t i=0;
+	for(; i+32<=n; i+=32) {
+		unsigned int m=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i)), needle));
+		if(m) {
+			return p+i+__builtin_ctz(m);
+		}
+	}
+	return simd_find_byte_scalar(p+i, c, n-i);
+}
+
+__attribute__((target("avx2,fma"))) static void simd_histogram_u8_avx2(const uint8_t* a, size_t n, uint64_t* hist) {
+	uint64_t t[4][256];
+	memset(t, 0, sizeof(t));
+	size_t i=0;
+	for(; i+32<=n; i+=32) {
+		__m256i v=_mm256_loadu_si256((const __m256i*)(a+i));
+		if((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a[i])))==0xFFFFFFFF) {
+			t[0][a[i]]+=32;
+			continue;
+		}
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i*)lanes, v);
+		for(int l=0; l<4; l++) {
+			simd_histogram_u8_add8(t, lanes[l]);
+		}
+	}
+	simd_histogram_u8_finish(t, a+i, n-i, hist);
+}
+
+__attribute__((target("avx2,fma"))) static void simd_f32_to_i16_avx2(const float* a, int16_t* out, size_t n) {
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m256i lo=_mm256_cvtps_epi32(_mm256_loadu_ps(a+i));
+		__m256i hi=_mm256_cvtps_epi32(_mm256_loadu_ps(a+i+8));
+		// packs works within 128 bit lanes, put the quarters back in order
+		__m256i packed=_mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i*)(out+i), packed);
+	}
+	simd_f32_to_i16_scalar(a+i, out+i, n-i);
+}
+
+/*
+ * AVX-512 (F and BW)
+ *
+ * The AVX-512 intrinsics of gcc 12 initialize their "undefined" vectors
+ * from themselves which -Wuninitialized flags (gcc bug 105593).
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx512bw"))) static int64_t simd_sum_i32_avx512(const int32_t* a, size_t n) {
+	__m512i acc0=_mm512_setzero_si512();
+	__m512i acc1=_mm512_setzero_si512();
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m512i v=_mm512_loadu_si512(a+i);
+		acc0=_mm512_add_epi64(acc0, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+		acc1=_mm512_add_epi64(acc1, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+	}
+	int64_t sum=_mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+	for(; i<n; i++) {
+		sum+=a[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void simd_minmax_i32_avx512(const int32_t* a, size_t n, int32_t* min, int32_t* max) {
+	__m512i mn=_mm512_set1_epi32(INT32_MAX);
+	__m512i mx=_mm512_set1_epi32(INT32_MIN);
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m512i v=_mm512_loadu_si512(a+i);
+		mn=_mm512_min_epi32(mn, v);
+		mx=_mm512_max_epi32(mx, v);
+	}
+	int32_t rmn, rmx;
+	simd_minmax_i32_scalar(a+i, n-i, &rmn, &rmx);
+	int32_t vmn=_mm512_reduce_min_epi32(mn);
+	int32_t vmx=_mm512_reduce_max_epi32(mx);
+	*min=vmn<rmn ? vmn : rmn;
+	*max=vmx>rmx ? vmx : rmx;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static float simd_dot_f32_avx512(const float* a, const float* b, size_t n) {
+	__m512 acc0=_mm512_setzero_ps();
+	__m512 acc1=_mm512_setzero_ps();
+	__m512 acc2=_mm512_setzero_ps();
+	__m512 acc3=_mm512_setzero_ps();
+	size_t i=0;
+	for(; i+64<=n; i+=64) {
+		acc0=_mm512_fmadd_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i), acc0);
+		acc1=_mm512_fmadd_ps(_mm512_loadu_ps(a+i+16), _mm512_loadu_ps(b+i+16), acc1);
+		acc2=_mm512_fmadd_ps(_mm512_loadu_ps(a+i+32), _mm512_loadu_ps(b+i+32), acc2);
+		acc3=_mm512_fmadd_ps(_mm512_loadu_ps(a+i+48), _mm512_loadu_ps(b+i+48), acc3);
+	}
+	float sum=_mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+	for(; i<n; i++) {
+		sum+=a[i]*b[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static const void* simd_find_byte_avx512(const void* s, int c, size_t n) {
+	const char* p=(const char*)s;
+	__m512i needle=_mm512_set1_epi8(c);
+	size_t i=0;
+	for(; i+64<=n; i+=64) {
+		__mmask64 m=_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p+i), needle);
+		if(m) {
+			return p+i+__builtin_ctzll(m);
+		}
+	}
+	return simd_find_byte_scalar(p+i, c, n-i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void simd_histogram_u8_avx512(const uint8_t* a, size_t n, uint64_t* hist) {
+	uint64_t t[4][256];
+	memset(t, 0, sizeof(t));
+	size_t i=0;
+	for(; i+64<=n; i+=64) {
+		__m512i v=_mm512_loadu_si512(a+i);
+		if(_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(a[i]))==~0ULL) {
+			t[0][a[i]]+=64;
+			continue;
+		}
+		uint64_t lanes[8];
+		_mm512_storeu_si512(lanes, v);
+		for(int l=0; l<8; l++) {
+			simd_histogram_u8_add8(t, lanes[l]);
+		}
+	}
+	simd_histogram_u8_finish(t, a+i, n-i, hist);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void simd_f32_to_i16_avx512(const float* a, int16_t* out, size_t n) {
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		// a saturating narrowing store, no packing and no permuting
+		__m512i v=_mm512_cvtps_epi32(_mm512_loadu_ps(a+i));
+		_mm256_storeu_si256((__m256i*)(out+i), _mm512_cvtsepi32_epi16(v));
+	}
+	simd_f32_to_i16_scalar(a+i, out+i, n-i);
+}
+#pragma GCC diagnostic pop
+
+/*
+ * Fill 'k' with the versions of 'level', which must be supported
+ */
+static inline void simd_select(simd_kernels* k, simd_level level) {
+	CHECK_ASSERT(simd_level_supported(level));
+	k->level=level;
+	switch(level) {
+	case SIMD_SCALAR:
+		k->sum_i32=simd_sum_i32_scalar;
+		k->minmax_i32=simd_minmax_i32_scalar;
+		k->dot_f32=simd_dot_f32_scalar;
+		k->find_byte=simd_find_byte_scalar;
+		k->histogram_u8=simd_histogram_u8_scalar;
+		k->f32_to_i16=simd_f32_to_i16_scalar;
+		break;
+	case SIMD_SSE2:
+		k->sum_i32=simd_sum_i32_sse2;
+		k->minmax_i32=simd_minmax_i32_sse2;
+		k->dot_f32=simd_dot_f32_sse2;
+		k->find_byte=simd_find_byte_sse2;
+		k->histogram_u8=simd_histogram_u8_sse2;
+		k->f32_to_i16=simd_f32_to_i16_sse2;
+		break;
+	case SIMD_AVX2:
+		k->sum_i32=simd_sum_i32_avx2;
+		k->minmax_i32=simd_minmax_i32_avx2;
+		k->dot_f32=simd_dot_f32_avx2;
+		k->find_byte=simd_find_byte_avx2;
+		k->histogram_u8=simd_histogram_u8_avx2;
+		k->f32_to_i16=simd_f32_to_i16_avx2;
+		break;
+	case SIMD_AVX512:
+		k->sum_i32=simd_sum_i32_avx512;
+		k->minmax_i32=simd_minmax_i32_avx512;
+		k->dot_f32=simd_dot_f32_avx512;
+		k->find_byte=simd_find_byte_avx512;
+		k->histogram_u8=simd_histogram_u8_avx512;
+		k->f32_to_i16=simd_f32_to_i16_avx512;
+		break;
+	default:
+		CHECK_ERROR("bad simd level");
+	}
+}
+
+static inline simd_level simd_best_level(void) {
+	int level=SIMD_LEVEL_NUM-1;
+	while(!simd_level_supported((simd_level)level)) {
+		level--;
+	}
+	return (simd_level)level;
+}
+
+/*
+ * The best versions for this cpu, filled once at startup
+ */
+static simd_kernels simd_dispatch;
+
+__attribute__((constructor)) static void simd_dispatch_init(void) {
+	simd_select(&simd_dispatch, simd_best_level());
+}
+
+#endif	/* !__simd_utils_h */
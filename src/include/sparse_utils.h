@@ -0,0 +1,390 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __sparse_utils_h
+#define __sparse_utils_h
+
+/*
+ * Working with sparse files without reading their holes.
+ *
+ * Two ways to find where the data of a file is:
+ * - lseek(2) with SEEK_DATA and SEEK_HOLE: portable (Solaris, the BSDs,
+ * Linux 3.1), works on most file systems, and where it does not the whole
+ * file is one data segment. Preallocated (unwritten) ranges are holes
+ * for it on most file systems since they read as zeros.
+ * - the FS_IOC_FIEMAP ioctl(2): the extents of the file as the file
+ * system stores them, with flags (unwritten, shared, inline, ...) and
+ * the physical location. Linux only and not every file system has it
+ * (not tmpfs, for one).
+ *
+ * On top of the SEEK_DATA/SEEK_HOLE walk:
+ * - sparse_scan(): read only the data segments.
+ * - sparse_checksum(): a checksum of the logical content of the file
+ * which skips the holes. Every non zero 64 bit word contributes a hash
+ * of its value and position and zero words contribute nothing, so holes
+ * can be skipped without changing the result and sparse_checksum_dense()
+ * (which reads every byte) gives the same number. This is for comparing
+ * files, not a cryptographic hash.
+ * - sparse_copy(): copy the data segments only, leaving holes where the
+ * source has holes and where the data is all zeros (blocks of the copy
+ * unit which the VM image wrote zeros to). When writing over an existing
+ * file those ranges are punched with fallocate(2) so the output does not
+ * keep stale blocks.
+ *
+ * References:
+ * man 2 lseek (SEEK_DATA), man 2 fallocate (FALLOC_FL_PUNCH_HOLE)
+ * https://www.kernel.org/doc/html/latest/filesystems/fiemap.html
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t
+#include <sys/stat.h>	// for fstat(2)
+#include <sys/ioctl.h>	// for ioctl(2)
+#include <linux/fs.h>	// for FS_IOC_FIEMAP
+#include <linux/fiemap.h>	// for struct fiemap, struct fiemap_extent, FIEMAP_*
+#include <fcntl.h>	// for fallocate(2), FALLOC_FL_*
+#include <unistd.h>	// for lseek(2), pread(2), pwrite(2), ftruncate(2)
+#include <stdlib.h>	// for malloc(3), free(3)
+#include <string.h>	// for memset(3), memcpy(3)
+#include <errno.h>	// for errno, ENXIO, EINVAL, EOPNOTSUPP
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_NOT_NULL(), CHECK_ASSERT()
+
+typedef struct _sparse_extent {
+	off_t off;
+	off_t len;
+	// FIEMAP_EXTENT_* (only from sparse_fiemap())
+	unsigned int flags;
+	// the physical offset (only from sparse_fiemap())
+	unsigned long physical;
+} sparse_extent;
+
+/*
+ * Called for every extent, in order, return non 0 to stop
+ */
+typedef int (*sparse_extent_cb)(const sparse_extent* e, void* arg);
+
+/*
+ * The data segments with SEEK_DATA/SEEK_HOLE, returns the number of them
+ */
+static inline unsigned long sparse_extents(int fd, sparse_extent_cb cb, void* arg) {
+	struct stat st;
+	CHECK_NOT_M1(fstat(fd, &st));
+	unsigned long n=0;
+	off_t off=0;
+	while(off<st.st_size) {
+		off_t data=lseek(fd, off, SEEK_DATA);
+		if(data==-1) {
+			// ENXIO: only a hole to the end
+			if(errno==ENXIO) {
+				break;
+			}
+			// no SEEK_DATA here, all of it is data
+			CHECK_ASSERT(errno==EINVAL);
+			data=off;
+		}
+		off_t hole=lseek(fd, data, SEEK_HOLE);
+		if(hole==-1) {
+			hole=st.st_size;
+		}
+		sparse_extent e={ data, hole-data, 0, 0 };
+		n++;
+		if(cb!=NULL && cb(&e, arg)) {
+			break;
+		}
+		off=hole;
+	}
+	return n;
+}
+
+/*
+ * The extents of the file system with FS_IOC_FIEMAP, returns the number
+ * of them or -1 (and errno) if the file system can not
+ */
+static inline long sparse_fiemap(int fd, sparse_extent_cb cb, void* arg) {
+	const unsigned int batch=256;
+	struct fiemap* fm=(struct fiemap*)CHECK_NOT_NULL(malloc(sizeof(struct fiemap)+batch*sizeof(struct fiemap_extent)));
+	long n=0;
+	unsigned long start=0;
+	int last=0;
+	while(!last) {
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start=start;
+		fm->fm_length=FIEMAP_MAX_OFFSET-start;
+		// flush dirty pages first, they have no extents yet
+		fm->fm_flags=FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count=batch;
+		if(ioctl(fd, FS_IOC_FIEMAP, fm)==-1) {
+			free(fm);
+			return -1;
+		}
+		if(fm->fm_mapped_extents==0) {
+			break;
+		}
+		for(unsigned int i=0; i<fm->fm_mapped_extents; i++) {
+			struct fiemap_extent* fe=fm->fm_extents+i;
+			sparse_extent e={ (off_t)fe->fe_logical, (off_t)fe->fe_length, fe->fe_flags, fe->fe_physical };
+			n++;
+			if(fe->fe_flags & FIEMAP_EXTENT_LAST) {
+				last=1;
+			}
+			if(cb!=NULL && cb(&e, arg)) {
+				last=1;
+				break;
+			}
+			start=fe->fe_logical+fe->fe_length;
+		}
+	}
+	free(fm);
+	return n;
+}
+
+/*
+ * Called with the data of the file, in order, return non 0 to stop
+ */
+typedef int (*sparse_data_cb)(const void* buf, size_t len, off_t off, void* arg);
+
+typedef struct _sparse_scan_state {
+	int fd;
+	char* buf;
+	size_t bufsize;
+	sparse_data_cb cb;
+	void* arg;
+	unsigned long bytes;
+} sparse_scan_state;
+
+static inline int sparse_scan_extent(const sparse_extent* e, void* arg) {
+	sparse_scan_state* s=(sparse_scan_state*)arg;
+	off_t off=e->off;
+	off_t end=e->off+e->len;
+	while(off<end) {
+		size_t len=end-off<(off_t)s->bufsize ? (size_t)(end-off) : s->bufsize;
+		ssize_t ret=CHECK_NOT_M1(pread(s->fd, s->buf, len, off));
+		// the file got shorter under us
+		if(ret==0) {
+			return 1;
+		}
+		s->bytes+=ret;
+		if(s->cb(s->buf, ret, off, s->arg)) {
+			return 1;
+		}
+		off+=ret;
+	}
+	return 0;
+}
+
+/*
+ * Read the data of the file, and only the data, returns the bytes read
+ */
+static inline unsigned long sparse_scan(int fd, size_t bufsize, sparse_data_cb cb, void* arg) {
+	sparse_scan_state s={ fd, (char*)CHECK_NOT_NULL(malloc(bufsize)), bufsize, cb, arg, 0 };
+	sparse_extents(fd, sparse_scan_extent, &s);
+	free(s.buf);
+	return s.bytes;
+}
+
+/*
+ * The contribution of one word at a word position, 0 for a zero word
+ */
+static inline unsigned long sparse_word_hash(unsigned long w, unsigned long pos) {
+	if(w==0) {
+		return 0;
+	}
+	// the splitmix64 finalizer
+	unsigned long x=w+pos*0x9e3779b97f4a7c15UL;
+	x=(x ^ (x >> 30))*0xbf58476d1ce4e5b9UL;
+	x=(x ^ (x >> 27))*0x94d049bb133111ebUL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * Add the hash of buf which is at off in the file, off is a multiple of 8
+ * (data segments start at block boundaries), a short tail is padded with
+ * zeros
+ */
+static inline int sparse_checksum_cb(const void* buf, size_t len, off_t off, void* arg) {
+	unsigned long* sum=(unsigned long*)arg;
+	const unsigned long* words=(const unsigned long*)buf;
+	unsigned long pos=off/sizeof(unsigned long);
+	size_t n=len/sizeof(unsigned long);
+	unsigned long s=0;
+	for(size_t i=0; i<n; i++) {
+		s+=sparse_word_hash(words[i], pos+i);
+	}
+	if(len%sizeof(unsigned long)!=0) {
+		unsigned long w=0;
+		memcpy(&w, (const char*)buf+n*sizeof(unsigned long), len%sizeof(unsigned long));
+		s+=sparse_word_hash(w, pos+n);
+	}
+	*sum+=s;
+	return 0;
+}
+
+static inline unsigned long sparse_checksum(int fd, size_t bufsize, unsigned long* bytes_read) {
+	unsigned long sum=0;
+	unsigned long bytes=sparse_scan(fd, bufsize, sparse_checksum_cb, &sum);
+	if(bytes_read!=NULL) {
+		*bytes_read=bytes;
+	}
+	return sum;
+}
+
+/*
+ * The same checksum, reading every byte of the file
+ */
+static inline unsigned long sparse_checksum_dense(int fd, size_t bufsize) {
+	char* buf=(char*)CHECK_NOT_NULL(malloc(bufsize));
+	unsigned long sum=0;
+	off_t off=0;
+	ssize_t ret;
+	while((ret=CHECK_NOT_M1(pread(fd, buf, bufsize, off)))>0) {
+		sparse_checksum_cb(buf, ret, off, &sum);
+		off+=ret;
+	}
+	free(buf);
+	return sum;
+}
+
+static inline int sparse_is_zero(const void* buf, size_t len) {
+	const unsigned long* words=(const unsigned long*)buf;
+	size_t n=len/sizeof(unsigned long);
+	for(size_t i=0; i<n; i++) {
+		if(words[i]!=0) {
+			return 0;
+		}
+	}
+	const char* p=(const char*)buf;
+	for(size_t i=n*sizeof(unsigned long); i<len; i++) {
+		if(p[i]!=0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+typedef struct _sparse_copy_stats {
+	// written to the output
+	unsigned long data;
+	// data of the input which was all zeros and left as a hole
+	unsigned long zeros;
+	// punched in the output
+	unsigned long punched;
+} sparse_copy_stats;
+
+typedef struct _sparse_copy_state {
+	int fdout;
+	size_t block;
+	int punch;
+	// the end of what was handled in the output
+	off_t done;
+	sparse_copy_stats* stats;
+	// the range to punch, grown while holes and zero blocks follow each other
+	off_t pending_off;
+	off_t pending_len;
+} sparse_copy_state;
+
+static inline void sparse_punch_flush(sparse_copy_state* s) {
+	if(s->pending_len==0) {
+		return;
+	}
+	CHECK_NOT_M1(fallocate(s->fdout, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, s->pending_off, s->pending_len));
+	s->stats->punched+=s->pending_len;
+	s->pending_len=0;
+}
+
+/*
+ * Punch a range of the output, one fallocate(2) for every run of holes
+ * and zero blocks and not one per block
+ */
+static inline void sparse_punch(sparse_copy_state* s, off_t off, off_t len) {
+	if(!s->punch || len==0) {
+		return;
+	}
+	if(s->pending_len>0 && s->pending_off+s->pending_len==off) {
+		s->pending_len+=len;
+		return;
+	}
+	sparse_punch_flush(s);
+	s->pending_off=off;
+	s->pending_len=len;
+}
+
+static inline int sparse_copy_cb(const void* buf, size_t len, off_t off, void* arg) {
+	sparse_copy_state* s=(sparse_copy_state*)arg;
+	// a hole of the input before this data
+	sparse_punch(s, s->done, off-s->done);
+	// write the blocks which are not all zeros, in runs
+	size_t run_start=0;
+	size_t run_len=0;
+	for(size_t pos=0; pos<len; pos+=s->block) {
+		size_t n=len-pos<s->block ? len-pos : s->block;
+		if(sparse_is_zero((const char*)buf+pos, n)) {
+			if(run_len>0) {
+				CHECK_ASSERT(CHECK_NOT_M1(pwrite(s->fdout, (const char*)buf+run_start, run_len, off+run_start))==(ssize_t)run_len);
+				s->stats->data+=run_len;
+				run_len=0;
+			}
+			sparse_punch(s, off+pos, n);
+			s->stats->zeros+=n;
+		} else {
+			if(run_len==0) {
+				run_start=pos;
+			}
+			run_len+=n;
+		}
+	}
+	if(run_len>0) {
+		CHECK_ASSERT(CHECK_NOT_M1(pwrite(s->fdout, (const char*)buf+run_start, run_len, off+run_start))==(ssize_t)run_len);
+		s->stats->data+=run_len;
+	}
+	s->done=off+len;
+	return 0;
+}
+
+/*
+ * Copy fdin to fdout keeping it sparse. block is the unit of zero
+ * detection (the block size of the output file system is the natural
+ * one). With punch the output may be an existing file: everything which
+ * is a hole or zeros in the input is punched in it. Without it the
+ * output must be empty (O_TRUNC).
+ */
+static inline void sparse_copy(int fdin, int fdout, size_t block, int punch, sparse_copy_stats* stats) {
+	struct stat st;
+	CHECK_NOT_M1(fstat(fdin, &st));
+	stats->data=0;
+	stats->zeros=0;
+	stats->punched=0;
+	sparse_copy_state s={ fdout, block, punch, 0, stats, 0, 0 };
+	// a multiple of the block so the blocks are aligned in the file
+	size_t bufsize=(1024*1024+block-1)/block*block;
+	sparse_scan(fdin, bufsize, sparse_copy_cb, &s);
+	// the hole at the end of the input
+	if(punch && st.st_size>s.done) {
+		struct stat stout;
+		CHECK_NOT_M1(fstat(fdout, &stout));
+		off_t end=stout.st_size<st.st_size ? stout.st_size : st.st_size;
+		if(end>s.done) {
+			sparse_punch(&s, s.done, end-s.done);
+		}
+	}
+	sparse_punch_flush(&s);
+	CHECK_NOT_M1(ftruncate(fdout, st.st_size));
+}
+
+#endif	/* !__sparse_utils_h */
@@ -0,0 +1,526 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __stats_utils_h
+#define __stats_utils_h
+
+/*
+ * A streaming statistics engine: count, sum, mean, variance, min, max and
+ * quantiles of a file of numbers (text or binary) of any size.
+ *
+ * - the file is mapped with mmap(2) (and MADV_SEQUENTIAL) and split into
+ * one range per thread. Text ranges are moved to the next separator so
+ * that no number is cut in two.
+ * - every thread converts its numbers to doubles in blocks of
+ * STATS_BLOCK (a text parser, or a conversion from the binary format, or
+ * nothing at all for doubles: the mapping itself is the block).
+ * - a block is summarized with two vector (AVX2, chosen at runtime) passes
+ * while it is in the L1 cache: sum, min and max, then the sum of squared
+ * distances from the block's mean (a two pass variance, exact up to
+ * rounding). Four lanes times four accumulators means the sum of a block
+ * is a tree of partial sums, which is what pairwise summation does.
+ * - blocks are merged into a thread's summary and thread summaries into
+ * the total with the parallel variance formula (Chan et al.), and the
+ * block sums are added with Kahan-Babuska (Neumaier) compensation.
+ * Compare this to a float accumulator: at 2^24 it stops counting ones.
+ * The sum of integers (below 2^41, so that a block can not pass 2^53)
+ * is exact; for fractions the block sums round and the result is close
+ * to, not exactly, the correctly rounded sum.
+ * - quantiles come from a histogram with a bucket per value of the top 19
+ * bits of the double (sign, exponent and 7 bits of mantissa), a relative
+ * error of at most 1/256 for any value in any range, no configuration
+ * and merging is adding buckets. This is the idea of HdrHistogram.
+ *
+ * Notes:
+ * - the histogram is 4MB per thread, only the pages which are used are
+ * ever written. Merging reads all of it, the pages which were never
+ * written read as the shared zero page and cost no memory.
+ * - NaNs are not filtered out, they make the mean and the variance NaN.
+ * - text numbers are separated by white space or commas. Plain decimals
+ * are parsed by a fast path, anything else (exponents, inf, very long
+ * mantissas) by strtod(3), tokens which are not numbers are counted in
+ * 'skipped'.
+ *
+ * References:
+ * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
+ * https://en.wikipedia.org/wiki/Kahan_summation_algorithm
+ * https://en.wikipedia.org/wiki/Pairwise_summation
+ * http://hdrhistogram.org/
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <stdint.h>	// for uint64_t, int64_t
+#include <stdlib.h>	// for calloc(3), free(3), strtod(3)
+#include <string.h>	// for memcpy(3), strcmp(3)
+#include <math.h>	// for fabs(3), NAN, INFINITY
+#include <sys/mman.h>	// for mmap(2), munmap(2), madvise(2)
+#include <sys/stat.h>	// for fstat(2)
+#include <fcntl.h>	// for open(2), O_RDONLY
+#include <unistd.h>	// for close(2)
+#include <pthread.h>	// for pthread_t, pthread_create(3), pthread_join(3)
+#include <immintrin.h>	// for _mm256_loadu_pd(), _mm256_add_pd(), _mm256_min_pd(), _mm256_max_pd(), _mm256_fmadd_pd()
+#include <err_utils.h>	// for CHECK_NOT_NULL(), CHECK_NOT_M1(), CHECK_NOT_VOIDP(), CHECK_ZERO_ERRNO(), CHECK_ASSERT(), CHECK_ERROR()
+
+#define STATS_BLOCK 4096
+#define STATS_BUCKET_SHIFT 45
+#define STATS_BUCKETS (1 << (64-STATS_BUCKET_SHIFT))
+#define STATS_MAX_THREADS 256
+
+typedef enum _stats_format {
+	STATS_TEXT,
+	STATS_F32,
+	STATS_F64,
+	STATS_I64,
+	STATS_U64,
+} stats_format;
+
+typedef struct _stats {
+	uint64_t count;
+	double mean;
+	// sum of squared distances from the mean
+	double m2;
+	double min;
+	double max;
+	// the sum and its Neumaier compensation
+	double sum;
+	double sum_c;
+	uint64_t skipped;
+	uint64_t* hist;
+} stats;
+
+static inline void stats_init(stats* s) {
+	s->count=0;
+	s->mean=0;
+	s->m2=0;
+	s->min=INFINITY;
+	s->max=-INFINITY;
+	s->sum=0;
+	s->sum_c=0;
+	s->skipped=0;
+	// calloc(3) of big sizes gets zero pages from mmap(2), untouched ones cost nothing
+	s->hist=(uint64_t*)CHECK_NOT_NULL(calloc(STATS_BUCKETS, sizeof(uint64_t)));
+}
+
+static inline void stats_free(stats* s) {
+	free(s->hist);
+	s->hist=NULL;
+}
+
+static inline void stats_add_sum(stats* s, double x) {
+	double t=s->sum+x;
+	if(fabs(s->sum)>=fabs(x)) {
+		s->sum_c+=(s->sum-t)+x;
+	} else {
+		s->sum_c+=(x-t)+s->sum;
+	}
+	s->sum=t;
+}
+
+/*
+ * Merge a summary of 'n' values with mean 'mean' and m2 'm2' into 's'
+ */
+static inline void stats_merge_moments(stats* s, uint64_t n, double mean, double m2) {
+	if(n==0) {
+		return;
+	}
+	uint64_t total=s->count+n;
+	double delta=mean-s->mean;
+	s->mean+=delta*n/total;
+	s->m2+=m2+delta*delta*((double)s->count*n/total);
+	s->count=total;
+}
+
+static inline void stats_block_scalar(const double* x, size_t n, double* sum, double* m2, double* min, double* max) {
+	double su=0, mn=INFINITY, mx=-INFINITY;
+	for(size_t i=0; i<n; i++) {
+		su+=x[i];
+		mn=x[i]<mn ? x[i] : mn;
+		mx=x[i]>mx ? x[i] : mx;
+	}
+	double mean=su/n;
+	double m=0;
+	for(size_t i=0; i<n; i++) {
+		m+=(x[i]-mean)*(x[i]-mean);
+	}
+	*sum=su;
+	*m2=m;
+	*min=mn;
+	*max=mx;
+}
+
+__attribute__((target("avx2,fma"))) static inline void stats_block_avx2(const double* x, size_t n, double* sum, double* m2, double* min, double* max) {
+	__m256d s0=_mm256_setzero_pd(), s1=s0, s2=s0, s3=s0;
+	__m256d mn=_mm256_set1_pd(INFINITY), mx=_mm256_set1_pd(-INFINITY);
+	size_t i=0;
+	for(; i+16<=n; i+=16) {
+		__m256d a=_mm256_loadu_pd(x+i);
+		__m256d b=_mm256_loadu_pd(x+i+4);
+		__m256d c=_mm256_loadu_pd(x+i+8);
+		__m256d d=_mm256_loadu_pd(x+i+12);
+		s0=_mm256_add_pd(s0, a);
+		s1=_mm256_add_pd(s1, b);
+		s2=_mm256_add_pd(s2, c);
+		s3=_mm256_add_pd(s3, d);
+		mn=_mm256_min_pd(mn, _mm256_min_pd(_mm256_min_pd(a, b), _mm256_min_pd(c, d)));
+		mx=_mm256_max_pd(mx, _mm256_max_pd(_mm256_max_pd(a, b), _mm256_max_pd(c, d)));
+	}
+	double lanes[4], lmn[4], lmx[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3)));
+	_mm256_storeu_pd(lmn, mn);
+	_mm256_storeu_pd(lmx, mx);
+	double su=(lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+	double rmn=INFINITY, rmx=-INFINITY;
+	for(int j=0; j<4; j++) {
+		rmn=lmn[j]<rmn ? lmn[j] : rmn;
+		rmx=lmx[j]>rmx ? lmx[j] : rmx;
+	}
+	for(size_t j=i; j<n; j++) {
+		su+=x[j];
+		rmn=x[j]<rmn ? x[j] : rmn;
+		rmx=x[j]>rmx ? x[j] : rmx;
+	}
+	double mean=su/n;
+	__m256d vmean=_mm256_set1_pd(mean);
+	__m256d q0=_mm256_setzero_pd(), q1=q0, q2=q0, q3=q0;
+	for(i=0; i+16<=n; i+=16) {
+		__m256d a=_mm256_sub_pd(_mm256_loadu_pd(x+i), vmean);
+		__m256d b=_mm256_sub_pd(_mm256_loadu_pd(x+i+4), vmean);
+		__m256d c=_mm256_sub_pd(_mm256_loadu_pd(x+i+8), vmean);
+		__m256d d=_mm256_sub_pd(_mm256_loadu_pd(x+i+12), vmean);
+		q0=_mm256_fmadd_pd(a, a, q0);
+		q1=_mm256_fmadd_pd(b, b, q1);
+		q2=_mm256_fmadd_pd(c, c, q2);
+		q3=_mm256_fmadd_pd(d, d, q3);
+	}
+	_mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(q0, q1), _mm256_add_pd(q2, q3)));
+	double m=(lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+	for(; i<n; i++) {
+		m+=(x[i]-mean)*(x[i]-mean);
+	}
+	*sum=su;
+	*m2=m;
+	*min=rmn;
+	*max=rmx;
+}
+
+// libgcc fills in the cpu model before main(), asking is a load and a test
+static inline int stats_have_avx2(void) {
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+/*
+ * Add a block of values (up to a few thousand so that it stays in the
+ * cache for the second pass)
+ */
+static inline void stats_add_block(stats* s, const double* x, size_t n) {
+	if(n==0) {
+		return;
+	}
+	double sum, m2, mn, mx;
+	if(stats_have_avx2()) {
+		stats_block_avx2(x, n, &sum, &m2, &mn, &mx);
+	} else {
+		stats_block_scalar(x, n, &sum, &m2, &mn, &mx);
+	}
+	for(size_t i=0; i<n; i++) {
+		uint64_t bits;
+		memcpy(&bits, x+i, sizeof(bits));
+		s->hist[bits >> STATS_BUCKET_SHIFT]++;
+	}
+	stats_add_sum(s, sum);
+	stats_merge_moments(s, n, sum/n, m2);
+	s->min=mn<s->min ? mn : s->min;
+	s->max=mx>s->max ? mx : s->max;
+}
+
+static inline void stats_merge(stats* s, const stats* o) {
+	stats_merge_moments(s, o->count, o->mean, o->m2);
+	stats_add_sum(s, o->sum);
+	stats_add_sum(s, o->sum_c);
+	s->min=o->min<s->min ? o->min : s->min;
+	s->max=o->max>s->max ? o->max : s->max;
+	s->skipped+=o->skipped;
+	for(size_t i=0; i<STATS_BUCKETS; i++) {
+		// do not write (and so allocate) the pages of buckets nobody used
+		if(o->hist[i]) {
+			s->hist[i]+=o->hist[i];
+		}
+	}
+}
+
+static inline double stats_sum(const stats* s) {
+	return s->sum+s->sum_c;
+}
+
+// the sample variance
+static inline double stats_variance(const stats* s) {
+	if(s->count<2) {
+		return 0;
+	}
+	return s->m2/(s->count-1);
+}
+
+/*
+ * The value below which a fraction 'q' (0 to 1) of the values are
+ * (nearest rank, within the bucket resolution)
+ */
+static inline double stats_quantile(const stats* s, double q) {
+	if(s->count==0) {
+		return NAN;
+	}
+	uint64_t rank=(uint64_t)(q*(s->count-1));
+	uint64_t seen=0;
+	// negative values first, the most negative has the biggest bucket
+	const uint64_t half=STATS_BUCKETS/2;
+	for(uint64_t k=0; k<STATS_BUCKETS; k++) {
+		uint64_t b=k<half ? STATS_BUCKETS-1-k : k-half;
+		seen+=s->hist[b];
+		if(seen>rank) {
+			// the middle of the bucket
+			uint64_t bits=(b << STATS_BUCKET_SHIFT) | (1ULL << (STATS_BUCKET_SHIFT-1));
+			double v;
+			memcpy(&v, &bits, sizeof(v));
+			if(v<s->min) {
+				return s->min;
+			}
+			if(v>s->max) {
+				return s->max;
+			}
+			return v;
+		}
+	}
+	return s->max;
+}
+
+static inline int stats_is_separator(char c) {
+	return c==' ' || c=='\n' || c=='\t' || c=='\r' || c==',';
+}
+
+/*
+ * Parse the token at 'p' (not a separator). Returns a pointer after the
+ * token, sets *ok to whether it was a number.
+ */
+static inline const char* stats_parse_double(const char* p, const char* end, double* out, int* ok) {
+	static const double pow10[]={
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char* start=p;
+	int neg=0;
+	if(p<end && (*p=='-' || *p=='+')) {
+		neg=*p=='-';
+		p++;
+	}
+	uint64_t mant=0;
+	int digits=0;
+	int frac=0;
+	while(p<end && *p>='0' && *p<='9') {
+		mant=mant*10+(*p-'0');
+		digits++;
+		p++;
+	}
+	if(p<end && *p=='.') {
+		p++;
+		while(p<end && *p>='0' && *p<='9') {
+			mant=mant*10+(*p-'0');
+			digits++;
+			frac++;
+			p++;
+		}
+	}
+	// exactly representable mantissa and power of ten: one correctly rounded division
+	if(digits>0 && digits<=15 && (p==end || stats_is_separator(*p))) {
+		double v=(double)mant/pow10[frac];
+		*out=neg ? -v : v;
+		*ok=1;
+		return p;
+	}
+	// the slow path needs a null terminated copy
+	while(p<end && !stats_is_separator(*p)) {
+		p++;
+	}
+	char buf[128];
+	size_t len=p-start;
+	*ok=0;
+	if(len<sizeof(buf)) {
+		memcpy(buf, start, len);
+		buf[len]='\0';
+		char* e;
+		*out=strtod(buf, &e);
+		*ok=len>0 && *e=='\0';
+	}
+	return p;
+}
+
+typedef struct _stats_job {
+	const char* start;
+	const char* end;
+	// the end of the file, a text number may go on until there
+	const char* limit;
+	stats_format format;
+	stats s;
+} stats_job;
+
+static inline void* stats_worker(void* p) {
+	stats_job* job=(stats_job*)p;
+	stats* s=&job->s;
+	double block[STATS_BLOCK];
+	size_t n=0;
+	if(job->format==STATS_TEXT) {
+		const char* q=job->start;
+		while(q<job->end) {
+			if(stats_is_separator(*q)) {
+				q++;
+				continue;
+			}
+			int ok;
+			// a number which starts in our range is ours even if it ends beyond it
+			q=stats_parse_double(q, job->limit, block+n, &ok);
+			if(ok) {
+				n++;
+				if(n==STATS_BLOCK) {
+					stats_add_block(s, block, n);
+					n=0;
+				}
+			} else {
+				s->skipped++;
+			}
+		}
+		stats_add_block(s, block, n);
+		return NULL;
+	}
+	if(job->format==STATS_F64) {
+		// no copy, the mapping is the block
+		const double* x=(const double*)job->start;
+		size_t count=(job->end-job->start)/sizeof(double);
+		for(size_t i=0; i<count; i+=STATS_BLOCK) {
+			stats_add_block(s, x+i, count-i<STATS_BLOCK ? count-i : STATS_BLOCK);
+		}
+		return NULL;
+	}
+	size_t size=job->format==STATS_F32 ? 4 : 8;
+	size_t count=(job->end-job->start)/size;
+	for(size_t i=0; i<count; i+=STATS_BLOCK) {
+		size_t len=count-i<STATS_BLOCK ? count-i : STATS_BLOCK;
+		// simple loops, the compiler vectorizes the conversions
+		switch(job->format) {
+		case STATS_F32: {
+			const float* x=(const float*)job->start+i;
+			for(size_t j=0; j<len; j++) {
+				block[j]=x[j];
+			}
+			break;
+		}
+		case STATS_I64: {
+			const int64_t* x=(const int64_t*)job->start+i;
+			for(size_t j=0; j<len; j++) {
+				block[j]=x[j];
+			}
+			break;
+		}
+		case STATS_U64: {
+			const uint64_t* x=(const uint64_t*)job->start+i;
+			for(size_t j=0; j<len; j++) {
+				block[j]=x[j];
+			}
+			break;
+		}
+		default:
+			CHECK_ERROR("bad format");
+		}
+		stats_add_block(s, block, len);
+	}
+	return NULL;
+}
+
+static inline stats_format stats_format_parse(const char* name) {
+	if(strcmp(name, "text")==0) {
+		return STATS_TEXT;
+	}
+	if(strcmp(name, "f32")==0) {
+		return STATS_F32;
+	}
+	if(strcmp(name, "f64")==0) {
+		return STATS_F64;
+	}
+	if(strcmp(name, "i64")==0) {
+		return STATS_I64;
+	}
+	if(strcmp(name, "u64")==0) {
+		return STATS_U64;
+	}
+	CHECK_ERROR("unknown format, use text, f32, f64, i64 or u64");
+}
+
+/*
+ * Summarize a whole file into 's' (which stats_init() prepares here)
+ * with 'threads' threads.
+ */
+static inline void stats_file(stats* s, const char* filename, stats_format format, int threads) {
+	CHECK_ASSERT(threads>0 && threads<=STATS_MAX_THREADS);
+	stats_init(s);
+	int fd=CHECK_NOT_M1(open(filename, O_RDONLY));
+	struct stat st;
+	CHECK_NOT_M1(fstat(fd, &st));
+	size_t size=st.st_size;
+	if(size==0) {
+		CHECK_NOT_M1(close(fd));
+		return;
+	}
+	const char* data=(const char*)CHECK_NOT_VOIDP(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0), MAP_FAILED);
+	CHECK_NOT_M1(madvise((void*)data, size, MADV_SEQUENTIAL));
+	const char* end=data+size;
+	// binary ranges are whole elements, text ranges start after a separator
+	size_t unit=format==STATS_TEXT ? 1 : format==STATS_F32 ? 4 : 8;
+	size_t elements=size/unit;
+	stats_job* jobs=(stats_job*)CHECK_NOT_NULL(calloc(threads, sizeof(stats_job)));
+	pthread_t tids[STATS_MAX_THREADS];
+	for(int i=0; i<threads; i++) {
+		stats_job* job=jobs+i;
+		job->start=data+elements*i/threads*unit;
+		job->end=data+elements*(i+1)/threads*unit;
+		job->limit=end;
+		job->format=format;
+		stats_init(&job->s);
+	}
+	if(format==STATS_TEXT) {
+		for(int i=1; i<threads; i++) {
+			const char* p=jobs[i].start;
+			while(p>data && p<end && !stats_is_separator(p[-1])) {
+				p++;
+			}
+			jobs[i].start=p;
+			jobs[i-1].end=p;
+		}
+	}
+	for(int i=0; i<threads; i++) {
+		CHECK_ZERO_ERRNO(pthread_create(tids+i, NULL, stats_worker, jobs+i));
+	}
+	for(int i=0; i<threads; i++) {
+		CHECK_ZERO_ERRNO(pthread_join(tids[i], NULL));
+		stats_merge(s, &jobs[i].s);
+		stats_free(&jobs[i].s);
+	}
+	free(jobs);
+	CHECK_NOT_M1(munmap((void*)data, size));
+	CHECK_NOT_M1(close(fd));
+}
+
+#endif	/* !__stats_utils_h */
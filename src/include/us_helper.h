@@ -175,6 +175,25 @@ static inline int syscall_getdents(unsigned int fd, struct linux_dirent *dirp, u
 	return syscall(SYS_getdents, fd, dirp, count);
 }
 
+/*
+ * Type struct linux_dirent64 which is taken from getdents(2) manpage,
+ * this one has the file type in d_type
+ */
+struct linux_dirent64 {
+	unsigned long d_ino;	/* 64-bit inode number */
+	long d_off;	/* 64-bit offset to next structure */
+	unsigned short d_reclen;/* Size of this dirent */
+	unsigned char d_type;	/* File type */
+	char d_name[];	/* Filename (null-terminated) */
+};
+
+/*
+ * Wrapper for the getdents64(2) system call (glibc has one only since 2.30)
+ */
+static inline int syscall_getdents64(unsigned int fd, struct linux_dirent64 *dirp, unsigned int count) {
+	return syscall(SYS_getdents64, fd, dirp, count);
+}
+
 /*
  * Wrapper for the readdir(2) system call which is not supplied by glibc
  * This is surrounded by #ifdef because on 64bit I had problems locating
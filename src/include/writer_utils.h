@@ -0,0 +1,199 @@
+/*
+ * This file is part of the demos-linux package.
+ * Copyright (C) 2011-2021 Mark Veltzer <mark.veltzer@gmail.com>
+ *
+ * demos-linux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * demos-linux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with demos-linux. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __writer_utils_h
+#define __writer_utils_h
+
+/*
+ * Sequential writers with predictable latency.
+ *
+ * A plain write(2) loop is fast as long as it only copies into the page
+ * cache and then, when the dirty pages reach the dirty limits
+ * (vm.dirty_ratio, vm.dirty_bytes), the writer is throttled in
+ * balance_dirty_pages() and a write takes tens or hundreds of
+ * milliseconds. The modes here:
+ * - WRITER_NAIVE: that loop.
+ * - WRITER_PACED: start the writeback of every chunk as soon as it is
+ * written (sync_file_range(2) SYNC_FILE_RANGE_WRITE, which does not
+ * wait) and wait for the chunk before it, so there are never more than
+ * two chunks of dirty data and the kernel never has to throttle. The
+ * pages which were written back are dropped (POSIX_FADV_DONTNEED) so the
+ * writer does not fill the page cache either.
+ * - WRITER_DSYNC: O_DSYNC, every write returns when it is on the device.
+ * - WRITER_GROUP: group commit, fdatasync(2) once every group_bytes, all
+ * the writes of a group become durable together for the price of one
+ * flush.
+ * All modes but WRITER_NAIVE preallocate the file with fallocate(2)
+ * ahead of the writer (if the file system can) which avoids block
+ * allocation in the write path and gives a contiguous file.
+ *
+ * Notes:
+ * - sync_file_range(2) does not flush the disk cache nor the metadata,
+ * WRITER_PACED is about latency, not durability.
+ *
+ * References:
+ * https://lwn.net/Articles/682582/
+ * man 2 sync_file_range (and the thread of Linus Torvalds about it)
+ */
+
+/* THIS IS A C FILE, NO C++ here */
+
+#include <firstinclude.h>
+#include <sys/types.h>	// for off_t, ssize_t
+#include <fcntl.h>	// for open(2), sync_file_range(2), fallocate(2), posix_fadvise(2)
+#include <unistd.h>	// for write(2), fdatasync(2), ftruncate(2), close(2)
+#include <errno.h>	// for errno, EOPNOTSUPP
+#include <string.h>	// for strcmp(3)
+#include <err_utils.h>	// for CHECK_NOT_M1(), CHECK_ZERO_ERRNO(), CHECK_ERROR()
+
+typedef enum _writer_mode {
+	WRITER_NAIVE,
+	WRITER_PACED,
+	WRITER_DSYNC,
+	WRITER_GROUP,
+	WRITER_MODES,
+} writer_mode;
+
+static const char* writer_mode_names[WRITER_MODES]={
+	"naive", "paced", "dsync", "group",
+};
+
+static inline writer_mode writer_mode_parse(const char* name) {
+	for(int m=0; m<WRITER_MODES; m++) {
+		if(strcmp(name, writer_mode_names[m])==0) {
+			return (writer_mode)m;
+		}
+	}
+	CHECK_ERROR("unknown writer mode");
+	return WRITER_NAIVE;
+}
+
+typedef struct _writer_cfg {
+	writer_mode mode;
+	// the writeback unit of WRITER_PACED
+	size_t chunk;
+	// the fallocate(2) step, 0 for none
+	size_t prealloc;
+	// drop the pages that are written back (WRITER_PACED)
+	int drop;
+	// the group size of WRITER_GROUP
+	size_t group_bytes;
+} writer_cfg;
+
+static inline void writer_cfg_init(writer_cfg* cfg, writer_mode mode) {
+	cfg->mode=mode;
+	cfg->chunk=8*1024*1024;
+	cfg->prealloc=mode==WRITER_NAIVE ? 0 : 64*1024*1024;
+	cfg->drop=1;
+	cfg->group_bytes=1024*1024;
+}
+
+typedef struct _writer {
+	int fd;
+	writer_cfg cfg;
+	// the write head
+	off_t off;
+	// writeback was started for everything below this
+	off_t submitted;
+	// preallocated up to here
+	off_t allocated;
+	// fdatasync(2) was done for everything below this
+	off_t synced;
+} writer;
+
+static inline void writer_open(writer* w, const char* filename, const writer_cfg* cfg) {
+	w->cfg=*cfg;
+	int flags=O_WRONLY | O_CREAT | O_TRUNC;
+	if(cfg->mode==WRITER_DSYNC) {
+		flags|=O_DSYNC;
+	}
+	w->fd=CHECK_NOT_M1(open(filename, flags, 0666));
+	w->off=0;
+	w->submitted=0;
+	w->allocated=0;
+	w->synced=0;
+}
+
+static inline void writer_prealloc(writer* w, off_t end) {
+	while(w->cfg.prealloc>0 && end>w->allocated) {
+		// KEEP_SIZE: the size of the file is still what was written
+		if(fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->allocated, w->cfg.prealloc)==-1) {
+			if(errno==EOPNOTSUPP) {
+				w->cfg.prealloc=0;
+				return;
+			}
+			CHECK_NOT_M1(-1);
+		}
+		w->allocated+=w->cfg.prealloc;
+	}
+}
+
+/*
+ * Start the writeback of the chunks behind the head, wait for the one
+ * before them and drop it
+ */
+static inline void writer_pace(writer* w) {
+	const off_t chunk=w->cfg.chunk;
+	while(w->off-w->submitted>=chunk) {
+		CHECK_NOT_M1(sync_file_range(w->fd, w->submitted, chunk, SYNC_FILE_RANGE_WRITE));
+		if(w->submitted>=chunk) {
+			off_t prev=w->submitted-chunk;
+			CHECK_NOT_M1(sync_file_range(w->fd, prev, chunk, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER));
+			if(w->cfg.drop) {
+				CHECK_ZERO_ERRNO(posix_fadvise(w->fd, prev, chunk, POSIX_FADV_DONTNEED));
+			}
+		}
+		w->submitted+=chunk;
+	}
+}
+
+static inline void writer_write(writer* w, const void* buf, size_t len) {
+	writer_prealloc(w, w->off+len);
+	size_t done=0;
+	while(done<len) {
+		done+=CHECK_NOT_M1(write(w->fd, (const char*)buf+done, len-done));
+	}
+	w->off+=len;
+	switch(w->cfg.mode) {
+	case WRITER_PACED:
+		writer_pace(w);
+		break;
+	case WRITER_GROUP:
+		if(w->off-w->synced>=(off_t)w->cfg.group_bytes) {
+			CHECK_NOT_M1(fdatasync(w->fd));
+			w->synced=w->off;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Everything written is durable when this returns
+ */
+static inline void writer_close(writer* w) {
+	CHECK_NOT_M1(fdatasync(w->fd));
+	// give back the preallocation beyond the end, truncating to the size we have frees it
+	if(w->allocated>w->off) {
+		CHECK_NOT_M1(ftruncate(w->fd, w->off));
+	}
+	CHECK_NOT_M1(close(w->fd));
+}
+
+#endif	/* !__writer_utils_h */